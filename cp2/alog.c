@@ -0,0 +1,241 @@
+/*
+ * alog.c
+ *
+ * Description: This file defines the binary access log of Liso server. Every
+ *              request leaves one fixed-size record (alog.h), filled in
+ *              place: either in a buffer that is written out when it is
+ *              full or a second old, or, with use_mmap, straight in the
+ *              file through a mapped window of ALOG_MAP bytes, which the
+ *              kernel writes back by itself. Each worker has a file of its
+ *              own, so records are never interleaved. A record's total time
+ *              is set once the response is sent, by then it may be written
+ *              out already; records are fixed-size, so it is found by its
+ *              slot in the file.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "params.h"
+#include "alog.h"
+#include "log.h"
+
+static struct
+{
+    int    fd;                  // -1 without an access log
+    int    use_mmap;
+    alog_rec_t *recs;           // the buffer, or the mapped window
+    size_t cap;                 // records that fit in recs
+    size_t n;                   // records used in recs
+    off_t  win;                 // file offset of recs[0]
+    time_t oldest;              // buffered: when recs[0] was handed out
+} al = { .fd = -1 };
+
+static int  next_window();
+static int  write_buffer();
+static void fail(const char *what);
+
+/******************************************************************************
+* subroutine: alog_open                                                       *
+* purpose:    create the access log file and write its header                 *
+* parameters: path     - the file, truncated if it exists                     *
+*             worker   - number of the worker writing it                      *
+*             use_mmap - 1 to write through a mapping, 0 through a buffer     *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int alog_open(const char *path, int worker, int use_mmap)
+{
+    alog_hdr_t hdr;
+
+    if ((al.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, ALOG_MAGIC, sizeof hdr.magic);
+    hdr.version = ALOG_VERSION;
+    hdr.rec_size = sizeof(alog_rec_t);
+    hdr.worker = worker;
+
+    al.use_mmap = use_mmap;
+    al.win = 0;
+    al.n = al.cap = 0;
+    if (use_mmap)
+    {
+        // the header is the first slot of the first window
+        if (next_window() < 0)
+            return -1;
+        memcpy(&al.recs[al.n++], &hdr, sizeof hdr);
+        return 0;
+    }
+
+    if (write(al.fd, &hdr, sizeof hdr) != sizeof hdr ||
+        (al.recs = malloc(ALOG_BUF)) == NULL)
+    {
+        close(al.fd);
+        al.fd = -1;
+        return -1;
+    }
+    al.win = sizeof hdr;
+    al.cap = ALOG_BUF / sizeof(alog_rec_t);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: alog_next                                                       *
+* purpose:    hand out the next record, zeroed, for the caller to fill in     *
+*             before the next call                                            *
+* parameters: slot - set to the record's slot in the file, for alog_finish()  *
+* return:     the record, NULL without an access log                          *
+******************************************************************************/
+alog_rec_t *alog_next(uint64_t *slot)
+{
+    alog_rec_t *rec;
+
+    if (al.fd < 0)
+        return NULL;
+    if (al.n == al.cap && (al.use_mmap ? next_window() : write_buffer()) < 0)
+        return NULL;
+
+    if (al.n == 0 && !al.use_mmap)
+        al.oldest = time(NULL);
+    *slot = al.win / sizeof(alog_rec_t) + al.n;
+    rec = &al.recs[al.n++];
+    memset(rec, 0, sizeof *rec);
+    return rec;
+}
+
+/******************************************************************************
+* subroutine: alog_finish                                                     *
+* purpose:    set the total time of a record handed out before, in place or,  *
+*             once it has been written out, in the file                       *
+* parameters: slot     - the record's slot, 0 (the header's) for none         *
+*             total_us - request start to its response sent                   *
+* return:     none                                                            *
+******************************************************************************/
+void alog_finish(uint64_t slot, uint32_t total_us)
+{
+    uint64_t first = al.win / sizeof(alog_rec_t);
+
+    if (al.fd < 0 || slot == 0)
+        return;
+
+    if (slot >= first && slot < first + al.n)
+    {
+        al.recs[slot - first].total_us = total_us;
+        return;
+    }
+    if (pwrite(al.fd, &total_us, sizeof total_us, slot * sizeof(alog_rec_t) +
+               offsetof(alog_rec_t, total_us)) != sizeof total_us)
+        fail("updating");
+}
+
+/* called about once a second: write out records buffered for a second */
+void alog_tick()
+{
+    if (al.fd >= 0 && !al.use_mmap && al.n > 0 &&
+        time(NULL) - al.oldest >= ALOG_FLUSH_SEC)
+        write_buffer();
+}
+
+/******************************************************************************
+* subroutine: alog_close                                                      *
+* purpose:    write out what is left and close the file. A mapped file is cut *
+*             back to the records actually used                               *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void alog_close()
+{
+    if (al.fd < 0)
+        return;
+
+    if (al.use_mmap)
+    {
+        munmap(al.recs, ALOG_MAP);
+        if (ftruncate(al.fd, al.win + al.n * sizeof(alog_rec_t)) < 0)
+            Log("Error: failed truncating the access log: %s \n", strerror(errno));
+    }
+    else if (write_buffer() == 0)
+        free(al.recs);
+    if (al.fd >= 0)
+        close(al.fd);
+    al.fd = -1;
+    al.recs = NULL;
+}
+
+/* microseconds since the epoch, what records are timed with */
+uint64_t alog_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* map the next ALOG_MAP bytes of the file, growing it first */
+static int next_window()
+{
+    void *map;
+
+    if (al.recs)
+    {
+        munmap(al.recs, ALOG_MAP);
+        al.recs = NULL;
+        al.win += ALOG_MAP;
+    }
+    al.n = al.cap = 0;
+
+    if (ftruncate(al.fd, al.win + ALOG_MAP) < 0 ||
+        (map = mmap(NULL, ALOG_MAP, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    al.fd, al.win)) == MAP_FAILED)
+    {
+        fail("mapping");
+        return -1;
+    }
+    al.recs = map;
+    al.cap = ALOG_MAP / sizeof(alog_rec_t);
+    return 0;
+}
+
+/* write the buffered records to the file */
+static int write_buffer()
+{
+    char *buf = (char *)al.recs;
+    size_t len = al.n * sizeof(alog_rec_t);
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = write(al.fd, buf, len)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fail("writing");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    al.win += al.n * sizeof(alog_rec_t);
+    al.n = 0;
+    return 0;
+}
+
+/* stop logging accesses after an error, the server goes on */
+static void fail(const char *what)
+{
+    Log("Error: %s the access log failed, no more records: %s \n",
+        what, strerror(errno));
+    if (!al.use_mmap)
+        free(al.recs);
+    else if (al.recs)
+        munmap(al.recs, ALOG_MAP);
+    al.recs = NULL;
+    close(al.fd);
+    al.fd = -1;
+}
@@ -0,0 +1,53 @@
+#ifndef _ALOG_H_
+#define _ALOG_H_
+
+#include <stdint.h>
+
+/* the access log is a header followed by one fixed-size record per request,
+ * in native byte order; lisod-logdump turns it into text */
+#define ALOG_MAGIC "LISOALOG"
+#define ALOG_VERSION 1
+#define ALOG_URI 80
+
+/* methods, ALOG_OTHER for the ones we do not implement */
+enum { ALOG_OTHER, ALOG_GET, ALOG_HEAD, ALOG_POST };
+
+/* record flags */
+#define ALOG_SECURE 1           // came in on the HTTPS port
+#define ALOG_CUT    2           // the uri was longer than ALOG_URI
+
+typedef struct
+{
+    char     magic[8];          // ALOG_MAGIC, not terminated
+    uint32_t version;
+    uint32_t rec_size;          // sizeof(alog_rec_t)
+    uint32_t worker;            // worker that wrote the file
+    uint32_t pad[27];           // the header takes the place of a record
+} alog_hdr_t;
+
+typedef struct
+{
+    uint64_t start;             // request start, microseconds since the epoch
+    uint32_t head_us;           // start to request head parsed, 0 if never
+    uint32_t total_us;          // start to response sent, 0 until then
+    uint64_t bytes;             // response bytes queued, headers included
+    uint8_t  addr[16];          // client address, IPv4 mapped into IPv6
+    uint16_t status;            // 0 if the request got no response
+    uint8_t  method;            // ALOG_GET, ...
+    uint8_t  flags;             // ALOG_SECURE, ALOG_CUT
+    uint8_t  uri_len;           // bytes of uri used
+    uint8_t  pad[3];
+    char     uri[ALOG_URI];     // not terminated
+} alog_rec_t;
+
+_Static_assert(sizeof(alog_rec_t) == 128, "access log record layout");
+_Static_assert(sizeof(alog_hdr_t) == sizeof(alog_rec_t), "access log header");
+
+int  alog_open(const char *path, int worker, int use_mmap);
+alog_rec_t *alog_next(uint64_t *slot);
+void alog_finish(uint64_t slot, uint32_t total_us);
+void alog_tick();
+void alog_close();
+uint64_t alog_now();
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * arena.c
+ *
+ * Description: This file defines the per-connection arena of Liso server,
+ *              a bump allocator over a pooled buffer that the request being
+ *              served takes its memory from.
+ *
+ */
+#include <stdlib.h>
+#include "arena.h"
+#include "bufpool.h"
+
+/* every block is aligned for any of the request's structures */
+#define ARENA_ALIGN 16
+
+/******************************************************************************
+* subroutine: arena_init                                                      *
+* purpose:    make an arena empty, for a new connection                       *
+* parameters: a - the arena                                                   *
+* return:     none                                                            *
+******************************************************************************/
+void arena_init(arena_t *a)
+{
+    a->used = a->size = 0;
+    a->buf = NULL;
+    a->spill = NULL;
+}
+
+/******************************************************************************
+* subroutine: arena_alloc                                                     *
+* purpose:    hand out uninitialized memory that lives until the next reset   *
+* parameters: a   - the arena                                                 *
+*             len - number of bytes                                           *
+* return:     the memory, NULL if it had to come from the heap and that failed*
+******************************************************************************/
+void *arena_alloc(arena_t *a, size_t len)
+{
+    void **block;
+    char *ptr;
+
+    len = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    // the request has been read already, so it gets its buffer at the cap
+    if (a->buf == NULL && (a->buf = bufpool_get(ARENA_SIZE, &a->size, 1)) == NULL)
+        a->size = 0;
+    if (len <= a->size - a->used)
+    {
+        ptr = a->buf + a->used;
+        a->used += len;
+        return ptr;
+    }
+
+    // rare: a huge head or a long path. The link goes in front of the block
+    if ((block = malloc(ARENA_ALIGN + len)) == NULL)
+        return NULL;
+    *block = a->spill;
+    a->spill = block;
+    return (char *)block + ARENA_ALIGN;
+}
+
+/******************************************************************************
+* subroutine: arena_reset                                                     *
+* purpose:    take back everything handed out since the last reset            *
+* parameters: a - the arena                                                   *
+* return:     none                                                            *
+******************************************************************************/
+void arena_reset(arena_t *a)
+{
+    void **block;
+
+    while ((block = a->spill) != NULL)
+    {
+        a->spill = *block;
+        free(block);
+    }
+    if (a->buf)
+        bufpool_put(a->buf, a->size);
+    a->buf = NULL;
+    a->used = a->size = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include "params.h"
+
+/* scratch memory of one connection for the request being served. It is
+ * handed out front to back and reset in one go once the request is done, so
+ * nothing is freed (or zeroed) piece by piece. The buffer comes from the
+ * buffer pool with the first allocation and goes back with the reset; what
+ * does not fit in it comes from the heap and is freed by the reset */
+typedef struct
+{
+    size_t used;                // bytes of buf handed out
+    size_t size;                // size of buf
+    char  *buf;                 // NULL between requests
+    void  *spill;               // heap blocks, linked through their first word
+} arena_t;
+
+void  arena_init(arena_t *a);
+void *arena_alloc(arena_t *a, size_t len);
+void  arena_reset(arena_t *a);
+
+#endif
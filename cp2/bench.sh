@@ -0,0 +1,39 @@
+#!/bin/sh
+################################################################################
+# bench.sh                                                                     #
+#                                                                              #
+# Description: This file runs the load scenarios of make bench: it starts a    #
+#              lisod on a free port with the www folder, drives it with        #
+#              lisoload and stops it. LISOD_OPTS passes options to lisod,      #
+#              BENCH_SECS sets the length of each run.                         #
+#                                                                              #
+# Usage:       ./bench.sh                                                      #
+# example:     LISOD_OPTS="-w 4" BENCH_SECS=10 ./bench.sh                      #
+################################################################################
+
+SECS=${BENCH_SECS:-5}
+PORT=${BENCH_PORT:-18480}
+TMP=$(mktemp -d /tmp/lisobench.XXXXXX)
+
+./lisod $LISOD_OPTS $PORT $((PORT + 1)) $TMP/lisod.log $TMP/lisod.lock www \
+    cgi key cert &
+PID=$!
+trap 'kill $PID 2>/dev/null; wait $PID 2>/dev/null; rm -rf $TMP' EXIT INT TERM
+sleep 1
+
+run()
+{
+    echo "== $1"
+    shift
+    ./lisoload -d $SECS -w 1 "$@" 127.0.0.1 $PORT || STATUS=1
+    echo
+}
+
+STATUS=0
+run "1 connection"                  -c 1
+run "100 connections"               -c 100 -t 2
+run "100 connections, depth 8"      -c 100 -t 2 -p 8
+run "1000 connections"              -c 1000 -t 4
+run "open loop, 20000 req/s"        -c 200 -t 2 -r 20000
+run "uri mix, 100 connections"      -c 100 -t 2 -f bench.mix
+exit $STATUS
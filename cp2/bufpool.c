@@ -0,0 +1,164 @@
+/*
+ * bufpool.c
+ *
+ * Description: This file defines the buffer pool of Liso server, which the
+ *              read and write buffers of the connections come from. A
+ *              connection holds buffers only while it has bytes to parse or
+ *              to send, so an idle keep-alive connection costs no more than
+ *              its slot. Returned buffers are kept on a free list per size
+ *              class for the next connection, within a small budget. All
+ *              buffers count against a byte cap: at the cap, a connection
+ *              that would start reading gets nothing and waits, while the
+ *              ones already being served are always given memory to finish
+ *              and give it back.
+ *
+ */
+#include <stdlib.h>
+#include "params.h"
+#include "bufpool.h"
+
+#define NCLASSES 5              // BUF_CLASS_MIN << 0 .. BUF_CLASS_MIN << 4
+
+/* a free buffer, linked through its first bytes */
+typedef struct fbuf
+{
+    struct fbuf *next;
+} fbuf_t;
+
+static struct
+{
+    size_t  cap;                // most bytes allocated at once
+    size_t  free_bytes;         // bytes on the free lists
+    fbuf_t *free[NCLASSES];     // free buffers of each class
+    bufpool_stats_t stats;
+} bp;
+
+static int  class_of(size_t len);
+static void trim(size_t need);
+
+/******************************************************************************
+* subroutine: bufpool_init                                                    *
+* purpose:    set up an empty pool                                            *
+* parameters: cap - most bytes of buffers allocated at once                   *
+* return:     none                                                            *
+******************************************************************************/
+void bufpool_init(size_t cap)
+{
+    bp.cap = cap;
+}
+
+/******************************************************************************
+* subroutine: bufpool_get                                                     *
+* purpose:    hand out a buffer of at least len bytes, from the free list of  *
+*             its class if there is one                                       *
+* parameters: len   - bytes needed                                            *
+*             size  - where to put the size of the buffer, which is what it   *
+*                     is given back with                                      *
+*             force - 1 to go over the cap rather than fail                   *
+* return:     the buffer, NULL at the cap or out of memory                    *
+******************************************************************************/
+char *bufpool_get(size_t len, size_t *size, int force)
+{
+    int k = class_of(len);
+    size_t n = k < 0 ? len : (size_t)BUF_CLASS_MIN << k;
+    fbuf_t *buf;
+
+    bp.stats.gets++;
+    if (k >= 0 && (buf = bp.free[k]) != NULL)
+    {
+        bp.free[k] = buf->next;
+        bp.free_bytes -= n;
+        bp.stats.reuses++;
+        bp.stats.in_use += n;
+        *size = n;
+        return (char *)buf;
+    }
+
+    // the free buffers of the other classes make room first
+    if (bp.stats.bytes + n > bp.cap)
+        trim(n);
+    if (bp.stats.bytes + n > bp.cap && !force)
+    {
+        bp.stats.refusals++;
+        return NULL;
+    }
+
+    if ((buf = malloc(n)) == NULL)
+        return NULL;
+    bp.stats.bytes += n;
+    bp.stats.in_use += n;
+    if (bp.stats.bytes > bp.stats.peak)
+        bp.stats.peak = bp.stats.bytes;
+    *size = n;
+    return (char *)buf;
+}
+
+/******************************************************************************
+* subroutine: bufpool_put                                                     *
+* purpose:    give a buffer back. It is kept for reuse unless the free lists  *
+*             are over their budget or the pool is over the cap               *
+* parameters: buf  - the buffer                                               *
+*             size - its size as bufpool_get() returned it, or the length it  *
+*                    was asked for                                            *
+* return:     none                                                            *
+******************************************************************************/
+void bufpool_put(char *buf, size_t size)
+{
+    int k = class_of(size);
+
+    if (k >= 0)
+        size = (size_t)BUF_CLASS_MIN << k;
+    bp.stats.in_use -= size;
+    if (k >= 0 && bp.free_bytes + size <= BUF_KEEP && bp.stats.bytes <= bp.cap)
+    {
+        ((fbuf_t *)buf)->next = bp.free[k];
+        bp.free[k] = (fbuf_t *)buf;
+        bp.free_bytes += size;
+        return;
+    }
+    free(buf);
+    bp.stats.bytes -= size;
+}
+
+/* no buffer for a connection that would start reading */
+int bufpool_full()
+{
+    return bp.stats.in_use + BUF_CLASS_MIN > bp.cap;
+}
+
+void bufpool_stats(bufpool_stats_t *stats)
+{
+    *stats = bp.stats;
+}
+
+/* the smallest class a buffer of len bytes fits in, -1 if none does */
+static int class_of(size_t len)
+{
+    int k;
+
+    for (k = 0; k < NCLASSES; k++)
+        if (len <= (size_t)BUF_CLASS_MIN << k)
+            return k;
+    return -1;
+}
+
+/* free unused buffers, the largest first, until need more bytes fit under
+ * the cap or there are none left */
+static void trim(size_t need)
+{
+    fbuf_t *buf;
+    size_t n;
+    int k;
+
+    for (k = NCLASSES - 1; k >= 0 && bp.stats.bytes + need > bp.cap; k--)
+    {
+        n = (size_t)BUF_CLASS_MIN << k;
+        while ((buf = bp.free[k]) != NULL && bp.stats.bytes + need > bp.cap)
+        {
+            bp.free[k] = buf->next;
+            bp.free_bytes -= n;
+            bp.stats.bytes -= n;
+            free(buf);
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <stddef.h>
+
+/* buffers come in five power-of-two size classes, from BUF_CLASS_MIN
+ * (params.h, 4 KB) to 16 times that. A larger buffer is allocated to size
+ * and freed when it is returned */
+
+/* counters of the buffer pool */
+typedef struct
+{
+    size_t bytes;               // bytes allocated, handed out or free
+    size_t peak;                // most bytes allocated at once
+    size_t in_use;              // bytes handed out
+    unsigned long gets;
+    unsigned long reuses;       // gets served from a free list
+    unsigned long refusals;     // gets refused at the cap
+} bufpool_stats_t;
+
+void  bufpool_init(size_t cap);
+char *bufpool_get(size_t len, size_t *size, int force);
+void  bufpool_put(char *buf, size_t size);
+int   bufpool_full();
+void  bufpool_stats(bufpool_stats_t *stats);
+
+#endif
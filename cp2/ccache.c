@@ -0,0 +1,413 @@
+/*
+ * ccache.c
+ *
+ * Description: This file defines the in-memory content cache of Liso server.
+ *              Small files are kept as ready-to-send blocks (header block
+ *              plus body) within a total byte budget. Eviction follows
+ *              S3-FIFO: new files enter a small FIFO queue that takes about
+ *              a tenth of the budget, and only the ones read again while
+ *              there move on to the main queue, so a scan over many cold
+ *              files cannot flush the hot ones. Files dropped from the small
+ *              queue are remembered in a ghost queue (key only) and go
+ *              straight to the main queue when they come back. The main
+ *              queue is a FIFO where entries read since their last pass are
+ *              reinserted instead of evicted.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ccache.h"
+
+#define FREQ_MAX  3             // access counts saturate here
+#define GHOST_MIN 64            // ghost queue length when the cache is small
+#define BUCKETS   1024          // initial hash table size
+
+/* the queues of S3-FIFO */
+enum { CQ_SMALL, CQ_MAIN, CQ_GHOST, CQ_NUM };
+
+/* one cached (or recently evicted) file */
+typedef struct centry
+{
+    char  *path;                // resolved path, the lookup key
+    unsigned hash;              // hash of path, the same as the file cache's
+    int    queue;               // CQ_SMALL, CQ_MAIN or CQ_GHOST
+    int    freq;                // reads since insertion or the last pass
+    dev_t  dev;                 // identity of the cached version of the file
+    ino_t  ino;
+    time_t mtime;
+    off_t  size;
+    cblock_t *blk;              // the response, NULL for ghosts
+    struct centry *hnext;       // next entry in the same hash bucket
+    struct centry *prev;        // neighbours in the queue, which runs from
+    struct centry *next;        // oldest to newest
+} centry_t;
+
+typedef struct
+{
+    centry_t *head;             // oldest, evicted first
+    centry_t *tail;             // newest
+    size_t bytes;               // sum of blk->len
+    int    count;
+} cqueue_t;
+
+static struct
+{
+    centry_t **buckets;         // hash table, nbuckets is a power of two
+    unsigned nbuckets;
+    int      nentries;          // entries in the table, ghosts included
+    size_t   budget;            // bytes the small and main queues may hold
+    size_t   max_file;          // larger files are never cached
+    cqueue_t q[CQ_NUM];
+    ccache_stats_t stats;
+} cache;
+
+static centry_t *find_entry(unsigned hash, const char *path);
+static int  hash_insert(centry_t *e);
+static void remove_entry(centry_t *e);
+static void evict();
+static void evict_small();
+static void evict_main();
+static void q_push(int queue, centry_t *e);
+static void q_unlink(centry_t *e);
+
+/******************************************************************************
+* subroutine: ccache_init                                                     *
+* purpose:    set up an empty cache                                           *
+* parameters: budget   - total bytes of cached responses, 0 disables caching  *
+*             max_file - largest file that is cached                          *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int ccache_init(size_t budget, size_t max_file)
+{
+    memset(&cache, 0, sizeof cache);
+    cache.budget = budget;
+    cache.max_file = max_file;
+    cache.nbuckets = BUCKETS;
+    if ((cache.buckets = calloc(cache.nbuckets, sizeof(centry_t *))) == NULL)
+        return -1;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: ccache_admits                                                   *
+* purpose:    tell if a file of this size would be cached                     *
+* parameters: size - the file size                                            *
+* return:     1 if so, 0 if not                                               *
+******************************************************************************/
+int ccache_admits(off_t size)
+{
+    return cache.budget > 0 && size <= cache.max_file;
+}
+
+/******************************************************************************
+* subroutine: ccache_get                                                      *
+* purpose:    look up the cached response for a file. A block cached from an  *
+*             older version of the file is dropped                            *
+* parameters: file - the file, freshly validated by the file cache            *
+* return:     the block with a reference held for the caller (drop it with    *
+*             ccache_put), NULL on a miss or if the file is not cacheable     *
+******************************************************************************/
+cblock_t *ccache_get(fentry_t *file)
+{
+    centry_t *e;
+
+    if (!ccache_admits(file->size))
+        return NULL;
+
+    e = find_entry(file->hash, file->path);
+    if (e && e->queue != CQ_GHOST &&
+        (e->dev != file->dev || e->ino != file->ino ||
+         e->mtime != file->mtime || e->size != file->size))
+    {
+        remove_entry(e);
+        e = NULL;
+    }
+
+    if (e == NULL || e->queue == CQ_GHOST)
+    {
+        cache.stats.misses++;
+        return NULL;
+    }
+
+    if (e->freq < FREQ_MAX)
+        e->freq++;
+    cache.stats.hits++;
+    ccache_hold(e->blk);
+    return e->blk;
+}
+
+/******************************************************************************
+* subroutine: ccache_alloc                                                    *
+* purpose:    make a new block for a file and copy its header block in. The   *
+*             caller reads the body to data + hdr_len and then passes the     *
+*             block to ccache_insert()                                        *
+* parameters: file    - the file, ccache_get() just missed it                 *
+*             hdr     - header block, from Server: down to the empty line     *
+*             hdr_len - length of hdr                                         *
+* return:     the block with the caller's reference, NULL if the file cannot  *
+*             be cached                                                       *
+******************************************************************************/
+cblock_t *ccache_alloc(fentry_t *file, const char *hdr, size_t hdr_len)
+{
+    cblock_t *blk;
+    size_t len = hdr_len + file->size;
+
+    if (!ccache_admits(file->size) || len > cache.budget)
+        return NULL;
+
+    if ((blk = malloc(sizeof(cblock_t) + len)) == NULL)
+        return NULL;
+    blk->refs = 1;
+    blk->hdr_len = hdr_len;
+    blk->len = len;
+    memcpy(blk->data, hdr, hdr_len);
+    return blk;
+}
+
+/******************************************************************************
+* subroutine: ccache_insert                                                   *
+* purpose:    cache a filled block, evicting older entries to stay within the *
+*             budget. The cache takes its own reference                       *
+* parameters: file - the file the block was read from                         *
+*             blk  - the block                                                *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int ccache_insert(fentry_t *file, cblock_t *blk)
+{
+    centry_t *e;
+    int queue = CQ_SMALL;
+
+    e = find_entry(file->hash, file->path);
+    if (e && e->queue == CQ_GHOST)
+    {
+        // evicted too early last time, it has earned a place in main
+        cache.stats.ghost_hits++;
+        q_unlink(e);
+        queue = CQ_MAIN;
+    }
+    else if (e)
+    {
+        // read by another request meanwhile, or an older version
+        remove_entry(e);
+        e = NULL;
+    }
+
+    if (e == NULL)
+    {
+        if ((e = calloc(1, sizeof(centry_t))) == NULL ||
+            (e->path = strdup(file->path)) == NULL)
+        {
+            free(e);
+            return -1;
+        }
+        e->hash = file->hash;
+        if (hash_insert(e) < 0)
+        {
+            free(e->path);
+            free(e);
+            return -1;
+        }
+    }
+
+    e->freq = 0;
+    e->dev = file->dev;
+    e->ino = file->ino;
+    e->mtime = file->mtime;
+    e->size = file->size;
+    e->blk = blk;
+    ccache_hold(blk);
+    q_push(queue, e);
+    cache.stats.inserts++;
+
+    evict();
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: ccache_hold                                                     *
+* purpose:    take one more reference to a block                              *
+* parameters: blk - the block                                                 *
+* return:     none                                                            *
+******************************************************************************/
+void ccache_hold(cblock_t *blk)
+{
+    blk->refs++;
+}
+
+/******************************************************************************
+* subroutine: ccache_put                                                      *
+* purpose:    drop a reference, the block is freed with the last one          *
+* parameters: blk - the block                                                 *
+* return:     none                                                            *
+******************************************************************************/
+void ccache_put(cblock_t *blk)
+{
+    if (--blk->refs == 0)
+        free(blk);
+}
+
+/******************************************************************************
+* subroutine: ccache_stats                                                    *
+* purpose:    read the cache counters                                         *
+* parameters: stats - where to put them                                       *
+* return:     none                                                            *
+******************************************************************************/
+void ccache_stats(ccache_stats_t *stats)
+{
+    *stats = cache.stats;
+    stats->bytes = cache.q[CQ_SMALL].bytes + cache.q[CQ_MAIN].bytes;
+    stats->entries = cache.q[CQ_SMALL].count + cache.q[CQ_MAIN].count;
+}
+
+static centry_t *find_entry(unsigned hash, const char *path)
+{
+    centry_t *e;
+
+    for (e = cache.buckets[hash & (cache.nbuckets - 1)]; e; e = e->hnext)
+        if (e->hash == hash && !strcmp(e->path, path))
+            return e;
+    return NULL;
+}
+
+/******************************************************************************
+* subroutine: hash_insert                                                     *
+* purpose:    add an entry to the hash table, doubling the table when it      *
+*             holds more entries than buckets                                 *
+* parameters: e - the entry                                                   *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+static int hash_insert(centry_t *e)
+{
+    centry_t **nb, *x, *next;
+    unsigned i, n;
+
+    if (cache.nentries >= cache.nbuckets)
+    {
+        n = cache.nbuckets * 2;
+        if ((nb = calloc(n, sizeof(centry_t *))) == NULL)
+            return -1;
+        for (i = 0; i < cache.nbuckets; i++)
+        {
+            for (x = cache.buckets[i]; x; x = next)
+            {
+                next = x->hnext;
+                x->hnext = nb[x->hash & (n - 1)];
+                nb[x->hash & (n - 1)] = x;
+            }
+        }
+        free(cache.buckets);
+        cache.buckets = nb;
+        cache.nbuckets = n;
+    }
+
+    e->hnext = cache.buckets[e->hash & (cache.nbuckets - 1)];
+    cache.buckets[e->hash & (cache.nbuckets - 1)] = e;
+    cache.nentries++;
+    return 0;
+}
+
+/* take an entry out of its queue and the table and free it */
+static void remove_entry(centry_t *e)
+{
+    centry_t **pp = &cache.buckets[e->hash & (cache.nbuckets - 1)];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    cache.nentries--;
+
+    q_unlink(e);
+    if (e->blk)
+        ccache_put(e->blk);
+    free(e->path);
+    free(e);
+}
+
+/* evict until the small and main queues fit in the budget again */
+static void evict()
+{
+    int limit;
+
+    while (cache.q[CQ_SMALL].bytes + cache.q[CQ_MAIN].bytes > cache.budget)
+    {
+        if (cache.q[CQ_SMALL].bytes > cache.budget / 10 ||
+            cache.q[CQ_MAIN].count == 0)
+            evict_small();
+        else
+            evict_main();
+    }
+
+    // remember about as many evicted files as are cached
+    limit = cache.q[CQ_SMALL].count + cache.q[CQ_MAIN].count;
+    if (limit < GHOST_MIN)
+        limit = GHOST_MIN;
+    while (cache.q[CQ_GHOST].count > limit)
+        remove_entry(cache.q[CQ_GHOST].head);
+}
+
+/* the oldest file of the small queue moves to main if it was read again
+ * meanwhile, otherwise only its key stays, in the ghost queue */
+static void evict_small()
+{
+    centry_t *e = cache.q[CQ_SMALL].head;
+
+    q_unlink(e);
+    if (e->freq > 1)
+    {
+        e->freq = 0;
+        q_push(CQ_MAIN, e);
+        return;
+    }
+
+    ccache_put(e->blk);
+    e->blk = NULL;
+    q_push(CQ_GHOST, e);
+    cache.stats.evictions++;
+}
+
+/* the oldest file of the main queue gets another pass if it was read since
+ * the last one, otherwise it is evicted */
+static void evict_main()
+{
+    centry_t *e = cache.q[CQ_MAIN].head;
+
+    if (e->freq > 0)
+    {
+        e->freq--;
+        q_unlink(e);
+        q_push(CQ_MAIN, e);
+        return;
+    }
+
+    remove_entry(e);
+    cache.stats.evictions++;
+}
+
+static void q_push(int queue, centry_t *e)
+{
+    cqueue_t *q = &cache.q[queue];
+
+    e->queue = queue;
+    e->prev = q->tail;
+    e->next = NULL;
+    if (q->tail) q->tail->next = e;
+    else q->head = e;
+    q->tail = e;
+    q->count++;
+    if (e->blk)
+        q->bytes += e->blk->len;
+}
+
+static void q_unlink(centry_t *e)
+{
+    cqueue_t *q = &cache.q[e->queue];
+
+    if (e->prev) e->prev->next = e->next;
+    else q->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else q->tail = e->prev;
+    e->prev = e->next = NULL;
+    q->count--;
+    if (e->blk)
+        q->bytes -= e->blk->len;
+}
@@ -0,0 +1,39 @@
+#ifndef _CCACHE_H_
+#define _CCACHE_H_
+
+#include <sys/types.h>
+#include "fcache.h"
+
+/* a cached response: the header block from Server: down to the empty line,
+ * followed by the file body. Queued responses hold a reference, so an evicted
+ * block lives on until the last one is sent */
+typedef struct
+{
+    int    refs;
+    size_t hdr_len;             // bytes of header at the start of data
+    size_t len;                 // header plus body
+    char   data[];
+} cblock_t;
+
+/* counters of the content cache */
+typedef struct
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long ghost_hits;   // misses on recently evicted files
+    unsigned long inserts;
+    unsigned long evictions;
+    size_t bytes;               // bytes held by cached blocks
+    int    entries;             // files cached
+} ccache_stats_t;
+
+int  ccache_init(size_t budget, size_t max_file);
+int  ccache_admits(off_t size);
+cblock_t *ccache_get(fentry_t *file);
+cblock_t *ccache_alloc(fentry_t *file, const char *hdr, size_t hdr_len);
+int  ccache_insert(fentry_t *file, cblock_t *blk);
+void ccache_hold(cblock_t *blk);
+void ccache_put(cblock_t *blk);
+void ccache_stats(ccache_stats_t *stats);
+
+#endif
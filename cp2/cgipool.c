@@ -0,0 +1,731 @@
+/*
+ * cgipool.c
+ *
+ * Description: This file defines the CGI worker pool of Liso server: small
+ *              processes that start the CGI programs, so the event loop
+ *              never forks (or waits for) one itself. The workers are forked
+ *              by a spawner process, itself forked when the server process
+ *              starts, before its caches, client table and thread pools: a
+ *              new worker is a copy of that small process, not of the
+ *              server. The spawner hands the server its end of the new
+ *              worker's socket pair (SCM_RIGHTS). A worker runs one job at a
+ *              time. It takes a framed request
+ *              (the program and its environment) from its socket pair,
+ *              starts the program with posix_spawn() and hands back the
+ *              server's ends of its stdin and stdout pipes (SCM_RIGHTS), so
+ *              the output streams to the client through the event loop
+ *              without passing the worker. Once the program has exited the
+ *              worker says how, and is ready for the next job.
+ *
+ *              The pool grows a worker at a time, up to max, while jobs find
+ *              every worker busy; they wait in the queue until one is ready.
+ *              It shrinks back to min once workers stay idle for
+ *              CGI_IDLE_SEC.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "params.h"
+#include "cgipool.h"
+
+/* the frame of every message, one message per packet */
+typedef struct
+{
+    uint32_t type;              // CM_*
+    uint32_t len;               // payload bytes after the header
+} cgimsg_t;
+
+enum { CM_RUN,                  // server: run the program, payload cgijob.msg
+       CM_QUIT,                 // server: exit
+       CM_STARTED,              // worker: running, stdin and stdout attached
+       CM_FAILED,               // worker: could not run it, payload errno;
+                                // spawner: could not fork a worker
+       CM_EXITED,               // worker: it exited, payload wait status
+       CM_SPAWN,                // server: fork a worker
+       CM_SPAWNED };            // spawner: payload its pid, its socket
+                                // attached
+
+static struct
+{
+    int min, max;
+    int tag;
+    int (*watch)(void *obj, int fd);
+    cgiworker_t *workers;
+    int nworkers;
+    int nbusy;
+    cgijob_t *head;             // jobs waiting for a worker
+    cgijob_t *tail;
+    int nqueued;
+    cgijob_t *reaped;           // jobs with news for the event loop
+    cgiworker_t spawner;        // fd -1 without one
+    int nspawning;              // workers asked of it, not here yet
+    unsigned long jobs;
+} cp = { .spawner.fd = -1 };
+
+static int  spawn_worker();
+static void spawner_event();
+static cgiworker_t *add_worker(int fd, pid_t pid);
+static void fail_queued(int err);
+static void remove_worker(cgiworker_t *w);
+static int  start_job(cgiworker_t *w, cgijob_t *job);
+static void worker_idle(cgiworker_t *w);
+static void post(cgijob_t *job, int events);
+static void spawner_main(int fd);
+static pid_t fork_child(int fd);
+static void worker_main(int fd);
+static int  run_program(char *msg, size_t len, int fds[2], pid_t *pid);
+static int  send_msg(int fd, int type, const void *data, size_t len,
+                     const int *fds, int nfds);
+static ssize_t recv_msg(int fd, char *buf, size_t size, int fds[2], int *nfds);
+
+/******************************************************************************
+* subroutine: cgipool_fork                                                    *
+* purpose:    fork the spawner the workers come from. Call it first thing in  *
+*             the process that submits the jobs, while that is still small    *
+* parameters: none                                                            *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int cgipool_fork()
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    if ((pid = fork_child(sv[1])) < 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        spawner_main(sv[1]);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    cp.spawner.fd = sv[0];
+    cp.spawner.pid = pid;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgipool_init                                                    *
+* purpose:    have the spawner start the first workers. Must run in the       *
+*             process that submits the jobs, after cgipool_fork()             *
+* parameters: min   - workers kept even when idle                             *
+*             max   - most workers at once, up to CGI_WORKERS                 *
+*             tag   - the type the event loop knows the workers by            *
+*             watch - arms the event loop to call cgipool_event() once the   *
+*                     worker's descriptor is readable                         *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int cgipool_init(int min, int max, int tag, int (*watch)(void *obj, int fd))
+{
+    int i;
+
+    cp.min = min;
+    cp.max = max < CGI_WORKERS ? max : CGI_WORKERS;
+    cp.tag = tag;
+    cp.watch = watch;
+    cp.spawner.type = tag;
+    if (fcntl(cp.spawner.fd, F_SETFL, O_NONBLOCK) < 0 ||
+        cp.watch(&cp.spawner, cp.spawner.fd) < 0)
+        return -1;
+    for (i = 0; i < cp.min; i++)
+        if (spawn_worker() < 0)
+            return -1;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgipool_submit                                                  *
+* purpose:    run a job on an idle worker, or queue it until one is: a new    *
+*             one is asked of the spawner while the pool is under its size    *
+* parameters: job - the job, with msg and len set                             *
+* return:     0 on success, -1 with errno set if it cannot be run             *
+******************************************************************************/
+int cgipool_submit(cgijob_t *job)
+{
+    cgiworker_t *w;
+
+    job->in = job->out = -1;
+    job->events = 0;
+    job->status = -1;
+    job->err = 0;
+    job->worker = NULL;
+    job->next = NULL;
+    job->reaped = 0;
+
+    for (w = cp.workers; w && (w->job || w->quitting); w = w->next)
+        ;
+    // one new worker for every queued job
+    if (w == NULL && cp.nqueued >= cp.nspawning &&
+        cp.nworkers + cp.nspawning < cp.max)
+        spawn_worker();
+    if (w == NULL)
+    {
+        if (cp.nworkers == 0 && cp.nspawning == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (cp.tail) cp.tail->next = job;
+        else cp.head = job;
+        cp.tail = job;
+        cp.nqueued++;
+        return 0;
+    }
+    return start_job(w, job);
+}
+
+/******************************************************************************
+* subroutine: cgipool_event                                                   *
+* purpose:    take the messages of a worker whose socket is readable. A      *
+*             worker that went away fails its job and is removed             *
+* parameters: w - the worker                                                  *
+* return:     none                                                            *
+******************************************************************************/
+void cgipool_event(cgiworker_t *w)
+{
+    char buf[sizeof(cgimsg_t) + sizeof(int)];
+    cgimsg_t *m = (cgimsg_t *)buf;
+    cgijob_t *job;
+    ssize_t n;
+    int fds[2], nfds, val;
+
+    if (w == &cp.spawner)
+    {
+        spawner_event();
+        return;
+    }
+
+    while (1)
+    {
+        if ((n = recv_msg(w->fd, buf, sizeof buf, fds, &nfds)) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < (ssize_t)sizeof(cgimsg_t))
+        {
+            // the worker exited (or broke the protocol)
+            remove_worker(w);
+            return;
+        }
+
+        job = w->job;
+        memcpy(&val, buf + sizeof(cgimsg_t),
+               m->len == sizeof(int) ? sizeof(int) : 0);
+        switch (m->type)
+        {
+        case CM_STARTED:
+            if (job == NULL || nfds != 2)
+                break;
+            job->in = fds[0];
+            job->out = fds[1];
+            post(job, CJ_STARTED);
+            break;
+
+        case CM_FAILED:
+        case CM_EXITED:
+            if (job == NULL)
+                break;
+            if (m->type == CM_FAILED)
+                job->err = val;
+            else
+                job->status = val;
+            w->job = NULL;
+            cp.nbusy--;
+            job->worker = NULL;
+            post(job, CJ_EXITED);
+            worker_idle(w);
+            break;
+        }
+    }
+
+    if (cp.watch(w, w->fd) < 0)
+        remove_worker(w);
+}
+
+/* the jobs with news since the last call, oldest first */
+cgijob_t *cgipool_reap()
+{
+    cgijob_t *list = NULL, *job;
+
+    // the list is newest first
+    while ((job = cp.reaped) != NULL)
+    {
+        cp.reaped = job->next;
+        job->next = list;
+        job->reaped = 0;
+        list = job;
+    }
+    return list;
+}
+
+/* called about once a second: retire the workers idle for too long, and
+ * wait for the spawner if it exited. The workers are its children, which it
+ * leaves to the kernel to reap */
+void cgipool_tick()
+{
+    time_t now = time(NULL);
+    cgiworker_t *w;
+    int live = 0;
+
+    for (w = cp.workers; w; w = w->next)
+        live += !w->quitting;
+    for (w = cp.workers; w && live > cp.min; w = w->next)
+    {
+        if (w->job || w->quitting || now - w->idle_since < CGI_IDLE_SEC)
+            continue;
+        // it exits on the message; its socket then reads as closed and the
+        // worker is removed from cgipool_event()
+        if (send_msg(w->fd, CM_QUIT, NULL, 0, NULL, 0) == 0)
+        {
+            w->quitting = 1;
+            live--;
+        }
+    }
+
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+}
+
+void cgipool_stats(cgipool_stats_t *stats)
+{
+    stats->workers = cp.nworkers;
+    stats->busy = cp.nbusy;
+    stats->queued = cp.nqueued;
+    stats->jobs = cp.jobs;
+}
+
+/* ask the spawner for a worker, which arrives at spawner_event() */
+static int spawn_worker()
+{
+    if (cp.spawner.fd < 0 ||
+        send_msg(cp.spawner.fd, CM_SPAWN, NULL, 0, NULL, 0) < 0)
+        return -1;
+    cp.nspawning++;
+    return 0;
+}
+
+/* take the spawner's answers: the new workers go to the queued jobs. If it
+ * went away, or cannot fork, with no worker left the queued jobs fail */
+static void spawner_event()
+{
+    char buf[sizeof(cgimsg_t) + sizeof(pid_t)];
+    cgimsg_t *m = (cgimsg_t *)buf;
+    cgiworker_t *w;
+    ssize_t n;
+    int fds[2], nfds, val;
+
+    while (1)
+    {
+        if ((n = recv_msg(cp.spawner.fd, buf, sizeof buf, fds, &nfds)) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < (ssize_t)sizeof(cgimsg_t))
+        {
+            // waited for by cgipool_tick()
+            close(cp.spawner.fd);
+            cp.spawner.fd = -1;
+            cp.nspawning = 0;
+            if (cp.nworkers == 0)
+                fail_queued(ECHILD);
+            return;
+        }
+
+        memcpy(&val, buf + sizeof(cgimsg_t),
+               m->len == sizeof(int) ? sizeof(int) : 0);
+        if (m->type == CM_SPAWNED && nfds == 1)
+        {
+            cp.nspawning--;
+            if ((w = add_worker(fds[0], val)) != NULL)
+                worker_idle(w);
+        }
+        else if (m->type == CM_FAILED)
+        {
+            cp.nspawning--;
+            if (cp.nworkers == 0 && cp.nspawning == 0)
+                fail_queued(val);
+        }
+    }
+
+    if (cp.watch(&cp.spawner, cp.spawner.fd) < 0)
+    {
+        close(cp.spawner.fd);
+        cp.spawner.fd = -1;
+    }
+}
+
+/* take on a worker the spawner forked, given the server's end of its socket */
+static cgiworker_t *add_worker(int fd, pid_t pid)
+{
+    cgiworker_t *w;
+
+    // closing the socket makes the worker exit
+    if ((w = calloc(1, sizeof(cgiworker_t))) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    w->type = cp.tag;
+    w->fd = fd;
+    w->pid = pid;
+    w->idle_since = time(NULL);
+    if (fcntl(w->fd, F_SETFL, O_NONBLOCK) < 0 || cp.watch(w, w->fd) < 0)
+    {
+        close(w->fd);
+        free(w);
+        return NULL;
+    }
+    w->next = cp.workers;
+    cp.workers = w;
+    cp.nworkers++;
+    return w;
+}
+
+/* fail every queued job, no worker is coming for them */
+static void fail_queued(int err)
+{
+    cgijob_t *job;
+
+    while ((job = cp.head) != NULL)
+    {
+        if ((cp.head = job->next) == NULL)
+            cp.tail = NULL;
+        cp.nqueued--;
+        job->next = NULL;
+        job->err = err;
+        post(job, CJ_EXITED);
+    }
+}
+
+/* forget a worker that exited; its job, if any, failed */
+static void remove_worker(cgiworker_t *w)
+{
+    cgiworker_t **pp;
+
+    for (pp = &cp.workers; *pp != w; pp = &(*pp)->next)
+        ;
+    *pp = w->next;
+    cp.nworkers--;
+
+    if (w->job)
+    {
+        cp.nbusy--;
+        w->job->worker = NULL;
+        w->job->err = EPIPE;
+        post(w->job, CJ_EXITED);
+    }
+
+    // reaped by the spawner
+    close(w->fd);
+    free(w);
+
+    // keep the queued jobs going
+    if (cp.nqueued > cp.nspawning && cp.nworkers + cp.nspawning < cp.max)
+        spawn_worker();
+    if (cp.nworkers == 0 && cp.nspawning == 0)
+        fail_queued(EPIPE);
+}
+
+/* send a job to an idle worker */
+static int start_job(cgiworker_t *w, cgijob_t *job)
+{
+    int ret = send_msg(w->fd, CM_RUN, job->msg, job->len, NULL, 0);
+
+    free(job->msg);
+    job->msg = NULL;
+    if (ret < 0)
+        return -1;
+
+    w->job = job;
+    job->worker = w;
+    cp.nbusy++;
+    cp.jobs++;
+    return 0;
+}
+
+/* a worker is done with its job: take the next queued one */
+static void worker_idle(cgiworker_t *w)
+{
+    cgijob_t *job;
+
+    w->idle_since = time(NULL);
+    while (!w->quitting && (job = cp.head) != NULL)
+    {
+        if ((cp.head = job->next) == NULL)
+            cp.tail = NULL;
+        cp.nqueued--;
+        job->next = NULL;
+        if (start_job(w, job) == 0)
+            return;
+        job->err = errno;
+        post(job, CJ_EXITED);
+    }
+}
+
+/* put a job on the reaped list for the event loop */
+static void post(cgijob_t *job, int events)
+{
+    job->events |= events;
+    if (job->reaped)
+        return;
+    job->reaped = 1;
+    job->next = cp.reaped;
+    cp.reaped = job;
+}
+
+/* the spawner process: a worker for every CM_SPAWN until the server goes */
+static void spawner_main(int fd)
+{
+    cgimsg_t m;
+    ssize_t n;
+    pid_t pid;
+    int sv[2], err;
+
+    // exited workers are reaped by the kernel
+    signal(SIGCHLD, SIG_IGN);
+
+    while ((n = recv(fd, &m, sizeof m, 0)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (n < (ssize_t)sizeof m || m.type == CM_QUIT)
+            return;
+        if (m.type != CM_SPAWN)
+            continue;
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        {
+            err = errno;
+            if (send_msg(fd, CM_FAILED, &err, sizeof err, NULL, 0) < 0)
+                return;
+            continue;
+        }
+        if ((pid = fork_child(sv[1])) == 0)
+        {
+            worker_main(sv[1]);
+            _exit(0);
+        }
+        err = errno;
+        close(sv[1]);
+        n = pid < 0 ? send_msg(fd, CM_FAILED, &err, sizeof err, NULL, 0) :
+                      send_msg(fd, CM_SPAWNED, &pid, sizeof pid, sv, 1);
+        close(sv[0]);
+        if (n < 0)
+            return;
+    }
+}
+
+/* fork a child that keeps nothing of its parent's but fd: no listeners,
+ * clients, epoll set or ring, none of its signal handling, and that dies
+ * with it. Like fork(), 0 in the child */
+static pid_t fork_child(int fd)
+{
+    pid_t pid;
+    int sig;
+
+    if ((pid = fork()) != 0)
+        return pid;
+
+    close_range(3, fd - 1, 0);
+    close_range(fd + 1, ~0U, 0);
+    for (sig = 1; sig < NSIG; sig++)
+        signal(sig, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    return 0;
+}
+
+/* the worker process: one job after the other until told to quit */
+static void worker_main(int fd)
+{
+    size_t size = sizeof(cgimsg_t) + CGI_ENV_MAX;
+    char  *buf;
+    cgimsg_t *m;
+    ssize_t n;
+    pid_t pid;
+    int fds[2], status, err;
+
+    if ((buf = malloc(size)) == NULL)
+        return;
+    m = (cgimsg_t *)buf;
+
+    while ((n = recv(fd, buf, size, 0)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (n < (ssize_t)sizeof(cgimsg_t) || m->type == CM_QUIT)
+            return;
+        if (m->type != CM_RUN || m->len != n - sizeof(cgimsg_t))
+            continue;
+
+        if ((err = run_program(buf + sizeof(cgimsg_t), m->len, fds, &pid)) != 0)
+        {
+            if (send_msg(fd, CM_FAILED, &err, sizeof err, NULL, 0) < 0)
+                return;
+            continue;
+        }
+
+        // the server's ends go to the server, the worker keeps none
+        err = send_msg(fd, CM_STARTED, NULL, 0, fds, 2);
+        close(fds[0]);
+        close(fds[1]);
+
+        while (waitpid(pid, &status, 0) < 0)
+            if (errno != EINTR)
+            {
+                status = -1;
+                break;
+            }
+        if (err < 0 || send_msg(fd, CM_EXITED, &status, sizeof status, NULL, 0) < 0)
+            return;
+    }
+}
+
+/* start the program of a CGI_RUN message (its path, then NAME=value pairs)
+ * in its own directory; fds gets the write end of its stdin and the read
+ * end of its stdout. Returns 0 or an errno */
+static int run_program(char *msg, size_t len, int fds[2], pid_t *pid)
+{
+    char *env[CGI_ENV_VARS + 1], *argv[2], *p, *end = msg + len, *slash;
+    char dir[MAX_PATH];
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    int in[2], out[2], n = 0, err;
+
+    if (len == 0 || end[-1] != '\0')
+        return EINVAL;
+    argv[0] = msg;
+    argv[1] = NULL;
+    for (p = msg + strlen(msg) + 1; p < end && n < CGI_ENV_VARS; p += strlen(p) + 1)
+        env[n++] = p;
+    env[n] = NULL;
+
+    snprintf(dir, sizeof dir, "%s", msg);
+    if ((slash = strrchr(dir, '/')) != NULL)
+        *slash = '\0';
+
+    if (pipe2(in, O_CLOEXEC) < 0)
+        return errno;
+    if (pipe2(out, O_CLOEXEC) < 0)
+    {
+        err = errno;
+        close(in[0]);
+        close(in[1]);
+        return err;
+    }
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+    posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+    if (slash)
+        posix_spawn_file_actions_addchdir_np(&fa, dir);
+    posix_spawnattr_init(&attr);
+    sigfillset(&sigs);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    err = posix_spawn(pid, msg, &fa, &attr, argv, env);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+
+    close(in[0]);
+    close(out[1]);
+    if (err != 0)
+    {
+        close(in[1]);
+        close(out[0]);
+        return err;
+    }
+    fds[0] = in[1];
+    fds[1] = out[0];
+    return 0;
+}
+
+/* send one framed message, with descriptors if any */
+static int send_msg(int fd, int type, const void *data, size_t len,
+                    const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    cgimsg_t m = { type, len };
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    iov[0].iov_base = &m;
+    iov[0].iov_len = sizeof m;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    if (nfds > 0)
+    {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return n == (ssize_t)(sizeof m + len) ? 0 : -1;
+}
+
+/* receive one framed message; fds gets the descriptors it came with, nfds
+ * their number. Returns the bytes received, 0 once the peer is gone */
+static ssize_t recv_msg(int fd, char *buf, size_t size, int fds[2], int *nfds)
+{
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+
+    while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    *nfds = 0;
+    cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+    }
+    return n;
+}
@@ -0,0 +1,63 @@
+#ifndef _CGIPOOL_H_
+#define _CGIPOOL_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+/* a CGI request. The event loop fills in the request part and submits it;
+ * a worker starts the program and hands back the server's ends of its
+ * stdin and stdout pipes, then reports how it exited */
+typedef struct cgijob
+{
+    int    type;                // the event loop's tag, the job is watched
+                                // through its stdout pipe
+    char  *msg;                 // the program's path and its environment,
+                                // "NAME=value", each ending in a NUL
+    size_t len;                 // of msg; the pool frees msg once it is sent
+    int    in;                  // stdin of the program, -1 if none
+    int    out;                 // its stdout, -1 if none
+    int    events;              // CJ_* since the job was last reaped
+    int    status;              // wait status once it exited, -1 if the
+                                // program could not be run
+    int    err;                 // then, why not
+    void  *owner;               // request waiting for the job, NULL if it is
+                                // gone; the pool does not touch it
+    struct cgiworker *worker;   // running the job, NULL while queued
+    struct cgijob *next;        // link in the queued or the reaped list
+    int    reaped;              // on the reaped list
+} cgijob_t;
+
+/* a worker process, talked to through a SOCK_SEQPACKET socket pair */
+typedef struct cgiworker
+{
+    int    type;                // the event loop's tag, see cgipool_init
+    int    fd;                  // the server's end of the socket
+    pid_t  pid;
+    cgijob_t *job;              // the job it runs, NULL if idle
+    time_t idle_since;
+    int    quitting;            // told to exit, gets no more jobs
+    struct cgiworker *next;     // all workers
+} cgiworker_t;
+
+/* what happened to a job, see cgijob_t.events */
+enum { CJ_STARTED = 1,          // in and out are set
+       CJ_EXITED  = 2 };        // status is set
+
+/* counters of the pool */
+typedef struct
+{
+    int workers;
+    int busy;
+    int queued;                 // jobs waiting for a worker
+    unsigned long jobs;
+} cgipool_stats_t;
+
+int  cgipool_fork();
+int  cgipool_init(int min, int max, int tag, int (*watch)(void *obj, int fd));
+int  cgipool_submit(cgijob_t *job);
+void cgipool_event(cgiworker_t *w);
+cgijob_t *cgipool_reap();
+void cgipool_tick();
+void cgipool_stats(cgipool_stats_t *stats);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * cryptopool.c
+ *
+ * Description: This file defines the crypto pool of Liso server, threads
+ *              that run the expensive steps of TLS handshakes: the one that
+ *              answers a ClientHello signs with the private key (RSA or
+ *              ECDSA) and makes the ECDHE share, which would stall every
+ *              other client of the event loop for hundreds of microseconds.
+ *              The steps take CPU, not I/O, so there is one queue, taken
+ *              from by as many threads as there are cores for the worker.
+ *              Finished jobs are put on a completion list and the event
+ *              loop is woken through an eventfd, as with the I/O pool.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "tls.h"
+#include "cryptopool.h"
+
+static struct
+{
+    pthread_mutex_t lock;       // guards the queue
+    pthread_cond_t  wake;       // idle threads sleep on it
+    cryptojob_t *head;          // next job to run
+    cryptojob_t *tail;
+    pthread_mutex_t done_lock;
+    cryptojob_t *done;          // finished jobs, newest first
+    int          efd;           // eventfd signalled on completion
+} cp;
+
+static void *crypto_thread(void *arg);
+
+/******************************************************************************
+* subroutine: cryptopool_init                                                 *
+* purpose:    start the pool threads. Must run after fork(), in the process   *
+*             that submits the jobs                                           *
+* parameters: nthreads - number of threads                                    *
+* return:     the eventfd to watch for completions, -1 on error               *
+******************************************************************************/
+int cryptopool_init(int nthreads)
+{
+    pthread_t tid;
+    sigset_t all, old;
+    int i;
+
+    memset(&cp, 0, sizeof cp);
+    if ((cp.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    pthread_mutex_init(&cp.lock, NULL);
+    pthread_cond_init(&cp.wake, NULL);
+    pthread_mutex_init(&cp.done_lock, NULL);
+
+    // signals are for the event loop thread, the pool threads never see them
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&tid, NULL, crypto_thread, NULL) != 0)
+        {
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return cp.efd;
+}
+
+/******************************************************************************
+* subroutine: cryptopool_submit                                               *
+* purpose:    queue a handshake step for the pool threads                     *
+* parameters: job - the job, owned by the pool until cryptopool_reap()        *
+*             returns it                                                      *
+* return:     none                                                            *
+******************************************************************************/
+void cryptopool_submit(cryptojob_t *job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&cp.lock);
+    if (cp.tail) cp.tail->next = job;
+    else cp.head = job;
+    cp.tail = job;
+    pthread_cond_signal(&cp.wake);
+    pthread_mutex_unlock(&cp.lock);
+}
+
+/******************************************************************************
+* subroutine: cryptopool_reap                                                 *
+* purpose:    take the finished jobs, called when the eventfd is readable     *
+* parameters: none                                                            *
+* return:     the finished jobs linked through next, oldest first             *
+******************************************************************************/
+cryptojob_t *cryptopool_reap()
+{
+    cryptojob_t *list, *job, *prev = NULL;
+    uint64_t cnt;
+
+    // reset the eventfd counter before looking, so no completion is missed
+    while (read(cp.efd, &cnt, sizeof cnt) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&cp.done_lock);
+    list = cp.done;
+    cp.done = NULL;
+    pthread_mutex_unlock(&cp.done_lock);
+
+    while (list)
+    {
+        job = list;
+        list = job->next;
+        job->next = prev;
+        prev = job;
+    }
+    return prev;
+}
+
+/* a pool thread: run the queued steps in order, sleep while there are none */
+static void *crypto_thread(void *arg)
+{
+    uint64_t one = 1;
+    cryptojob_t *job;
+
+    while (1)
+    {
+        pthread_mutex_lock(&cp.lock);
+        while (cp.head == NULL)
+            pthread_cond_wait(&cp.wake, &cp.lock);
+        job = cp.head;
+        if ((cp.head = job->next) == NULL)
+            cp.tail = NULL;
+        pthread_mutex_unlock(&cp.lock);
+
+        tls_step(job->ssl);
+
+        pthread_mutex_lock(&cp.done_lock);
+        job->next = cp.done;
+        cp.done = job;
+        pthread_mutex_unlock(&cp.done_lock);
+
+        while (write(cp.efd, &one, sizeof one) < 0 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
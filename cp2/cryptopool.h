@@ -0,0 +1,23 @@
+#ifndef _CRYPTOPOOL_H_
+#define _CRYPTOPOOL_H_
+
+#include <openssl/ssl.h>
+
+struct client;
+
+/* one handshake step run by the crypto pool. The event loop hands over the
+ * connection (its SSL and its socket) and leaves it alone until the job is
+ * reaped; a pool thread only runs the step */
+typedef struct cryptojob
+{
+    SSL   *ssl;                 // the connection, paused in tls_handshake()
+    struct client *owner;       // client the step is run for; only the event
+                                // loop touches this
+    struct cryptojob *next;     // link in a queue
+} cryptojob_t;
+
+int  cryptopool_init(int nthreads);
+void cryptopool_submit(cryptojob_t *job);
+cryptojob_t *cryptopool_reap();
+
+#endif
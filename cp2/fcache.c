@@ -0,0 +1,361 @@
+/*
+ * fcache.c
+ *
+ * Description: This file defines the static file metadata cache of Liso
+ *              server. Entries are keyed by resolved path and keep the
+ *              file's size, mtime, content type, Last-Modified string and
+ *              an open descriptor, so a hot file is served without any
+ *              stat()/open() call. An entry is stat()ed again once it is
+ *              older than the revalidation interval, and reloaded if the
+ *              file changed. The least recently used entry is dropped when
+ *              the cache is full.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "fcache.h"
+#include "log.h"
+
+static struct
+{
+    fentry_t **buckets;         // hash table, nbuckets is a power of two
+    unsigned nbuckets;
+    int      count;             // entries in the table
+    int      max_entries;
+    int      revalidate;        // seconds before an entry is stat()ed again
+    fentry_t *lru_head;         // least recently used
+    fentry_t *lru_tail;         // most recently used
+} cache;
+
+static unsigned hash_path(const char *path);
+static fentry_t *find_entry(unsigned hash, const char *path);
+static fentry_t *load_entry(const char *path);
+static void drop_entry(fentry_t *e);
+static void lru_unlink(fentry_t *e);
+static void lru_append(fentry_t *e);
+
+/******************************************************************************
+* subroutine: fcache_init                                                     *
+* purpose:    set up an empty cache                                           *
+* parameters: max_entries - most files kept open at a time                    *
+*             revalidate  - seconds an entry is trusted without a stat()      *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int fcache_init(int max_entries, int revalidate)
+{
+    cache.nbuckets = 1;
+    while (cache.nbuckets < 2 * (unsigned)max_entries)
+        cache.nbuckets <<= 1;
+
+    if ((cache.buckets = calloc(cache.nbuckets, sizeof(fentry_t *))) == NULL)
+        return -1;
+
+    cache.count = 0;
+    cache.max_entries = max_entries;
+    cache.revalidate = revalidate;
+    cache.lru_head = cache.lru_tail = NULL;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: fcache_get                                                      *
+* purpose:    look up a regular, readable file, loading it on a miss or when  *
+*             it changed since it was cached                                  *
+* parameters: path - the resolved file path                                   *
+* return:     the entry with a reference held for the caller (drop it with    *
+*             fcache_put), NULL with errno set on error. EACCES means the     *
+*             file exists but is not a readable regular file                  *
+******************************************************************************/
+fentry_t *fcache_get(const char *path)
+{
+    struct stat sbuf;
+    fentry_t *e;
+    unsigned hash = hash_path(path);
+    time_t now = time(NULL);
+
+    e = find_entry(hash, path);
+    if (e && now - e->checked >= cache.revalidate)
+    {
+        if (stat(path, &sbuf) == 0 && sbuf.st_dev == e->dev &&
+            sbuf.st_ino == e->ino && sbuf.st_mtime == e->mtime &&
+            sbuf.st_size == e->size)
+            e->checked = now;
+        else
+        {
+            // replaced, changed or gone; users already holding it keep theirs
+            drop_entry(e);
+            e = NULL;
+        }
+    }
+
+    if (e == NULL)
+    {
+        if ((e = load_entry(path)) == NULL)
+            return NULL;
+        return fcache_insert(e);
+    }
+
+    lru_unlink(e);
+    lru_append(e);
+    e->refs++;
+    return e;
+}
+
+/******************************************************************************
+* subroutine: fcache_find                                                     *
+* purpose:    look up a file without any system call. An entry that is due    *
+*             for revalidation counts as a miss                               *
+* parameters: path - the resolved file path                                   *
+* return:     the entry with a reference held for the caller, NULL on a miss  *
+******************************************************************************/
+fentry_t *fcache_find(const char *path)
+{
+    fentry_t *e;
+
+    e = find_entry(hash_path(path), path);
+    if (e == NULL || time(NULL) - e->checked >= cache.revalidate)
+        return NULL;
+
+    lru_unlink(e);
+    lru_append(e);
+    e->refs++;
+    return e;
+}
+
+/******************************************************************************
+* subroutine: fcache_open                                                     *
+* purpose:    open a file and build an entry for it without touching the      *
+*             cache, so it may run on an I/O pool thread                      *
+* parameters: path - the resolved file path                                   *
+* return:     the new entry, to be passed to fcache_insert(); NULL with errno *
+*             set as for fcache_get()                                         *
+******************************************************************************/
+fentry_t *fcache_open(const char *path)
+{
+    return load_entry(path);
+}
+
+/******************************************************************************
+* subroutine: fcache_insert                                                   *
+* purpose:    add an entry built by fcache_open() to the cache. If the cache  *
+*             already has the same version of the file, that entry is kept    *
+*             (and marked fresh) and the new one is dropped                   *
+* parameters: e - the new entry                                               *
+* return:     the cached entry with a reference held for the caller           *
+******************************************************************************/
+fentry_t *fcache_insert(fentry_t *e)
+{
+    fentry_t *old;
+    unsigned bucket = e->hash & (cache.nbuckets - 1);
+
+    if ((old = find_entry(e->hash, e->path)) != NULL)
+    {
+        if (old->dev == e->dev && old->ino == e->ino &&
+            old->mtime == e->mtime && old->size == e->size)
+        {
+            old->checked = e->checked;
+            fcache_put(e);
+            lru_unlink(old);
+            lru_append(old);
+            old->refs++;
+            return old;
+        }
+        drop_entry(old);
+    }
+
+    e->hnext = cache.buckets[bucket];
+    cache.buckets[bucket] = e;
+    cache.count++;
+
+    if (cache.count > cache.max_entries)
+        drop_entry(cache.lru_head);
+
+    lru_append(e);
+    e->refs++;
+    return e;
+}
+
+/******************************************************************************
+* subroutine: fcache_hold                                                     *
+* purpose:    take one more reference to an entry                             *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+void fcache_hold(fentry_t *e)
+{
+    e->refs++;
+}
+
+/******************************************************************************
+* subroutine: fcache_put                                                      *
+* purpose:    drop a reference, the file is closed with the last one          *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+void fcache_put(fentry_t *e)
+{
+    if (--e->refs > 0)
+        return;
+
+    close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+/******************************************************************************
+* subroutine: get_filetype                                                    *
+* purpose:    find filetype by filename extension                             *
+* parameters: filename: the requested filename                               *
+*             filetype: a pointer to return filetype result                   *
+* return:     none                                                            *
+******************************************************************************/
+void get_filetype(const char *filename, char *filetype)
+{
+    if (strstr(filename, ".html"))
+        strcpy(filetype, "text/html");
+    else if (strstr(filename, ".css"))
+        strcpy(filetype, "text/css");
+    else if (strstr(filename, ".js"))
+        strcpy(filetype, "application/javascript");
+    else if (strstr(filename, ".png"))
+        strcpy(filetype, "image/png");
+    else if (strstr(filename, ".gif"))
+        strcpy(filetype, "image/gif");
+    else if (strstr(filename, ".jpg"))
+        strcpy(filetype, "image/jpeg");
+    else
+        strcpy(filetype, "text/plain");
+}
+
+static fentry_t *find_entry(unsigned hash, const char *path)
+{
+    fentry_t *e;
+
+    for (e = cache.buckets[hash & (cache.nbuckets - 1)]; e; e = e->hnext)
+        if (e->hash == hash && !strcmp(e->path, path))
+            return e;
+    return NULL;
+}
+
+/* FNV-1a */
+static unsigned hash_path(const char *path)
+{
+    unsigned h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+/******************************************************************************
+* subroutine: load_entry                                                      *
+* purpose:    open a file and fill a new entry with its metadata              *
+* parameters: path - the resolved file path                                   *
+* return:     the entry holding the cache's reference, NULL with errno set    *
+******************************************************************************/
+static fentry_t *load_entry(const char *path)
+{
+    struct stat sbuf;
+    int fd;
+
+    // O_NONBLOCK so a FIFO under the www folder cannot stall the server
+    if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+        return NULL;
+
+    if (fstat(fd, &sbuf) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    return fcache_build(path, fd, &sbuf);
+}
+
+/******************************************************************************
+* subroutine: fcache_build                                                    *
+* purpose:    build an entry for a file that is already open, for callers     *
+*             that did the open() and stat() themselves (the io_uring         *
+*             backend). Like fcache_open() it does not touch the cache        *
+* parameters: path - the resolved file path                                   *
+*             fd   - the open descriptor, owned by the entry from now on and  *
+*                    closed on error                                          *
+*             sbuf - its metadata                                             *
+* return:     the new entry, to be passed to fcache_insert(); NULL with errno *
+*             set as for fcache_get()                                         *
+******************************************************************************/
+fentry_t *fcache_build(const char *path, int fd, const struct stat *sbuf)
+{
+    struct tm tm;
+    fentry_t *e;
+
+    if (!S_ISREG(sbuf->st_mode) || !(S_IRUSR & sbuf->st_mode))
+    {
+        close(fd);
+        errno = EACCES;
+        return NULL;
+    }
+
+    if ((e = calloc(1, sizeof(fentry_t))) == NULL ||
+        (e->path = strdup(path)) == NULL)
+    {
+        Log("Error: out of memory caching %s \n", path);
+        free(e);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    e->hash = hash_path(path);
+    e->fd = fd;
+    e->refs = 1;
+    e->size = sbuf->st_size;
+    e->mtime = sbuf->st_mtime;
+    e->dev = sbuf->st_dev;
+    e->ino = sbuf->st_ino;
+    e->checked = time(NULL);
+    get_filetype(path, e->type);
+    gmtime_r(&e->mtime, &tm);
+    strftime(e->lastmod, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+    return e;
+}
+
+/******************************************************************************
+* subroutine: drop_entry                                                      *
+* purpose:    remove an entry from the cache and drop the cache's reference   *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+static void drop_entry(fentry_t *e)
+{
+    fentry_t **pp = &cache.buckets[e->hash & (cache.nbuckets - 1)];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    cache.count--;
+
+    lru_unlink(e);
+    fcache_put(e);
+}
+
+static void lru_unlink(fentry_t *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else cache.lru_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else cache.lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_append(fentry_t *e)
+{
+    e->prev = cache.lru_tail;
+    e->next = NULL;
+    if (cache.lru_tail) cache.lru_tail->next = e;
+    else cache.lru_head = e;
+    cache.lru_tail = e;
+}
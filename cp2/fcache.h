@@ -0,0 +1,41 @@
+#ifndef _FCACHE_H_
+#define _FCACHE_H_
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "params.h"
+
+/* metadata and an open descriptor of one static file, shared by every request
+ * for that file. The cache holds one reference while the entry is in its
+ * table, each user (a request being answered, a queued sendfile() range)
+ * holds another; the descriptor is closed when the last one is dropped */
+typedef struct fentry
+{
+    char  *path;                // resolved path, the lookup key
+    unsigned hash;              // hash of path
+    int    fd;                  // open read-only descriptor
+    int    refs;                // references held, see above
+    off_t  size;
+    time_t mtime;
+    dev_t  dev;
+    ino_t  ino;
+    time_t checked;             // last time the file was stat()ed
+    char   type[MIN_LINE];      // Content-Type value
+    char   lastmod[MIN_LINE];   // Last-Modified value
+    struct fentry *hnext;       // next entry in the same hash bucket
+    struct fentry *prev;        // neighbours in the LRU list, which runs
+    struct fentry *next;        // from least to most recently used
+} fentry_t;
+
+int  fcache_init(int max_entries, int revalidate);
+fentry_t *fcache_get(const char *path);
+fentry_t *fcache_find(const char *path);
+fentry_t *fcache_open(const char *path);
+fentry_t *fcache_build(const char *path, int fd, const struct stat *sbuf);
+fentry_t *fcache_insert(fentry_t *e);
+void fcache_hold(fentry_t *e);
+void fcache_put(fentry_t *e);
+void get_filetype(const char *filename, char *filetype);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * iopool.c
+ *
+ * Description: This file defines the disk I/O pool of Liso server, a few
+ *              threads that run the filesystem calls which may block (open,
+ *              fstat, pread, readahead) so the event loop never waits on a
+ *              cold file. Every thread has its own job queue; jobs are
+ *              handed out round robin and an idle thread steals from the
+ *              other queues before going to sleep. Finished jobs are put on
+ *              a completion list and the event loop is woken through an
+ *              eventfd, which it polls like any other descriptor.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "iopool.h"
+
+/* the job queue of one thread */
+typedef struct
+{
+    pthread_mutex_t lock;
+    iojob_t *head;              // next job to run
+    iojob_t *tail;
+} ioqueue_t;
+
+static struct
+{
+    int        nthreads;
+    ioqueue_t *queues;          // one per thread
+    unsigned   next;            // queue of the next job, event loop only
+    atomic_int pending;         // jobs queued and not yet taken
+    pthread_mutex_t sleep_lock; // idle threads sleep on wake
+    pthread_cond_t  wake;
+    pthread_mutex_t done_lock;
+    iojob_t   *done;            // finished jobs, newest first
+    int        efd;             // eventfd signalled on completion
+} iop;
+
+static void *io_thread(void *arg);
+static void run_job(iojob_t *job);
+static iojob_t *q_pop(ioqueue_t *q);
+
+/******************************************************************************
+* subroutine: iopool_init                                                     *
+* purpose:    start the pool threads. Must run after fork(), in the process   *
+*             that submits the jobs                                           *
+* parameters: nthreads - number of threads                                    *
+* return:     the eventfd to watch for completions, -1 on error               *
+******************************************************************************/
+int iopool_init(int nthreads)
+{
+    pthread_t tid;
+    sigset_t all, old;
+    int i;
+
+    memset(&iop, 0, sizeof iop);
+    iop.nthreads = nthreads;
+    if ((iop.queues = calloc(nthreads, sizeof(ioqueue_t))) == NULL)
+        return -1;
+    if ((iop.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+
+    pthread_mutex_init(&iop.sleep_lock, NULL);
+    pthread_cond_init(&iop.wake, NULL);
+    pthread_mutex_init(&iop.done_lock, NULL);
+    for (i = 0; i < nthreads; i++)
+        pthread_mutex_init(&iop.queues[i].lock, NULL);
+
+    // signals are for the event loop thread, the pool threads never see them
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&tid, NULL, io_thread, (void *)(intptr_t)i) != 0)
+        {
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return iop.efd;
+}
+
+/******************************************************************************
+* subroutine: iopool_submit                                                   *
+* purpose:    queue a job for the pool threads                                *
+* parameters: job - the job, owned by the pool until iopool_reap() returns it *
+* return:     none                                                            *
+******************************************************************************/
+void iopool_submit(iojob_t *job)
+{
+    ioqueue_t *q = &iop.queues[iop.next++ % iop.nthreads];
+
+    job->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail) q->tail->next = job;
+    else q->head = job;
+    q->tail = job;
+    pthread_mutex_unlock(&q->lock);
+
+    atomic_fetch_add(&iop.pending, 1);
+    pthread_mutex_lock(&iop.sleep_lock);
+    pthread_cond_signal(&iop.wake);
+    pthread_mutex_unlock(&iop.sleep_lock);
+}
+
+/******************************************************************************
+* subroutine: iopool_reap                                                     *
+* purpose:    take the finished jobs, called when the eventfd is readable     *
+* parameters: none                                                            *
+* return:     the finished jobs linked through next, oldest first             *
+******************************************************************************/
+iojob_t *iopool_reap()
+{
+    iojob_t *list, *job, *prev = NULL;
+    uint64_t cnt;
+
+    // reset the eventfd counter before looking, so no completion is missed
+    while (read(iop.efd, &cnt, sizeof cnt) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&iop.done_lock);
+    list = iop.done;
+    iop.done = NULL;
+    pthread_mutex_unlock(&iop.done_lock);
+
+    while (list)
+    {
+        job = list;
+        list = job->next;
+        job->next = prev;
+        prev = job;
+    }
+    return prev;
+}
+
+/* a pool thread: run jobs from the own queue, then from the others', then
+ * sleep until more are submitted */
+static void *io_thread(void *arg)
+{
+    int id = (int)(intptr_t)arg, i;
+    uint64_t one = 1;
+    iojob_t *job;
+
+    while (1)
+    {
+        job = NULL;
+        for (i = 0; i < iop.nthreads && job == NULL; i++)
+            job = q_pop(&iop.queues[(id + i) % iop.nthreads]);
+
+        if (job == NULL)
+        {
+            pthread_mutex_lock(&iop.sleep_lock);
+            while (atomic_load(&iop.pending) == 0)
+                pthread_cond_wait(&iop.wake, &iop.sleep_lock);
+            pthread_mutex_unlock(&iop.sleep_lock);
+            continue;
+        }
+        atomic_fetch_sub(&iop.pending, 1);
+
+        run_job(job);
+
+        pthread_mutex_lock(&iop.done_lock);
+        job->next = iop.done;
+        iop.done = job;
+        pthread_mutex_unlock(&iop.done_lock);
+
+        while (write(iop.efd, &one, sizeof one) < 0 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+static void run_job(iojob_t *job)
+{
+    ssize_t n;
+
+    job->ret = 0;
+    job->err = 0;
+
+    switch (job->op)
+    {
+    case IO_OPEN:
+        if ((job->file = fcache_open(job->path)) == NULL)
+        {
+            job->ret = -1;
+            job->err = errno;
+        }
+        break;
+
+    case IO_PREAD:
+        while (job->ret < job->len)
+        {
+            n = pread(job->file->fd, job->buf + job->ret,
+                      job->len - job->ret, job->off + job->ret);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                job->err = (n < 0) ? errno : EIO;   // EOF: file got shorter
+                break;
+            }
+            job->ret += n;
+        }
+        break;
+
+    case IO_READAHEAD:
+        // returns once the range is in the page cache
+        if ((job->ret = readahead(job->file->fd, job->off, job->len)) < 0)
+            job->err = errno;
+        break;
+    }
+}
+
+static iojob_t *q_pop(ioqueue_t *q)
+{
+    iojob_t *job;
+
+    pthread_mutex_lock(&q->lock);
+    if ((job = q->head) != NULL)
+    {
+        q->head = job->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
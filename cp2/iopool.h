@@ -0,0 +1,38 @@
+#ifndef _IOPOOL_H_
+#define _IOPOOL_H_
+
+#include <sys/types.h>
+#include "fcache.h"
+#include "ccache.h"
+
+/* filesystem operations run by the I/O pool */
+enum { IO_OPEN, IO_PREAD, IO_READAHEAD };
+
+struct client;
+
+/* one offloaded operation. The event loop fills in the request part and
+ * holds references to the file and block for the job; a pool thread only
+ * runs the system calls and fills in the result part */
+typedef struct iojob
+{
+    int    op;                  // IO_OPEN, IO_PREAD or IO_READAHEAD
+    char  *path;                // IO_OPEN: file to open
+    fentry_t *file;             // IO_PREAD, IO_READAHEAD: file to read;
+                                // IO_OPEN: the new entry (not cached yet)
+    cblock_t *blk;              // IO_PREAD: block being filled
+    char  *buf;                 // IO_PREAD: where to read to
+    off_t  off;                 // IO_PREAD, IO_READAHEAD: file range
+    size_t len;
+    void  *seg;                 // IO_READAHEAD: the segment waiting for it
+    ssize_t ret;                // bytes read, or -1
+    int    err;                 // errno of the failed call
+    struct client *owner;       // client waiting for the job, NULL if it is
+                                // gone; only the event loop touches this
+    struct iojob *next;         // link in a queue
+} iojob_t;
+
+int  iopool_init(int nthreads);
+void iopool_submit(iojob_t *job);
+iojob_t *iopool_reap();
+
+#endif
@@ -0,0 +1,277 @@
+/*******************************************************************************
+* lisobench.c                                                                  *
+*                                                                              *
+* Description: This file contains a small benchmark client for the Liso       *
+*              server. It parks a number of idle connections on the server     *
+*              and then measures the latency of sequential GET requests on top *
+*              of them, which shows how the cost of one event loop wakeup      *
+*              grows with the number of open (but quiet) connections. With -k *
+*              the requests reuse one keep-alive connection, otherwise every   *
+*              request opens a new one and asks the server to close it. With  *
+*              -p the requests are pipelined, depth at a time.                 *
+*                                                                              *
+* Usage:       ./lisobench [-k] [-p depth] [-i idle] [-n requests] [-u uri]    *
+*                          <host> <port>                                       *
+* example:     ./lisobench -i 10000 -n 20000 -u /index.html 127.0.0.1 8080     *
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define BUF_SIZE 65536
+#define MAX_REQ  1024
+
+/* a benchmark connection and the response bytes read ahead on it */
+typedef struct
+{
+    int  fd;                    // -1 when not connected
+    int  len;                   // bytes buffered in buf
+    char buf[BUF_SIZE];
+} conn_t;
+
+static int  connect_to(struct addrinfo *ai);
+static int  do_batch(struct addrinfo *ai, conn_t *conn, const char *req,
+                     int reqlen, int depth);
+static int  read_response(conn_t *conn, int *is_closed);
+static double now_usec();
+static void usage_exit();
+
+int main(int argc, char *argv[])
+{
+    int opt, i, nidle = 0, nreq = 1000, nok = 0, reqlen, rv, n;
+    int keepalive = 0, depth = 1;
+    int *idle;
+    char *uri = "/index.html";
+    char *req, one[MAX_REQ];
+    double start, elapsed;
+    struct addrinfo hints, *ai;
+    static conn_t conn;
+
+    while ((opt = getopt(argc, argv, "kp:i:n:u:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'k': keepalive = 1; break;
+        case 'p': depth = atoi(optarg); keepalive = 1; break;
+        case 'i': nidle = atoi(optarg); break;
+        case 'n': nreq = atoi(optarg); break;
+        case 'u': uri = optarg; break;
+        default:  usage_exit();
+        }
+    }
+    if (argc - optind != 2 || nreq <= 0 || nidle < 0 || depth <= 0)
+        usage_exit();
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(argv[optind], argv[optind+1], &hints, &ai)) != 0)
+    {
+        fprintf(stderr, "lisobench: %s\n", gai_strerror(rv));
+        return EXIT_FAILURE;
+    }
+
+    // a batch is depth copies of the same request, written at once
+    reqlen = snprintf(one, sizeof one,
+                      "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%s\r\n",
+                      uri, argv[optind], argv[optind+1],
+                      keepalive ? "" : "Connection: close\r\n");
+    req = malloc(reqlen * depth);
+    for (i = 0; i < depth; i++)
+        memcpy(req + i * reqlen, one, reqlen);
+
+    // park the idle connections; they never send a byte
+    idle = malloc(sizeof(int) * (nidle ? nidle : 1));
+    for (i = 0; i < nidle; i++)
+    {
+        if ((idle[i] = connect_to(ai)) < 0)
+        {
+            fprintf(stderr, "lisobench: only %d idle connections opened: %s\n",
+                    i, strerror(errno));
+            nidle = i;
+            break;
+        }
+    }
+    // give the server a moment to accept all of them
+    if (nidle) sleep(1);
+
+    conn.fd = -1;
+    start = now_usec();
+    for (i = 0; i < nreq; i += n)
+    {
+        n = (nreq - i < depth) ? nreq - i : depth;
+        nok += do_batch(ai, &conn, req, reqlen, n);
+    }
+    elapsed = now_usec() - start;
+    if (conn.fd >= 0)
+        close(conn.fd);
+
+    printf("connections:      %s\n", keepalive ? "keep-alive" : "one per request");
+    printf("pipeline depth:   %d\n", depth);
+    printf("idle connections: %d\n", nidle);
+    printf("requests:         %d (%d failed)\n", nreq, nreq - nok);
+    printf("throughput:       %.1f req/s\n", nreq / (elapsed / 1e6));
+    printf("mean latency:     %.1f us\n", elapsed / nreq * depth);
+
+    for (i = 0; i < nidle; i++)
+        close(idle[i]);
+    free(idle);
+    free(req);
+    freeaddrinfo(ai);
+    return (nok == nreq) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/******************************************************************************
+* subroutine: connect_to                                                      *
+* purpose:    open a TCP connection to the server                             *
+* parameters: ai - resolved server address                                    *
+* return:     the connected descriptor, -1 on failure                         *
+******************************************************************************/
+static int connect_to(struct addrinfo *ai)
+{
+    int fd;
+
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+        return -1;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/******************************************************************************
+* subroutine: do_batch                                                        *
+* purpose:    write depth requests in one go and read their responses. A      *
+*             connection is opened if there is none, and closed again when    *
+*             the server says so                                              *
+* parameters: ai     - resolved server address                                *
+*             conn   - the connection to reuse                                *
+*             req    - at least depth copies of the request, back to back     *
+*             reqlen - length of one request                                  *
+*             depth  - number of requests to send                             *
+* return:     number of 2xx responses                                         *
+******************************************************************************/
+static int do_batch(struct addrinfo *ai, conn_t *conn, const char *req,
+                    int reqlen, int depth)
+{
+    int i, status, nok = 0, is_closed = 0;
+
+    if (conn->fd < 0)
+    {
+        if ((conn->fd = connect_to(ai)) < 0)
+            return 0;
+        conn->len = 0;
+    }
+
+    if (write(conn->fd, req, reqlen * depth) != reqlen * depth)
+        is_closed = 1;
+
+    for (i = 0; i < depth && !is_closed; i++)
+    {
+        if ((status = read_response(conn, &is_closed)) < 0)
+            break;
+        if (status >= 200 && status < 300)
+            nok++;
+    }
+
+    if (i < depth || is_closed)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    return nok;
+}
+
+/******************************************************************************
+* subroutine: read_response                                                   *
+* purpose:    read one complete response, using Content-Length to find its    *
+*             end. Bytes of the next response stay in the connection buffer   *
+* parameters: conn      - the connection                                      *
+*             is_closed - set if the server is closing the connection         *
+* return:     the HTTP status code, -1 on error                               *
+******************************************************************************/
+static int read_response(conn_t *conn, int *is_closed)
+{
+    int n, hdrlen, status;
+    long left;
+    char *end, *cl;
+
+    // read the whole header block
+    while (1)
+    {
+        conn->buf[conn->len] = 0;
+        if ((end = strstr(conn->buf, "\r\n\r\n")) != NULL)
+            break;
+        if (conn->len == BUF_SIZE - 1)
+            return -1;
+        if ((n = read(conn->fd, conn->buf + conn->len,
+                      BUF_SIZE - 1 - conn->len)) <= 0)
+            return -1;
+        conn->len += n;
+    }
+    hdrlen = end - conn->buf + 4;
+    *end = 0;
+
+    // status line looks like "HTTP/1.1 200 OK"
+    if (sscanf(conn->buf, "HTTP/%*d.%*d %d", &status) != 1)
+        return -1;
+    *is_closed = (strcasestr(conn->buf, "Connection: close") != NULL);
+
+    // then the body, part of which may already be buffered
+    if ((cl = strcasestr(conn->buf, "Content-Length:")) == NULL)
+        return -1;
+    left = strtol(cl + 15, NULL, 10);
+    if (left <= conn->len - hdrlen)
+    {
+        conn->len -= hdrlen + left;
+        memmove(conn->buf, conn->buf + hdrlen + left, conn->len);
+        return status;
+    }
+
+    left -= conn->len - hdrlen;
+    conn->len = 0;
+    while (left > 0)
+    {
+        if ((n = read(conn->fd, conn->buf, BUF_SIZE - 1)) <= 0)
+            return -1;
+        // keep what belongs to the next response
+        if (n > left)
+        {
+            conn->len = n - left;
+            memmove(conn->buf, conn->buf + left, conn->len);
+        }
+        left -= n;
+    }
+    return status;
+}
+
+static double now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void usage_exit()
+{
+    fprintf(stdout,
+            "Usage: ./lisobench [-k] [-p depth] [-i idle] [-n requests] [-u uri] \n"
+            "                   <host> <port> \n"
+            "    -k          - reuse one keep-alive connection for all requests \n"
+            "    -p depth    - pipeline depth requests at a time (implies -k) \n"
+            "    -i idle     - idle connections to keep open during the run \n"
+            "    -n requests - number of requests to time \n"
+            "    -u uri      - the uri to request (default /index.html) \n");
+    exit(EXIT_FAILURE);
+}
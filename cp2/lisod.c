@@ -9,9 +9,19 @@
 *                                                                              *
 *              The server currently support following features:                *
 *              1. HTTP1.1: support HEAD, GET and POST                          *
-*              2. Support connections from multiple clients                    *
+*              2. Support connections from multiple clients (epoll event loop) *
 *              3. Log debug, info and error in the log file                    *
 *              4. Run server as a daemon process                               *
+*              5. One worker process per core with --workers (SO_REUSEPORT)    *
+*              6. An io_uring event loop instead of epoll with --io-uring      *
+*              7. A binary access log with --access-log (lisod-logdump)        *
+*              8. Counters and latency histograms at /server-status            *
+*              9. CGI programs started by a pool of worker processes           *
+*              10. Request bodies streamed with splice(), to CGI programs or   *
+*                  to files with --upload-dir                                  *
+*              11. TLS on the HTTPS port, sessions resumed across workers      *
+*              12. Kernel TLS where available, so HTTPS files use sendfile()   *
+*              13. TLS handshake private-key work run on a crypto pool        *
 *                                                                              *
 * Authors:     Wenjun Zhang <wenjunzh@andrew.cmu.edu>,                         *
 *                                                                              *
@@ -26,6 +36,18 @@
 *******************************************************************************/
 
 #include "lisod.h"
+
+struct lisod_state STATE;
+static volatile sig_atomic_t KEEPON = 1;
+static uring_t RING;                    // ring of the io_uring backend
+static iojob_t *LATE_JOBS;              // jobs the ring had no room for
+static pool *POOL;                      // connections of this worker
+static struct
+{
+    int    dir;                         // cgi_path is a folder of programs
+    time_t checked;                     // when cgi_path was stat()ed
+    cgiscript_t slot[CGI_SCRIPTS];
+} SCRIPTS;                              // CGI programs found, see find_script
 /*
 #define PORT "9999"
 #define BUF_SIZE 4096
@@ -33,211 +55,386 @@
 
 int main(int argc, char* argv[])
 {
-	static int KEEPON = 1;
-	struct timeval tv;
-	static pool pool;
-
-	char s_port[6];
-	if (argc != 9)
-		usage_exit();
-
-	STATE.port = (int)strtol(argv[1], (char**)NULL, 10);
-	STATE.s_port = (int)strtol(argv[2], (char**)NULL, 10);
-
-	strcpy(STATE.log_path, argv[3]);
-	strcpy(STATE.lck_path, argv[4]);
-	strcpy(STATE.www_path, argv[5]);
-	strcpy(STATE.cgi_path, argv[6]);
-	strcpy(STATE.key_path, argv[7]);
-	strcpy(STATE.ctf_path, argv[8]);
+	int i, status, tls_ok;
+	int socks[MAX_WORKERS], s_socks[MAX_WORKERS];
+	pid_t pids[MAX_WORKERS], pid;
+	struct sigaction sa;
+	struct rlimit rl;
 
+	parse_args(argc, argv);
 
 	if (STATE.www_path[strlen(STATE.www_path)-1] == '/')
 		STATE.www_path[strlen(STATE.www_path)-1] = '\0';
 
 	STATE.log = log_open(STATE.log_path);
 
-	Log("Start Liso server. Server is running in background. \n");
+	// every connection is a descriptor, take as many as we are allowed
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			Log("Error: failed raising the descriptor limit: %s \n", strerror(errno));
+	}
 
-	int listener;
-	int newfd;
-	struct sockaddr_storage remoteaddr; // client address
-	socklen_t addrlen;
-	
-	char remoteIP[INET6_ADDRSTRLEN];
+	// a client may hang up before we reply; handle that as EPIPE from send()
+	signal(SIGPIPE, SIG_IGN);
 
-	int yes=1;        // for setsockopt() SO_REUSEADDR, below
-	int i, rv;
+	// stop the event loop (or the workers) cleanly; no SA_RESTART so
+	// epoll_wait() and wait() return early
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = signal_handler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
 
-	struct addrinfo hints, *ai, *p;
+	Log("Start Liso server. Server is running in background. \n");
 
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
+	// the HTTPS port speaks TLS, set up once for all workers so they share
+	// the session cache and ticket keys; without a usable key and
+	// certificate the port is not served
+	if (!(tls_ok = tls_init(STATE.key_path, STATE.ctf_path) == 0))
+		Log("Error: no TLS, not listening on HTTPS port %d \n", STATE.s_port);
 
-	tostring(s_port, STATE.port);
-	if ((rv = getaddrinfo(NULL, s_port, &hints, &ai)) != 0)
+	// one pair of listeners per worker, all bound with SO_REUSEPORT so the
+	// kernel spreads new connections over the workers. Binding them here
+	// lets a busy port fail the start instead of a worker
+	for (i = 0; i < STATE.workers; i++)
 	{
-		fprintf(stderr, "selectserver: %s\n", gai_strerror(rv));
-		exit(1);
+		s_socks[i] = -1;
+		if ((socks[i] = open_listener(STATE.port)) < 0 ||
+		    (tls_ok && (s_socks[i] = open_listener(STATE.s_port)) < 0))
+		{
+			Log("Error: failed creating sockets for worker %d.\n", i);
+			log_close();
+			return EXIT_FAILURE;
+		}
 	}
 
-	for(p = ai; p != NULL; p = p->ai_next)
+	Log("Listen success! >>>>>>>>>>>>>>>>>>>> \n");
+
+	if (STATE.workers == 1)
+		return run_worker(0, socks[0], s_socks[0]);
+
+	for (i = 0; i < STATE.workers; i++)
+		pids[i] = spawn_worker(i, socks, s_socks);
+
+	// restart workers that die, until we are told to stop
+	while (KEEPON)
 	{
-	    	listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (listener < 0)
-		{ 
-			continue;
+		if ((pid = wait(&status)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
 		}
-		
-		// lose the pesky "address already in use" error message
-		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
-		if (bind(listener, p->ai_addr, p->ai_addrlen) < 0)
-		{
-			Log("Error: failed binding socket.\n");
-			clean();
+		for (i = 0; i < STATE.workers && pids[i] != pid; i++)
+			;
+		if (i == STATE.workers || !KEEPON)
 			continue;
-		}
-		Log("Bind success! \n");
 
-		break;
+		Log("Error: worker %d (pid %d) died with status %d, restarting \n",
+		    i, (int)pid, status);
+		sleep(1);   // don't spin if it dies right away again
+		pids[i] = spawn_worker(i, socks, s_socks);
 	}
 
-	// if we got here, it means we didn't get bound
-	if (p == NULL)
-	{
-		Log("Error: failed creating socket for HTTP connection.\n");
-		fclose(STATE.log);
-		return EXIT_FAILURE;
-	}
-	freeaddrinfo(ai); // all done with this
+	Log("Shut down Server >>>>>>>>>>>>>>>>>>>> \n");
+	for (i = 0; i < STATE.workers; i++)
+		if (pids[i] > 0)
+			kill(pids[i], SIGTERM);
+	while (wait(&status) > 0 || errno == EINTR)
+		;
+
+	return 0;
+}
+
+/******************************************************************************
+* subroutine: open_listener                                                   *
+* purpose:    create, bind and listen on a TCP socket for a port. In worker   *
+*             mode the socket is bound with SO_REUSEPORT                      *
+* parameters: port - the port to listen on                                    *
+* return:     the listening descriptor, -1 on failure                         *
+******************************************************************************/
+int open_listener(int port)
+{
+    struct addrinfo hints, *ai, *p;
+    char port_str[6];
+    int  listener = -1, yes = 1, rv;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    tostring(port_str, port);
+    if ((rv = getaddrinfo(NULL, port_str, &hints, &ai)) != 0)
+    {
+        Log("Error: getaddrinfo: %s \n", gai_strerror(rv));
+        return -1;
+    }
+
+    for (p = ai; p != NULL; p = p->ai_next)
+    {
+        if ((listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+
+        // lose the pesky "address already in use" error message
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        if (STATE.workers > 1)
+            setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+
+        if (bind(listener, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+
+        close(listener);
+        listener = -1;
+    }
+    freeaddrinfo(ai); // all done with this
+
+    if (listener < 0)
+    {
+        Log("Error: failed binding socket on port %d.\n", port);
+        return -1;
+    }
+
+    if (listen(listener, MAX_CONN) == -1)
+    {
+        Log("Error: listening on socket.\n");
+        close(listener);
+        return -1;
+    }
+
+    Log("Create socket success: sock =  %d \n", listener);
+    return listener;
+}
+
+/******************************************************************************
+* subroutine: spawn_worker                                                    *
+* purpose:    fork a worker process. The child keeps only its own listeners   *
+*             and dies with the master                                        *
+* parameters: id      - worker number                                         *
+*             socks   - HTTP listeners of all workers                         *
+*             s_socks - HTTPS listeners of all workers                        *
+* return:     pid of the worker, -1 on failure                                *
+******************************************************************************/
+pid_t spawn_worker(int id, int *socks, int *s_socks)
+{
+    pid_t pid;
+    int i;
+
+    if ((pid = fork()) < 0)
+    {
+        Log("Error: failed forking worker %d \n", id);
+        return -1;
+    }
+    if (pid > 0)
+        return pid;
+
+    log_fork();
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    for (i = 0; i < STATE.workers; i++)
+    {
+        if (i == id)
+            continue;
+        close(socks[i]);
+        close(s_socks[i]);
+    }
+    exit(run_worker(id, socks[id], s_socks[id]));
+}
+
+/******************************************************************************
+* subroutine: run_worker                                                      *
+* purpose:    run one event loop with its own connection table and caches     *
+*             until the process is told to stop                               *
+* parameters: id     - worker number                                          *
+*             sock   - HTTP listener of this worker                           *
+*             s_sock - HTTPS listener of this worker                          *
+* return:     exit status                                                     *
+******************************************************************************/
+int run_worker(int id, int sock, int s_sock)
+{
+	static pool pool;
+	ccache_stats_t cstats;
+	bufpool_stats_t bstats;
+	char path[MAX_PATH + 16];
 
-	STATE.sock = listener;
-	Log("Create socket success: sock =  %d \n", listener);
+	STATE.worker = id;
+	POOL = &pool;
+	STATE.sock = sock;
+	STATE.s_sock = s_sock;
 
-	// listen
-	if (listen(listener, MAX_CONN) == -1)
+	if (STATE.pin_cpus)
+		pin_worker(id);
+
+	// the CGI workers are forked from a copy of this process taken now,
+	// before its caches, client table and thread pools exist
+	if (cgipool_fork() < 0)
 	{
-		Log("Error: listening on socket.\n");
+		Log("Error: failed forking the CGI spawner: %s \n", strerror(errno));
 		clean();
 		return EXIT_FAILURE;
 	}
 
-	Log("Listen success! >>>>>>>>>>>>>>>>>>>> \n");
-
-
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
+	// request heads are scanned with the widest vector unit there is
+	scan_init(SCAN_AUTO);
+	bufpool_init(STATE.buf_bytes);
 
-	tostring(s_port, STATE.s_port);
-	if ((rv = getaddrinfo(NULL, s_port, &hints, &ai)) != 0)
+	if (fcache_init(FCACHE_ENTRIES, FCACHE_REVALIDATE) < 0 ||
+	    ccache_init(STATE.cache_bytes, CCACHE_MAX_FILE) < 0)
 	{
-		fprintf(stderr, "selectserver: %s\n", gai_strerror(rv));
-		exit(1);
+		Log("Error: failed creating the file caches.\n");
+		clean();
+		return EXIT_FAILURE;
 	}
 
-	for(p = ai; p != NULL; p = p->ai_next)
+	// every worker writes an access log of its own
+	if (STATE.alog_path[0])
 	{
-	    	listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (listener < 0)
-		{ 
-			continue;
-		}
-		
-		// lose the pesky "address already in use" error message
-		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-
-		if (bind(listener, p->ai_addr, p->ai_addrlen) < 0)
+		if (STATE.workers == 1)
+			snprintf(path, sizeof path, "%s", STATE.alog_path);
+		else
+			snprintf(path, sizeof path, "%s.%d", STATE.alog_path, id);
+		if (alog_open(path, id, STATE.alog_mmap) < 0)
 		{
-			Log("Error: failed binding socket.\n");
+			Log("Error: failed opening access log %s: %s \n", path, strerror(errno));
 			clean();
-			continue;
+			return EXIT_FAILURE;
 		}
-		Log("Bind success! \n");
-
-		break;
 	}
 
-	// if we got here, it means we didn't get bound
-	if (p == NULL)
+	// add the listeners to the epoll set
+	if (init_pool(&pool) < 0)
 	{
-		Log("Error: failed creating socket for HTTPS connection.\n");
-		fclose(STATE.log);
+		Log("Error: failed creating epoll instance or I/O pool.\n");
+		clean();
 		return EXIT_FAILURE;
 	}
-	freeaddrinfo(ai); // all done with this
 
-	STATE.s_sock = listener;
-	Log("Create socket success: sock =  %d \n", listener);
-
-	// listen
-	if (listen(listener, MAX_CONN) == -1)
+	// the CGI workers are watched by the event loop, so they come after it
+	if (cgipool_init(CGI_MIN_WORKERS < STATE.cgi_workers ? CGI_MIN_WORKERS :
+	                 STATE.cgi_workers, STATE.cgi_workers, EV_CGI,
+	                 watch_cgi) < 0)
 	{
-		Log("Error: listening on socket.\n");
+		Log("Error: failed starting the CGI workers: %s \n", strerror(errno));
 		clean();
 		return EXIT_FAILURE;
 	}
 
-	Log("Listen success! >>>>>>>>>>>>>>>>>>>> \n");
-	// add the listener to the master set
-	
-	init_pool(&pool);
+	// handshakes go on without the crypto pool if it cannot start
+	if (init_crypto(&pool) < 0)
+		Log("Error: failed starting the crypto pool: %s \n", strerror(errno));
+
+	if (STATE.use_uring)
+		run_uring(&pool);
+	else
+		run_epoll(&pool);
+
+	alog_close();
+
+	ccache_stats(&cstats);
+	Log("Content cache: %lu hits, %lu misses (%lu ghost), "
+	    "%lu inserts, %lu evictions, %d files in %zu bytes \n",
+	    cstats.hits, cstats.misses, cstats.ghost_hits,
+	    cstats.inserts, cstats.evictions, cstats.entries,
+	    cstats.bytes);
+	bufpool_stats(&bstats);
+	Log("Buffer pool: %lu gets, %lu reused, %lu refused at the cap, "
+	    "peak %zu bytes \n", bstats.gets, bstats.reuses, bstats.refusals,
+	    bstats.peak);
+	if (STATE.workers == 1)
+		Log("Shut down Server >>>>>>>>>>>>>>>>>>>> \n");
+	else
+		Log("Worker %d stopped \n", id);
+
+	return 0;
+}
+
+/******************************************************************************
+* subroutine: run_epoll                                                       *
+* purpose:    the epoll event loop, runs until the worker is told to stop     *
+* parameters: p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void run_epoll(pool *p)
+{
+	void *ptr;
+	int i;
 
 	// main loop
 	while(KEEPON)
 	{
-		tv.tv_sec = 1; // timeout = 1 sec
-		tv.tv_usec = 0;
-		pool.ready_set = pool.read_set;
-
-		if ((pool.nready = select(pool.maxfd+1, &pool.ready_set, NULL, NULL, &tv)) == -1)
+		// timeout = 1 sec
+		if ((p->nready = epoll_wait(p->epfd, p->events, MAX_EVENTS, 1000)) == -1)
 		{
-			if (errno == EINTR)
-			{
-				Log("Shut down Server >>>>>>>>>>>>>>>>>>>> \n");
-				break;
-			}
-
-			Log("Error: select error \n");
+			if (errno != EINTR)
+				Log("Error: epoll_wait error \n");
 			continue;
 		}
-		for(i = 0; (i <= pool.maxfd) && (pool.nready > 0); i++)
+
+		// only the ready descriptors are visited, the idle ones cost nothing
+		for(i = 0; i < p->nready; i++)
 		{
-			if (FD_ISSET(i, &pool.ready_set))
-			{
-				if (i == STATE.sock || i == STATE.s_sock)
-				{
-					addrlen = sizeof remoteaddr;
-					newfd = accept(i,(struct sockaddr *)&remoteaddr, &addrlen);
-					if (newfd == -1)
-					{
-					       Log("Error: accepting connection. \n");
-					       continue;
-					}
-					
-					Log("accept client: new connection from %s on socket %d\n", inet_ntop(remoteaddr.ss_family, get_in_addr((struct sockaddr*)&remoteaddr), remoteIP, INET6_ADDRSTRLEN), newfd);
-
-					if (STATE.is_full)
-					{
-						pool.nready--;
-						serve_error(newfd, "503", "Service Unavailable",
-						"Server is too busy right now. Please try again later.", 1);
-						close(newfd);
-					}
-					else
-						add_client(newfd, &pool);					
-				}
-				else
-					check_clients(&pool);
-			}
+			ptr = p->events[i].data.ptr;
+			if (*(int *)ptr == EV_LISTENER)
+				accept_clients((listener_t *)ptr, p);
+			else if (*(int *)ptr == EV_IOPOOL)
+				reap_jobs(p);
+			else if (*(int *)ptr == EV_CRYPTO)
+				reap_handshakes(p);
+			else if (*(int *)ptr == EV_CGI || *(int *)ptr == EV_CGIOUT ||
+			         *(int *)ptr == EV_CGIIN)
+				cgi_ready(ptr, p);
+			else
+				check_client((client_t *)ptr, p);
 		}
+
+		// read for the clients that waited for buffers released meanwhile
+		wake_waiters(p);
+
+		// close connections that stayed quiet for too long
+		expire_clients(p);
+		alog_tick();
+		cgipool_tick();
 	} // END for(;;)--and you thought it would never end!
-	
-	return 0;
+}
+
+/******************************************************************************
+* subroutine: pin_worker                                                      *
+* purpose:    bind a worker to one of the CPUs the server may run on, worker  *
+*             i getting the i-th one (modulo their number)                    *
+* parameters: id - worker number                                              *
+* return:     none                                                            *
+******************************************************************************/
+void pin_worker(int id)
+{
+    cpu_set_t allowed, one;
+    int cpu, n = 0, k;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) < 0)
+        return;
+
+    k = id % CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed) && n++ == k)
+            break;
+
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (sched_setaffinity(0, sizeof one, &one) < 0)
+        Log("Error: failed pinning worker %d to CPU %d \n", id, cpu);
+    else
+        LogInfo("Info: worker %d pinned to CPU %d \n", id, cpu);
+}
+
+/******************************************************************************
+* subroutine: signal_handler                                                  *
+* purpose:    ask the event loop (or the master) to stop                      *
+* parameters: sig - the signal                                                *
+* return:     none                                                            *
+******************************************************************************/
+void signal_handler(int sig)
+{
+    KEEPON = 0;
 }
 
 
@@ -247,27 +444,72 @@ int main(int argc, char* argv[])
 
 /******************************************************************************
 * subroutine: init_pool                                                       *
-* purpose:    setup the initial value for pool attributes                     *
-* parameters: sock - the descriptor server using to listen client connections *
-*             p    - pointer to pool instance                                 *
-* return:     none                                                            *
+* purpose:    setup the initial value for pool attributes and register both   *
+*             listeners with a new epoll instance (edge-triggered)            *
+* parameters: p    - pointer to pool instance                                 *
+* return:     0 on success, -1 on failure                                     *
 ******************************************************************************/
-void init_pool (pool *p)
+int init_pool (pool *p)
 {
-	// Initialize descriptors
+	struct epoll_event ev;
 	int i;
-	p->maxi = -1;
-	for (i=0; i< FD_SETSIZE; i++)
-	p->clientfd[i] = -1;
-	if(STATE.sock < STATE.s_sock)
-		p->maxfd = STATE.s_sock;
-	else
-		p->maxfd = STATE.sock;
 
-	FD_ZERO(&p->read_set);
-	FD_SET(STATE.sock, &p->read_set);
-	FD_SET(STATE.s_sock, &p->read_set);
+	p->nslots = 0;
+	p->nclients = 0;
+	p->free_slots = NULL;
+	p->wait_head = p->wait_tail = NULL;
+	p->idle_head = p->idle_tail = NULL;
 	STATE.is_full = 0;
+
+	if ((p->epfd = epoll_create1(0)) < 0)
+		return -1;
+
+	p->listeners[0].fd = STATE.sock;
+	p->listeners[0].is_secure = 0;
+	p->listeners[1].fd = STATE.s_sock;
+	p->listeners[1].is_secure = 1;
+
+	for (i = 0; i < 2; i++)
+	{
+		p->listeners[i].type = EV_LISTENER;
+		p->listeners[i].armed = 0;
+		if (p->listeners[i].fd < 0)		// HTTPS without TLS
+			continue;
+		if (set_nonblocking(p->listeners[i].fd) < 0)
+			return -1;
+
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &p->listeners[i];
+		if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->listeners[i].fd, &ev) < 0)
+			return -1;
+	}
+
+	// the disk I/O pool reports finished jobs through an eventfd
+	p->io.type = EV_IOPOOL;
+	p->io.fd = -1;
+	p->crypto.type = EV_CRYPTO;
+	p->crypto.fd = -1;
+
+	// the ring does the disk I/O as well, no pool threads then
+	if (STATE.use_uring && uring_start(p) == 0)
+		return 0;
+	if (STATE.use_uring)
+	{
+		Log("Error: io_uring not available (%s), using epoll \n", strerror(errno));
+		STATE.use_uring = 0;
+	}
+
+	if (STATE.io_threads > 0)
+	{
+		if ((p->io.fd = iopool_init(STATE.io_threads)) < 0)
+			return -1;
+
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &p->io;
+		if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->io.fd, &ev) < 0)
+			return -1;
+	}
+	return 0;
 }
 
 
@@ -281,6 +523,15 @@ int close_socket(int sock)
     return 0;
 }
 
+int set_nonblocking(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
 {
@@ -291,503 +542,4050 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+// get the peer address of a client for the access log, IPv4 as ::ffff:a.b.c.d
+void get_peer(client_t *c)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof addr;
+
+	memset(c->addr, 0, sizeof c->addr);
+	if (getpeername(c->fd, (struct sockaddr *)&addr, &len) < 0)
+		return;
+	if (addr.ss_family == AF_INET) {
+		c->addr[10] = c->addr[11] = 0xff;
+		memcpy(c->addr + 12, get_in_addr((struct sockaddr *)&addr), 4);
+	}
+	else if (addr.ss_family == AF_INET6)
+		memcpy(c->addr, get_in_addr((struct sockaddr *)&addr), 16);
+}
+
 
 /******************************************************************************
 * subroutine: serve_error                                                     *
-* purpose:    return error message to client                                  *
-* parameters: client_fd: client descriptor                                    *
+* purpose:    queue an error message for the client                           *
+* parameters: c: the client                                                   *
 *             errnum: error number                                            *
 *             shortmsg: short error message                                   *
 *             longmsg:  long error message                                    *
 *             is_closed - an indicate if sending 'Connection: close' back     *
 * return:     none                                                            *
 ******************************************************************************/
-void serve_error(int client_fd, char *errnum, char *shortmsg, char *longmsg, 
+void serve_error(client_t *c, char *errnum, char *shortmsg, char *longmsg, 
+                 int is_closed) {
+    char buf[MAX_LINE];
+
+    if (c->context)
+        c->context->status = atoi(errnum);
+    queue_bytes(c, buf, format_error(buf, errnum, shortmsg, longmsg, is_closed));
+}
+
+/******************************************************************************
+* subroutine: format_error                                                    *
+* purpose:    build a complete error response                                 *
+* parameters: buf: where to build the response, MAX_LINE bytes                *
+*             errnum, shortmsg, longmsg, is_closed: as for serve_error        *
+* return:     the length of the response                                      *
+******************************************************************************/
+int format_error(char *buf, char *errnum, char *shortmsg, char *longmsg,
                  int is_closed) {
     struct tm tm;
     time_t now;
-    char buf[MAX_LINE], body[MAX_LINE], dbuf[MIN_LINE];
+    int  len, blen;
+    char body[MAX_LINE/2], dbuf[MIN_LINE];
 
     now = time(0);
     tm = *gmtime(&now);
     strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
 
     // build HTTP response body
-    sprintf(body, "<html><title>Lisod Error</title>");
-    sprintf(body, "%s<body>\r\n", body);
-    sprintf(body, "%sError %s -- %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<br><p>%s</p></body></html>\r\n", body, longmsg);
+    blen = sprintf(body, "<html><title>Lisod Error</title>");
+    blen += sprintf(body + blen, "<body>\r\n");
+    blen += sprintf(body + blen, "Error %s -- %s\r\n", errnum, shortmsg);
+    blen += sprintf(body + blen, "<br><p>%s</p></body></html>\r\n", longmsg);
 
     // print HTTP response
-    sprintf(buf, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
-    sprintf(buf, "%sDate: %s\r\n", buf, dbuf);
-    sprintf(buf, "%sServer: Liso/1.0\r\n", buf);
-    if (is_closed) sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-type: text/html\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n\r\n", buf, (int)strlen(body));
-    send(client_fd, buf, strlen(buf), 0);
-    send(client_fd, body, strlen(body), 0);
+    len = sprintf(buf, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
+    len += sprintf(buf + len, "Date: %s\r\n", dbuf);
+    len += sprintf(buf + len, "Server: Liso/1.0\r\n");
+    if (is_closed) len += sprintf(buf + len, "Connection: close\r\n");
+    len += sprintf(buf + len, "Content-type: text/html\r\n");
+    len += sprintf(buf + len, "Content-length: %d\r\n\r\n", blen);
+    memcpy(buf + len, body, blen);
+    return len + blen;
 }
 
 
 /******************************************************************************
-* subroutine: add_client                                                      *
-* purpose:    add a new client to the pool and update pool attributes         *
-* parameters: client_fd - the descriptor of new client                        *
-*             p    - pointer to pool instance                                 *
-* return:     0 on success, -1 on failure                                     *
+* subroutine: accept_clients                                                  *
+* purpose:    accept every pending connection on a listener. The listener is  *
+*             edge-triggered, so keep accepting until the backlog is empty    *
+* parameters: l - the listener that became readable                           *
+*             p - pointer to pool instance                                    *
+* return:     none                                                            *
 ******************************************************************************/
-int add_client(int client_fd, pool *p)
+void accept_clients(listener_t *l, pool *p)
 {
-    int i;
-    p->nready--;
+    int newfd;
+    struct sockaddr_storage remoteaddr; // client address
+    socklen_t addrlen;
+    char remoteIP[INET6_ADDRSTRLEN];
+    char buf[MAX_LINE];
 
-    if (STATE.is_full)
-    	return -1;
- 
-    // only accept FD_SETSIZE - 5 clients to keep server from overloading
-    for (i=0; i<(FD_SETSIZE - 5); i++)
+    while (1)
     {
-        if (p->clientfd[i] < 0)
+        addrlen = sizeof remoteaddr;
+        newfd = accept(l->fd, (struct sockaddr *)&remoteaddr, &addrlen);
+        if (newfd == -1)
         {
-            // add client descriptor to the pool
-            p->clientfd[i] = client_fd;
-
-            // add the descriptor to the descriptor set
-            FD_SET(client_fd, &p->read_set);
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                Log("Error: accepting connection. \n");
+            return;
+        }
 
-            // add read buf
-             rio_readinitb(&p->clientrio[i], client_fd);
+        LogDebug("accept client: new connection from %s on socket %d\n",
+            inet_ntop(remoteaddr.ss_family,
+                      get_in_addr((struct sockaddr*)&remoteaddr),
+                      remoteIP, INET6_ADDRSTRLEN), newfd);
 
-            // update max descriptor and pool highwater mark
-            if (client_fd > p->maxfd)
-                p->maxfd = client_fd;
-            if (i > p->maxi)
-                p->maxi = i;
-            break;
+        if (STATE.is_full || add_client(newfd, l->is_secure, p) < 0)
+        {
+            // no client slot to queue on, best effort straight to the socket
+            // (a TLS client would not understand it)
+            if (!l->is_secure)
+                send(newfd, buf, format_error(buf, "503",
+                     "Service Unavailable",
+                     "Server is too busy right now. Please try again later.",
+                     1), MSG_DONTWAIT);
+            close(newfd);
         }
     }
-    
-    if (i == (FD_SETSIZE - 5))
+}
+
+/******************************************************************************
+* subroutine: add_client                                                      *
+* purpose:    add a new client to the pool and register it with epoll         *
+* parameters: client_fd - the descriptor of new client                        *
+*             is_secure - 1 if accepted on the HTTPS port                     *
+*             p    - pointer to pool instance                                 *
+* return:     0 on success, -1 on failure                                     *
+******************************************************************************/
+int add_client(int client_fd, int is_secure, pool *p)
+{
+    int one = 1;
+    client_t *c;
+    struct epoll_event ev;
+
+    if ((c = alloc_slot(p)) == NULL)
     {   
         STATE.is_full = 1;
         Log ("Error: too many clients. \n");
         return -1;
     }
+
+    c->type = EV_CLIENT;
+    c->fd = client_fd;
+    c->is_secure = is_secure;
+    c->ssl = NULL;
+    c->tls_up = 0;
+    c->crypto = NULL;
+    c->ktls = 0;
+    c->tls_out.type = EV_TLSOUT;
+    c->tls_out.c = c;
+    c->is_closed = 0;
+    c->closing = 0;
+    c->nrequests = 0;
+    c->context = NULL;
+    arena_init(&c->arena);
+    c->out = NULL;
+    c->iov = NULL;
+    c->out_head = c->out_cnt = 0;
+    c->unsent = NULL;
+    c->unsent_head = c->unsent_cnt = 0;
+    c->wbuf = NULL;
+    c->wlen = c->wcap = 0;
+    c->queued = 0;
+    c->t_accept = alog_now();
+    c->t_queued = 0;
+    c->uops = c->dead = 0;
+    c->recv_armed = c->send_busy = c->body_armed = 0;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->piped = 0;
+    c->wprev = c->wnext = NULL;
+    c->waiting = 0;
+
+    // requests are parsed as bytes arrive, never wait in read(). The ring
+    // waits for a socket by itself, but TLS records are read and written by
+    // OpenSSL, which must not wait either
+    if ((!STATE.use_uring || is_secure) && set_nonblocking(client_fd) < 0)
+    {
+        Log("Error: failed setting client socket non-blocking \n");
+        free_slot(c, p);
+        return -1;
+    }
+
+    // a response goes out in several sends; on a persistent connection
+    // Nagle would hold the last one back until the client's delayed ACK
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // add read buf
+    rio_readinitb(&c->rio, client_fd);
+
+    // the handshake starts with the client's first bytes
+    if (is_secure && (c->ssl = c->rio.rio_ssl = tls_new(client_fd)) == NULL)
+    {
+        Log("Error: failed creating a TLS session \n");
+        free_slot(c, p);
+        return -1;
+    }
+
+    // the access log has the peer address of every request
+    if (STATE.alog_path[0])
+        get_peer(c);
+
+    // the connection object itself is the epoll user data; EPOLLOUT is
+    // edge-triggered too, so it only reports a full socket draining. With
+    // io_uring a receive is queued instead, once there is a buffer for it
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (STATE.use_uring ? !bufpool_full() && uring_recv(c, 0) < 0 :
+        epoll_ctl(p->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+    {
+        Log("Error: failed watching client socket \n");
+        if (c->ssl)
+            tls_close(c->ssl);
+        free_slot(c, p);
+        return -1;
+    }
+
+    c->prev = c->next = NULL;
+    touch_client(c, p);
+    if (STATE.use_uring && !c->recv_armed)
+        wait_buffer(c, p);
+
+    metrics_count(C_ACCEPTS, 1);
+    if (++p->nclients == MAX_CLIENTS)
+        STATE.is_full = 1;
     return 0;
 }
 
 /******************************************************************************
-* subroutine: check_clients                                                   *
-* purpose:    process the ready set from the set of descriptors               *
+* subroutine: alloc_slot                                                      *
+* purpose:    take a client slot off the free list. When it is empty the next *
+*             CLIENT_CHUNK slots are allocated, so memory grows with the      *
+*             number of connections the worker has had open at once           *
 * parameters: p - pointer to the pool instance                                *
-* return:     0 on success, -1 on failure                                     *
+* return:     the slot, NULL at MAX_CLIENTS or out of memory                  *
 ******************************************************************************/
-void check_clients(pool *p)
+client_t *alloc_slot(pool *p)
 {
-    int i, connfd, is_closed;
+    client_t *chunk, *c;
+    int i;
 
-    for (i=0; (i <= p->maxi) && (p->nready > 0); i++)
+    if (p->free_slots == NULL)
     {
-        connfd = p->clientfd[i];
+        if (p->nslots == MAX_CLIENTS)
+            return NULL;
+        if ((chunk = calloc(CLIENT_CHUNK, sizeof(client_t))) == NULL)
+            return NULL;
+        p->chunks[p->nslots / CLIENT_CHUNK] = chunk;
 
-        if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set)))
+        // linked in reverse, so the first slot of the chunk goes out first
+        for (i = CLIENT_CHUNK - 1; i >= 0; i--)
         {
-            p->nready--;
-            is_closed = 0;
-            process_request(i, p, &is_closed);
-            /*if (is_closed) */
-            remove_client(i, p);
+            chunk[i].fd = -1;
+            chunk[i].id = p->nslots + i;
+            chunk[i].next = p->free_slots;
+            p->free_slots = &chunk[i];
         }
+        p->nslots += CLIENT_CHUNK;
     }
+
+    c = p->free_slots;
+    p->free_slots = c->next;
+    c->next = NULL;
+    return c;
 }
 
 /******************************************************************************
-* subroutine: process_request                                                 *
-* purpose:    handle a single request and return responses                    *
-* parameters: id        - the index of the client in the pool                 *
-*             p         - a pointer of pool struct                            *
-*             is_closed - idicator if the transaction is closed               *
+* subroutine: free_slot                                                       *
+* purpose:    put a client slot back on the free list, where it is the first  *
+*             to be reused while its memory is still warm                     *
+* parameters: c - the slot                                                    *
+*             p - pointer to the pool instance                                *
 * return:     none                                                            *
 ******************************************************************************/
-void process_request(int id, pool *p, int *is_closed)
+void free_slot(client_t *c, pool *p)
 {
-    HTTPContext *context = (HTTPContext *)calloc(1, sizeof(HTTPContext));
+    c->fd = -1;
+    c->next = p->free_slots;
+    p->free_slots = c;
+}
 
-    Log("Start processing request. \n");
+/******************************************************************************
+* subroutine: wait_buffer                                                     *
+* purpose:    park a client that has to read but found the buffer pool at its *
+*             cap. Its socket is not read (with io_uring: no receive is       *
+*             queued) until wake_waiters() gets to it                         *
+* parameters: c - the client                                                  *
+*             p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void wait_buffer(client_t *c, pool *p)
+{
+    if (c->waiting)
+        return;
+    c->waiting = 1;
+    c->wnext = NULL;
+    c->wprev = p->wait_tail;
+    if (p->wait_tail) p->wait_tail->wnext = c;
+    else p->wait_head = c;
+    p->wait_tail = c;
+}
 
-    // parse request line (get method, uri, version)
-    if (parse_requestline(id, p, context, is_closed) < 0)
-    	goto Done;
+/******************************************************************************
+* subroutine: unwait_buffer                                                   *
+* purpose:    take a client off the list of clients waiting for a buffer      *
+* parameters: c - the client                                                  *
+*             p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void unwait_buffer(client_t *c, pool *p)
+{
+    if (c->wprev) c->wprev->wnext = c->wnext;
+    else p->wait_head = c->wnext;
+    if (c->wnext) c->wnext->wprev = c->wprev;
+    else p->wait_tail = c->wprev;
+    c->wprev = c->wnext = NULL;
+    c->waiting = 0;
+}
 
-    // check HTTP method (support GET, POST, HEAD now)
-    if (strcasecmp(context->method, "GET")  && 
-        strcasecmp(context->method, "HEAD") && 
-        strcasecmp(context->method, "POST"))
-    {
-        *is_closed = 1;
-        serve_error(p->clientfd[id], "501", "Not Implemented",
-                   "The method is not valid or not implemented by the server",
-                    *is_closed); 
-        goto Done;
-    }
+/******************************************************************************
+* subroutine: wake_waiters                                                    *
+* purpose:    let the waiting clients read, in the order they came, as long   *
+*             as the buffer pool is below its cap                             *
+* parameters: p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void wake_waiters(pool *p)
+{
+    client_t *c;
 
-    // check HTTP version
-    if (strcasecmp(context->version, "HTTP/1.1"))
+    while ((c = p->wait_head) != NULL && !bufpool_full())
     {
-        *is_closed = 1;
-        serve_error(p->clientfd[id], "505", "HTTP Version not supported",
-                    "HTTP/1.0 is not supported by Liso server", *is_closed);  
-        goto Done;
+        unwait_buffer(c, p);
+        check_client(c, p);
     }
-
-    // parse uri (get filename and parameters if any)
-    parse_uri(context);
-   
-    // parse request headers 
-    if (parse_requestheaders(id, p, context, is_closed) < 0) goto Done;
-
-/*
-    // for POST, parse request body
-    if (!strcasecmp(context->method, "POST"))
-        if (parse_requestbody(id, p, context, is_closed) < 0) goto Done;
-*/
-    // send response 
-    if (!strcasecmp(context->method, "GET"))
-        serve_get(p->clientfd[id], context, is_closed); 
-    else if (!strcasecmp(context->method, "POST")) 
-        serve_post(p->clientfd[id], context, is_closed);
-    else if (!strcasecmp(context->method, "HEAD")) 
-        serve_head(p->clientfd[id], context, is_closed);
-
-    Done:
-    free(context); 
-    Log("End of processing request. \n");
 }
 
-
 /******************************************************************************
-* subroutine: parse_requestline                                               *
-* purpose:    parse the content of request line                               *
-* parameters: id        - the index of the client in the pool                 *
-*             p         - a pointer of the pool data structure                *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
-* return:     0 on success -1 on error                                        *
+* subroutine: check_client                                                    *
+* purpose:    serve a client whose descriptor epoll reported ready. Reads     *
+*             whatever has arrived, answers every complete request in the     *
+*             buffer and sends the queued responses together; an incomplete  *
+*             request is kept and resumed on the next event. The connection   *
+*             stays open unless a request asks to close                       *
+* parameters: c - the ready client                                            *
+*             p - pointer to the pool instance                                *
+* return:     none                                                            *
 ******************************************************************************/
-int parse_requestline(int id, pool *p, HTTPContext *context, int *is_closed)
+void check_client(client_t *c, pool *p)
 {
-    char buf[MAX_LINE];
+    int rc, ret, full, body;
 
-    memset(buf, 0, MAX_LINE); 
+    // removed earlier in this round of events (by an I/O completion)
+    if (c->fd < 0)
+        return;
 
-    if (rio_readlineb(&p->clientrio[id], buf, MAX_LINE) < 0)
+    // the ring backend drives the client from its completions
+    if (STATE.use_uring)
     {
-        *is_closed = 1;
-        Log("Error: rio_readlineb error in process_request \n");
-        serve_error(p->clientfd[id], "500", "Internal Server Error",
-                    "The server encountered an unexpected condition.", *is_closed);
-        return -1;
+        uring_kick(c, p);
+        return;
     }
 
-    if (sscanf(buf, "%s %s %s", context->method, context->uri, context->version) < 3)
+    // removed while the crypto pool had it, or still there; the step's
+    // completion looks at the socket again
+    if (c->dead || c->crypto)
+        return;
+
+    touch_client(c, p);
+
+    // a TLS client shakes hands first, driven by the edges of its socket
+    // like a request is
+    if (c->ssl && !c->tls_up && (ret = tls_accept(c)) <= 0)
     {
-    	Log("Method: %s\turi: %s\tversion: %s\n", context->method, context->uri, context->version);
-        *is_closed = 1;
-        Log("Info: Invalid request line: '%s' \n", buf);
-        serve_error(p->clientfd[id], "400", "Bad Request",
-                    "The request is not understood by the server", *is_closed);
-        return -1;
+        if (ret < 0)
+            remove_client(c, p);
+        return;
+    }
+
+    // a request waiting for the disk is resumed from io_done(), one waiting
+    // for a CGI program from cgi_done(); until then only the responses queued
+    // before it (and the program's output) are sent, and the program takes
+    // the request body as it comes
+    if (c->job || c->cgi)
+    {
+        if (c->cgi && c->cgi->started && !c->cgi->in_armed &&
+            c->context->body != BODY_NONE)
+            cgi_input(c->cgi, p);
+        if ((ret = flush_client(c)) < 0)
+            remove_client(c, p);
+        else if (ret == 0 && c->cgi && c->cgi->paused)
+            cgi_resume(c->cgi, p);
+        return;
+    }
+
+    // finish the responses left from an earlier pass first. Responses go
+    // out in order, so nothing more is read until the queue has drained
+    if ((ret = flush_client(c)) != 0)
+    {
+        if (ret < 0) remove_client(c, p);
+        return;
+    }
+    if (c->closing)
+    {
+        remove_client(c, p);
+        return;
+    }
+
+    while (1)
+    {
+        // a client with nothing buffered needs a buffer from the pool to read
+        // into; at the cap it waits until another client gives one back
+        if (rio_attach(&c->rio, 0) < 0)
+        {
+            wait_buffer(c, p);
+            return;
+        }
+
+        // edge-triggered: read until the socket is drained or the buffer full.
+        // A request body is taken from the socket by parse_requestbody(),
+        // not through the buffer
+        rio_compact(c);
+        body = c->context && c->state == PS_BODY;
+        rc = body ? RIO_AGAIN : rio_fill(&c->rio);
+        if (rc == RIO_ERROR)
+        {
+            remove_client(c, p);
+            return;
+        }
+
+        // answer every complete (pipelined) request in the buffer, and the
+        // one whose disk I/O just finished
+        full = serve_buffered(c);
+
+        // and send the whole batch with one writev()
+        if ((ret = flush_client(c)) != 0)
+        {
+            if (ret < 0) remove_client(c, p);
+            return;
+        }
+
+        // peer went away, anything left in the buffer is incomplete
+        if (c->closing || rc == RIO_EOF)
+        {
+            remove_client(c, p);
+            return;
+        }
+        // the rest is read once the disk I/O (or the CGI program) is done
+        if (c->job || c->cgi)
+            return;
+        // and once a body is through, what follows it
+        if (full || (body && !(c->context && c->state == PS_BODY)))
+            continue;
+        if (rc == RIO_AGAIN)
+        {
+            // idle until the next request, which may be a while
+            rio_detach(c);
+            return;
+        }
+
+        // RIO_FULL and the parser still wants more: a bigger buffer, unless
+        // the header is too long
+        if (c->rio.rio_bufptr == c->rio.rio_buf && rio_grow(&c->rio) < 0)
+        {
+            serve_error(c, "400", "Bad Request", "Request header too long.", 1);
+            c->closing = 1;
+        }
     }
+}
+
+/******************************************************************************
+* subroutine: serve_buffered                                                  *
+* purpose:    answer every complete (pipelined) request in the read buffer,   *
+*             and the one whose disk I/O just finished, stopping at a request *
+*             that waits for more bytes or for the disk                       *
+* parameters: c - the client                                                  *
+* return:     1 if the output queue filled up first, 0 otherwise              *
+******************************************************************************/
+int serve_buffered(client_t *c)
+{
+    int ret;
+
+    while ((c->rio.rio_cnt > 0 || c->context) && !c->closing && !c->job &&
+           !c->cgi)
+    {
+        // bound the batch, the rest is parsed once it has been sent
+        if (c->out_cnt + 2 > MAX_SEGS || c->unsent_cnt == MAX_PIPELINE)
+            return 1;
+
+        ret = process_request(c, &c->is_closed);
+        if (ret == PARSE_AGAIN || ret == PARSE_BLOCKED)
+            break;
 
-    Log("Request: method=%s, uri=%s, version=%s \n",
-        context->method, context->uri, context->version);
+        c->nrequests++;
+        if (c->is_closed)
+            c->closing = 1;
+    }
     return 0;
 }
 
 /******************************************************************************
-* subroutine: parse_uri                                                       *
-* purpose:    to parse filename and CGI arguments from uri                    *
-* parameters: context - a pointer of the HTTP context data structure          *
+* subroutine: touch_client                                                    *
+* purpose:    record activity on a client by moving it to the tail of the     *
+*             idle list, so the list stays sorted by last_active              *
+* parameters: c - the active client                                           *
+*             p - pointer to the pool instance                                *
 * return:     none                                                            *
 ******************************************************************************/
-void parse_uri(HTTPContext *context)
+void touch_client(client_t *c, pool *p)
 {
-    char *ptr;
+    c->last_active = time(NULL);
 
-    ///TODO check HTTP://
-    // initialize filename path
-    strcpy(context->filename, STATE.www_path);
+    if (p->idle_tail == c)
+        return;
+
+    // unlink (a new client is not linked yet)
+    if (c->prev) c->prev->next = c->next;
+    if (c->next) c->next->prev = c->prev;
+    if (p->idle_head == c) p->idle_head = c->next;
+
+    // append
+    c->prev = p->idle_tail;
+    c->next = NULL;
+    if (p->idle_tail) p->idle_tail->next = c;
+    p->idle_tail = c;
+    if (p->idle_head == NULL) p->idle_head = c;
+}
+
+/******************************************************************************
+* subroutine: expire_clients                                                  *
+* purpose:    close the clients that have been quiet for longer than the      *
+*             keep-alive timeout. Only the expired head of the idle list is   *
+*             visited. A client waiting for the disk or its CGI program is    *
+*             not idle, it goes back to the tail of the list. One that the    *
+*             program waits for, to send more of the body or to take the      *
+*             output, times out like any other                                *
+* parameters: p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void expire_clients(pool *p)
+{
+    time_t deadline = time(NULL) - STATE.keepalive_timeout;
+    client_t *c;
+    int body;
 
-    // parse uri
-    if (!strstr(context->uri, "cgi-bin"))  // static content
+    while ((c = p->idle_head) && c->last_active <= deadline)
     {
-        context->is_static = 1;
-        strcat(context->filename, context->uri);
-        if (context->uri[strlen(context->uri)-1] == '/')
-            strcat(context->filename, "index.html");
+        // a body the socket is not read for is paused on a full stdin pipe
+        body = c->context && c->context->body != BODY_NONE;
+        if (c->job || (c->cgi && !c->cgi->paused &&
+                       (!body || c->cgi->in_armed)))
+        {
+            touch_client(c, p);
+            continue;
+        }
+        LogInfo("Info: closing idle connection on socket %d \n", c->fd);
+        remove_client(c, p);
     }
-    else
-    {                             // dynamic content
-        ptr = index(context->uri, '?');
-        if (ptr)
+}
+
+/******************************************************************************
+* subroutine: process_request                                                 *
+* purpose:    parse as much of the client's request as has arrived and return *
+*             responses once it is complete                                   *
+* parameters: c         - the client sending the request                      *
+*             is_closed - idicator if the transaction is closed               *
+* return:     PARSE_DONE when the request was answered, PARSE_ERROR when it   *
+*             was rejected, PARSE_AGAIN when more bytes are needed,           *
+*             PARSE_BLOCKED when the response waits for disk I/O              *
+******************************************************************************/
+int process_request(client_t *c, int *is_closed)
+{
+    HTTPContext *context;
+    scan_t scan;
+    uint64_t slot;
+    int ret;
+
+    if (c->context == NULL)
+    {
+        if ((c->context = arena_alloc(&c->arena, sizeof(HTTPContext))) == NULL)
         {
-            strcpy(context->cgiargs, ptr+1);
-            *ptr = '\0'; ///TODO what is this for?
+            Log("Error: no memory for a request \n");
+            *is_closed = 1;
+            return PARSE_ERROR;
         }
-        else
-        {        
-            strcpy(context->cgiargs, "");
+        memset(c->context, 0, sizeof(HTTPContext));
+        c->context->body_fd = -1;
+        c->context->body_pipe[0] = c->context->body_pipe[1] = -1;
+        c->context->t_start = alog_now();
+        c->context->queued = c->queued;
+        if (c->nrequests == 0)
+            metrics_time(M_FIRST_BYTE, c->context->t_start - c->t_accept);
+        c->state = PS_REQUESTLINE;
+        // the last request allowed on this connection says so in its reply
+        *is_closed = (c->nrequests + 1 >= STATE.max_requests);
+        LogDebug("Start processing request. \n");
+    }
+    context = c->context;
+
+    switch (c->state)
+    {
+    case PS_REQUESTLINE:
+        // parse request line (get method, uri, version), once the whole
+        // head has arrived
+        if ((ret = parse_requestline(c, context, &scan, is_closed)) != PARSE_DONE)
+            goto Done;
+
+        // check HTTP method (support GET, POST, HEAD now)
+        if (!slice_eq(context->method, "get")  &&
+            !slice_eq(context->method, "head") &&
+            !slice_eq(context->method, "post"))
+        {
+            *is_closed = 1;
+            serve_error(c, "501", "Not Implemented",
+                       "The method is not valid or not implemented by the server",
+                        *is_closed); 
+            ret = PARSE_ERROR;
+            goto Done;
+        }
+
+        // check HTTP version
+        if (!slice_eq(context->version, "http/1.1"))
+        {
+            *is_closed = 1;
+            serve_error(c, "505", "HTTP Version not supported",
+                        "HTTP/1.0 is not supported by Liso server", *is_closed);  
+            ret = PARSE_ERROR;
+            goto Done;
+        }
+
+        // parse uri (get filename and parameters if any)
+        if (parse_uri(c, context) < 0)
+        {
+            *is_closed = 1;
+            serve_error(c, "500", "Internal Server Error",
+                        "The server is out of memory.", *is_closed);
+            ret = PARSE_ERROR;
+            goto Done;
+        }
+
+        // parse request headers, scanned along with the request line
+        if ((ret = parse_requestheaders(c, context, &scan, is_closed)) != PARSE_DONE)
+            goto Done;
+        context->t_head = alog_now();
+        c->state = PS_BODY;
+
+        // a static request's body is taken before the response, into an
+        // upload file or dropped; a CGI program's is fed to its stdin, see
+        // cgi_input()
+        if (context->is_static && context->body != BODY_NONE)
+        {
+            if (slice_eq(context->method, "post") && STATE.upload_path[0] &&
+                open_upload(c, context, is_closed) < 0)
+            {
+                ret = PARSE_ERROR;
+                goto Done;
+            }
+            if (context->expect &&
+                queue_bytes(c, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0)
+            {
+                *is_closed = 1;
+                ret = PARSE_ERROR;
+                goto Done;
+            }
+        }
+        /* fall through */
+
+    case PS_BODY:
+        // (again) once more of the body has arrived
+        if (context->is_static &&
+            (ret = parse_requestbody(c, context, is_closed)) != PARSE_DONE)
+            goto Done;
+        c->state = PS_SERVE;
+        /* fall through */
+
+    case PS_SERVE:
+        // (again) once the disk I/O the response waited for is done
+        ret = PARSE_DONE;
+    }
+
+    // send response 
+    if (slice_eq(context->method, "get") && slice_eq(context->path, STATUS_URI))
+        serve_status(c, context, is_closed);
+    else if (!context->is_static)
+        serve_cgi(c, context, is_closed);
+    else if (slice_eq(context->method, "get"))
+        serve_get(c, context, is_closed); 
+    else if (slice_eq(context->method, "post"))
+        serve_post(c, context, is_closed);
+    else if (slice_eq(context->method, "head"))
+        serve_head(c, context, is_closed);
+
+    // the response is finished when the I/O pool (or the CGI program) is done
+    if (c->job || c->cgi)
+        return PARSE_BLOCKED;
+
+    Done:
+    // an incomplete request is resumed on the next read event
+    if (ret == PARSE_AGAIN)
+        return ret;
+
+    // the rest of a body that was not taken must not be taken for the next
+    // request
+    if (context->body != BODY_NONE)
+        *is_closed = 1;
+
+    slot = log_access(c, context);
+    count_request(c, context);
+    time_response(c, context->t_start, slot);
+    free_context(c);
+    LogDebug("End of processing request. \n");
+    return ret;
+}
+
+/******************************************************************************
+* subroutine: log_access                                                      *
+* purpose:    write the access log record of a request that is done. The uri *
+*             is whatever the request line had, cut to ALOG_URI bytes. The    *
+*             total time is set once the response is sent, see response_sent *
+* parameters: c       - the client                                            *
+*             context - the request                                           *
+* return:     the record's slot, 0 without an access log                      *
+******************************************************************************/
+uint64_t log_access(client_t *c, HTTPContext *context)
+{
+    alog_rec_t *rec;
+    uint64_t slot;
+
+    if ((rec = alog_next(&slot)) == NULL)
+        return 0;
+
+    rec->start = context->t_start;
+    if (context->t_head)
+        rec->head_us = context->t_head - context->t_start;
+    rec->bytes = c->queued - context->queued;
+    memcpy(rec->addr, c->addr, sizeof rec->addr);
+    rec->status = context->status;
+
+    if (slice_eq(context->method, "get"))
+        rec->method = ALOG_GET;
+    else if (slice_eq(context->method, "head"))
+        rec->method = ALOG_HEAD;
+    else if (slice_eq(context->method, "post"))
+        rec->method = ALOG_POST;
+    if (c->is_secure)
+        rec->flags |= ALOG_SECURE;
+
+    rec->uri_len = context->uri.len;
+    if (context->uri.len > ALOG_URI)
+    {
+        rec->uri_len = ALOG_URI;
+        rec->flags |= ALOG_CUT;
+    }
+    memcpy(rec->uri, context->uri.ptr, rec->uri_len);
+    return slot;
+}
+
+/******************************************************************************
+* subroutine: count_request                                                   *
+* purpose:    record the metrics of a request that is done: the time of its  *
+*             phases, its status and the bytes of its response. The total     *
+*             time is recorded once the response is sent, see response_sent  *
+* parameters: c       - the client                                            *
+*             context - the request                                           *
+* return:     none                                                            *
+******************************************************************************/
+void count_request(client_t *c, HTTPContext *context)
+{
+    if (context->t_head)
+        metrics_time(M_PARSE, context->t_head - context->t_start);
+    if (context->t_found)
+        metrics_time(M_LOOKUP, context->t_found - context->t_find);
+
+    metrics_count(C_REQUESTS, 1);
+    metrics_count(C_BYTES, c->queued - context->queued);
+    if (context->status >= 100 && context->status < 600)
+        metrics_count(C_STATUS_1XX + context->status / 100 - 1, 1);
+}
+
+/******************************************************************************
+* subroutine: time_response                                                   *
+* purpose:    time a request that is done from its start to the last byte of  *
+*             its response sent: right away if that is out already, else once *
+*             the output queue gets past the response, see sent_responses()   *
+* parameters: c       - the client                                            *
+*             t_start - alog_now() at the request's first byte                *
+*             slot    - its access log record, 0 if none                      *
+* return:     none                                                            *
+******************************************************************************/
+void time_response(client_t *c, uint64_t t_start, uint64_t slot)
+{
+    unsent_t *u;
+
+    if (c->out_head == c->out_cnt && !c->piped)
+    {
+        response_sent(t_start, slot, alog_now());
+        return;
+    }
+
+    // serve_buffered() leaves room for one; the queue is not empty, so the
+    // block is there
+    u = &c->unsent[c->unsent_cnt++];
+    u->end = c->out_cnt;
+    u->t_start = t_start;
+    u->slot = slot;
+}
+
+/* time the requests whose response has left the output queue by now */
+void sent_responses(client_t *c)
+{
+    unsent_t *u;
+    uint64_t now = 0;
+
+    while (c->unsent_head < c->unsent_cnt)
+    {
+        u = &c->unsent[c->unsent_head];
+        if (c->out_head < u->end || c->piped)
+            break;
+        if (now == 0)
+            now = alog_now();
+        response_sent(u->t_start, u->slot, now);
+        c->unsent_head++;
+    }
+}
+
+/* a request's response is sent, now it is timed */
+void response_sent(uint64_t t_start, uint64_t slot, uint64_t now)
+{
+    alog_finish(slot, now - t_start);
+    metrics_time(M_TOTAL, now - t_start);
+}
+
+/******************************************************************************
+* subroutine: serve_status                                                    *
+* purpose:    answer the status page with the metrics of this worker, as text *
+*             or, with ?format=prometheus, in the Prometheus text format      *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_status(client_t *c, HTTPContext *context, int *is_closed)
+{
+    int prometheus = slice_eq(context->query, "format=prometheus");
+    ccache_stats_t cstats;
+    bufpool_stats_t bstats;
+    cgipool_stats_t gstats;
+    tls_stats_t tstats;
+    mgauge_t gauges[15];
+    char  *body = NULL;
+    size_t blen = 0;
+    FILE  *f;
+    int    len, n = 0;
+    char   buf[BUF_SIZE];
+
+    ccache_stats(&cstats);
+    bufpool_stats(&bstats);
+    gauges[n++] = (mgauge_t){ "worker", "number of this worker", STATE.worker };
+    gauges[n++] = (mgauge_t){ "connections", "open connections",
+                              POOL->nclients };
+    gauges[n++] = (mgauge_t){ "client_slots", "client slots allocated",
+                              POOL->nslots };
+    gauges[n++] = (mgauge_t){ "buffer_bytes", "connection buffer bytes in use",
+                              bstats.in_use };
+    gauges[n++] = (mgauge_t){ "buffer_fill", "buffer bytes in use over the cap",
+                              (double)bstats.in_use / STATE.buf_bytes };
+    gauges[n++] = (mgauge_t){ "cache_bytes", "bytes in the content cache",
+                              cstats.bytes };
+    gauges[n++] = (mgauge_t){ "cache_hit_ratio", "content cache hits over lookups",
+                              cstats.hits + cstats.misses ? (double)cstats.hits /
+                              (cstats.hits + cstats.misses) : 0 };
+    gauges[n++] = (mgauge_t){ "log_dropped", "log lines dropped on full rings",
+                              log_dropped() };
+    cgipool_stats(&gstats);
+    gauges[n++] = (mgauge_t){ "cgi_workers", "CGI worker processes",
+                              gstats.workers };
+    gauges[n++] = (mgauge_t){ "cgi_busy", "CGI workers running a program",
+                              gstats.busy };
+    gauges[n++] = (mgauge_t){ "cgi_queued", "CGI requests waiting for a worker",
+                              gstats.queued };
+    gauges[n++] = (mgauge_t){ "cgi_jobs", "CGI programs started",
+                              gstats.jobs };
+    tls_stats(&tstats);
+    gauges[n++] = (mgauge_t){ "tls_handshake_rate",
+                              "TLS handshakes per second, recently",
+                              tstats.rate };
+    gauges[n++] = (mgauge_t){ "tls_resumption_ratio",
+                              "TLS handshakes that resumed a session",
+                              tstats.handshakes ? (double)tstats.resumed /
+                              tstats.handshakes : 0 };
+    gauges[n++] = (mgauge_t){ "tls_cache_hit_ratio",
+                              "TLS session ids found in the shared cache",
+                              tstats.cache_hits + tstats.cache_misses ?
+                              (double)tstats.cache_hits / (tstats.cache_hits +
+                              tstats.cache_misses) : 0 };
+
+    if ((f = open_memstream(&body, &blen)) == NULL ||
+        metrics_render(f, prometheus, gauges, n) < 0 || fclose(f) != 0)
+    {
+        if (f)
+            fclose(f);
+        free(body);
+        serve_error(c, "500", "Internal Server Error",
+                    "The server is out of memory.", *is_closed);
+        return;
+    }
+
+    len = sprintf(buf, "HTTP/1.1 200 OK\r\n");
+    len += sprintf(buf + len, "Server: Liso/1.0\r\n");
+    len += sprintf(buf + len, "Cache-Control: no-store\r\n");
+    if (*is_closed) len += sprintf(buf + len, "Connection: close\r\n");
+    len += sprintf(buf + len, "Content-Length: %zu\r\n", blen);
+    len += sprintf(buf + len, "Content-Type: %s\r\n\r\n", prometheus ?
+                   "text/plain; version=0.0.4" : "text/plain");
+    context->status = 200;
+    if (queue_bytes(c, buf, len) < 0 || queue_bytes(c, body, blen) < 0)
+        *is_closed = 1;
+    free(body);
+}
+
+/******************************************************************************
+* subroutine: free_context                                                    *
+* purpose:    drop the client's request context and the cache references it  *
+*             holds, and reset the arena it lives in                          *
+* parameters: c - the client                                                  *
+* return:     none                                                            *
+******************************************************************************/
+void free_context(client_t *c)
+{
+    HTTPContext *context = c->context;
+
+    if (context->file)
+        fcache_put(context->file);
+    if (context->blk)
+        ccache_put(context->blk);
+    // an upload that was not stored
+    if (context->upload_tmp)
+    {
+        close(context->body_pipe[0]);
+        close(context->body_pipe[1]);
+        if (context->body_fd >= 0)
+            close(context->body_fd);
+        unlink(context->upload_tmp);
+    }
+    arena_reset(&c->arena);
+    c->context = NULL;
+}
+
+
+/******************************************************************************
+* subroutine: parse_requestline                                               *
+* purpose:    scan the request head in the read buffer and take the request   *
+*             line out of it. Nothing is consumed until the whole head (up to *
+*             the empty line) has arrived                                     *
+* parameters: c         - the client sending the request                      *
+*             context   - a pointer refers to HTTP context                    *
+*             scan      - where to put the scanned head                       *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     PARSE_DONE, PARSE_AGAIN if the head is incomplete, PARSE_ERROR  *
+******************************************************************************/
+int parse_requestline(client_t *c, HTTPContext *context, scan_t *scan,
+                      int *is_closed)
+{
+    int ret;
+
+    if ((ret = scan_head(c->rio.rio_bufptr, c->rio.rio_cnt, scan)) == SCAN_AGAIN)
+        return PARSE_AGAIN;
+
+    if (ret == SCAN_DONE)
+    {
+        // the slices stay valid, consumed bytes are not overwritten before
+        // the next read
+        c->rio.rio_bufptr += scan->len;
+        c->rio.rio_cnt -= scan->len;
+    }
+
+    if (ret == SCAN_TOO_MANY)
+    {
+        *is_closed = 1;
+        LogInfo("Info: too many header fields \n");
+        serve_error(c, "400", "Bad Request",
+                    "Too many header fields.", *is_closed);
+        return PARSE_ERROR;
+    }
+
+    if (ret == SCAN_ERROR)
+    {
+        *is_closed = 1;
+        LogInfo("Info: Invalid request head \n");
+        serve_error(c, "400", "Bad Request",
+                    "The request is not understood by the server", *is_closed);
+        return PARSE_ERROR;
+    }
+
+    context->method = scan->method;
+    context->uri = scan->uri;
+    context->version = scan->version;
+
+    LogInfo("Request: method=%.*s, uri=%.*s, version=%.*s \n",
+        (int)context->method.len, context->method.ptr,
+        (int)context->uri.len, context->uri.ptr,
+        (int)context->version.len, context->version.ptr);
+    return PARSE_DONE;
+}
+
+/******************************************************************************
+* subroutine: parse_uri                                                       *
+* purpose:    to split the uri into path and CGI arguments, and build the     *
+*             filename from the path                                          *
+* parameters: c       - the client, whose arena holds the filename            *
+*             context - a pointer of the HTTP context data structure          *
+* return:     0 on success, -1 if there is no memory for the filename         *
+******************************************************************************/
+int parse_uri(client_t *c, HTTPContext *context)
+{
+    const char *q;
+    size_t len;
+
+    ///TODO check HTTP://
+    // the query is whatever follows '?', both parts stay in the read buffer
+    context->path = context->uri;
+    context->query.ptr = context->uri.ptr + context->uri.len;
+    context->query.len = 0;
+    if ((q = memchr(context->uri.ptr, '?', context->uri.len)) != NULL)
+    {
+        context->path.len = q - context->uri.ptr;
+        context->query.ptr = q + 1;
+        context->query.len = context->uri.len - context->path.len - 1;
+    }
+
+    context->is_static = !memmem(context->path.ptr, context->path.len,
+                                 "cgi-bin", 7);
+
+    // filename: the www folder, and for static content the path in it
+    len = strlen(STATE.www_path);
+    context->filename = arena_alloc(&c->arena, len + context->path.len +
+                                               sizeof("index.html"));
+    if (context->filename == NULL)
+        return -1;
+    memcpy(context->filename, STATE.www_path, len);
+    if (context->is_static)
+    {
+        memcpy(context->filename + len, context->path.ptr, context->path.len);
+        len += context->path.len;
+        if (context->path.len > 0 && context->path.ptr[context->path.len-1] == '/')
+        {
+            memcpy(context->filename + len, "index.html", 10);
+            len += 10;
         }
     }
+    context->filename[len] = '\0';
+    return 0;
 }
 
 /******************************************************************************
 * subroutine: parse_requestheaders                                            *
-* purpose:    parse the content of request headers                            *
-* parameters: id        - the index of the client in the pool                 *
-*             p         - a pointer of the pool data structure                *
+* purpose:    apply the request headers the server cares about                *
+* parameters: c         - the client sending the request                      *
 *             context   - a pointer refers to HTTP context                    *
+*             scan      - the scanned head                                    *
 *             is_closed - an indicator if the current transaction is closed   *
-* return:     0 on success -1 on error                                        *
+* return:     PARSE_DONE, PARSE_ERROR on error                                *
+******************************************************************************/
+int parse_requestheaders(client_t *c, HTTPContext *context, scan_t *scan,
+                         int *is_closed)
+{
+    header_t *h;
+    slice_t port;
+    const char *colon;
+    long len;
+    int i;
+
+    context->content_len = -1;
+
+    // keep the header fields with the request, the names and values stay in
+    // the read buffer
+    context->nheaders = scan->nheaders;
+    context->headers = arena_alloc(&c->arena, scan->nheaders * sizeof(header_t));
+    if (context->headers == NULL)
+    {
+        *is_closed = 1;
+        serve_error(c, "500", "Internal Server Error",
+                    "The server is out of memory.", *is_closed);
+        return PARSE_ERROR;
+    }
+    memcpy(context->headers, scan->headers, scan->nheaders * sizeof(header_t));
+
+    for (i = 0; i < scan->nheaders; i++)
+    {
+        h = &scan->headers[i];
+        switch (h->id)
+        {
+        case HDR_HOST:
+            // the port after the last colon, unless that is inside [IPv6]
+            colon = memrchr(h->value.ptr, ':', h->value.len);
+            if (colon && !memchr(colon, ']', h->value.ptr + h->value.len - colon))
+            {
+                port.ptr = colon + 1;
+                port.len = h->value.ptr + h->value.len - port.ptr;
+                if (slice_tol(port) == STATE.s_port)
+                {
+                    context->is_secure = 1;
+                    LogDebug("Secure connection \n");
+                }
+            }
+            break;
+
+        case HDR_CONNECTION:
+            if (slice_has(h->value, "close"))
+                *is_closed = 1;
+            break;
+
+        case HDR_CONTENT_LENGTH:
+            context->has_contentlen = 1;
+            if ((len = slice_tol(h->value)) < 0)
+            {
+                *is_closed = 1;
+                serve_error(c, "400", "Bad Request",
+                            "Invalid Content-Length.", *is_closed);
+                return PARSE_ERROR;
+            }
+            // refused before a byte of it is read
+            if (len > STATE.max_body)
+            {
+                *is_closed = 1;
+                serve_error(c, "413", "Content Too Large",
+                            "The request body is too large.", *is_closed);
+                return PARSE_ERROR;
+            }
+            context->content_len = (int)len;
+            LogDebug("Debug: content-length=%d \n", context->content_len);
+            break;
+
+        case HDR_TRANSFER_ENCODING:
+            if (!slice_eq(h->value, "chunked"))
+            {
+                *is_closed = 1;
+                serve_error(c, "501", "Not Implemented",
+                            "Only the chunked transfer coding is supported",
+                            *is_closed);
+                return PARSE_ERROR;
+            }
+            context->chunked = 1;
+            break;
+
+        case HDR_EXPECT:
+            if (!slice_eq(h->value, "100-continue"))
+            {
+                *is_closed = 1;
+                serve_error(c, "417", "Expectation Failed",
+                            "Only 100-continue is supported", *is_closed);
+                return PARSE_ERROR;
+            }
+            context->expect = 1;
+            break;
+        }
+    }
+
+    if (!context->has_contentlen && !context->chunked &&
+        slice_eq(context->method, "post"))
+    {
+        serve_error(c, "411", "Length Required",
+                       "Content-Length is required.", *is_closed);
+        return PARSE_ERROR;
+    }
+
+    // the body follows the head, chunked (which wins over a Content-Length,
+    // RFC 9112 6.3) or with the announced length
+    if (context->chunked)
+    {
+        context->content_len = -1;
+        context->body = BODY_SIZE;
+    }
+    else if (context->content_len > 0)
+    {
+        context->body = BODY_DATA;
+        context->body_left = context->body_len = context->content_len;
+    }
+
+    return PARSE_DONE;
+}
+
+/******************************************************************************
+* subroutine: parse_requestbody                                               *
+* purpose:    take the request body, as far as it has arrived, and pass it to *
+*             context->body_fd: a CGI program's stdin, an upload file, or     *
+*             nowhere (-1). Whatever came along with the head is written     *
+*             from the read buffer; the rest is spliced from the socket, so  *
+*             the body never goes through a buffer of ours and a client can  *
+*             send no more than the destination takes. A chunked body is     *
+*             taken apart here, the size lines are read a line at a time     *
+* parameters: c         - the client sending the request                      *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     PARSE_DONE once the body is through, PARSE_AGAIN until more of  *
+*             it arrives, PARSE_BLOCKED while the destination is full,        *
+*             PARSE_ERROR if the client went away or sent a bad chunk         *
+******************************************************************************/
+int parse_requestbody(client_t *c, HTTPContext *context, int *is_closed)
+{
+    char *end;
+    long long size;
+    int ret, len;
+
+    while (context->body != BODY_NONE)
+    {
+        if (context->body == BODY_DATA)
+        {
+            if ((ret = body_data(c, context)) != PARSE_DONE)
+            {
+                if (ret == PARSE_AGAIN)
+                    return wait_body(c);
+                if (ret == PARSE_ERROR)
+                    *is_closed = 1;
+                return ret;
+            }
+            if (context->body_left == 0)
+                context->body = context->chunked ? BODY_CRLF : BODY_NONE;
+            continue;
+        }
+
+        // the chunked framing: a size line, the CRLF after the data, the
+        // trailer fields up to an empty line
+        if ((ret = body_line(c, context)) == 0)
+            return wait_body(c);
+        if (ret < 0)
+            goto Bad;
+        len = context->llen;
+        context->llen = 0;
+        while (len > 0 && (context->line[len - 1] == '\n' ||
+                           context->line[len - 1] == '\r'))
+            len--;
+        context->line[len] = '\0';
+
+        switch (context->body)
+        {
+        case BODY_SIZE:
+            size = strtoll(context->line, &end, 16);
+            if (end == context->line || (*end && *end != ';' && *end != ' ') ||
+                size < 0)
+                goto Bad;
+            if (size > STATE.max_body - context->body_len)
+            {
+                if (!c->cgi)
+                    serve_error(c, "413", "Content Too Large",
+                                "The request body is too large.", 1);
+                *is_closed = 1;
+                return PARSE_ERROR;
+            }
+            context->body_len += size;
+            context->body_left = size;
+            context->body = size > 0 ? BODY_DATA : BODY_TRAILER;
+            break;
+
+        case BODY_CRLF:
+            if (len > 0)
+                goto Bad;
+            context->body = BODY_SIZE;
+            break;
+
+        case BODY_TRAILER:
+            if (len == 0)
+                context->body = BODY_NONE;
+            break;
+        }
+    }
+    return PARSE_DONE;
+
+    Bad:
+    // the response to a CGI request may be on its way already
+    if (!c->cgi)
+        serve_error(c, "400", "Bad Request", "Malformed chunked body.", 1);
+    *is_closed = 1;
+    return PARSE_ERROR;
+}
+
+/******************************************************************************
+* subroutine: body_data                                                       *
+* purpose:    move the next bytes of the body (or of the chunk) to where they *
+*             go: from the read buffer with write(), from the socket with     *
+*             splice() into a pipe, through the context's pipe into a file,  *
+*             or dropped with recv(MSG_TRUNC). Only what the socket holds is  *
+*             taken, so a blocking socket (io_uring) does not block. A       *
+*             destination that fails (a program that closed its stdin, a     *
+*             full disk) is given up, and the rest of the body dropped       *
+* parameters: c       - the client                                            *
+*             context - a pointer refers to HTTP context                      *
+* return:     PARSE_DONE when some bytes were moved, PARSE_AGAIN if the       *
+*             socket is empty, PARSE_BLOCKED if the destination is full,      *
+*             PARSE_ERROR if the client went away                             *
+******************************************************************************/
+int body_data(client_t *c, HTTPContext *context)
+{
+    static char rec[TLS_RECORD];
+    rio_t *rp = &c->rio;
+    int buffered = rp->rio_cnt > 0, spliced = 0, avail;
+    size_t want;
+    ssize_t n, m;
+    char byte;
+
+    if (buffered)
+    {
+        want = context->body_left < rp->rio_cnt ? context->body_left :
+                                                   rp->rio_cnt;
+        n = context->body_fd < 0 ? (ssize_t)want :
+            write(context->body_fd, rp->rio_bufptr, want);
+    }
+    else if (c->ssl && (context->body_fd < 0 || !(c->ktls & KTLS_RX) ||
+                        tls_pending(c->ssl)))
+    {
+        // TLS records are opened in user space: peeked at, and taken once
+        // the destination took them. With kTLS, the kernel opens them and
+        // the socket is spliced from like a plain one, once OpenSSL holds
+        // none of its bytes
+        if ((n = tls_peek(c->ssl, rec, sizeof rec)) < 0 && errno == EAGAIN)
+            return PARSE_AGAIN;
+        if (n <= 0)
+            return PARSE_ERROR;
+        want = context->body_left < n ? context->body_left : n;
+        n = context->body_fd < 0 ? (ssize_t)want :
+            write(context->body_fd, rec, want);
+        if (n > 0)
+            tls_read(c->ssl, rec, n);
+    }
+    else
+    {
+        // how much has arrived; nothing yet, or the end of the stream
+        if ((n = recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT)) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return PARSE_AGAIN;
+        if (n <= 0 || ioctl(c->fd, FIONREAD, &avail) < 0)
+            return PARSE_ERROR;
+        want = context->body_left < avail ? context->body_left : avail;
+        if (want > SPLICE_CHUNK)
+            want = SPLICE_CHUNK;
+
+        if (context->body_fd < 0)
+            n = recv(c->fd, NULL, want, MSG_TRUNC | MSG_DONTWAIT);
+        else
+        {
+            n = splice(c->fd, NULL, context->upload_tmp ?
+                       context->body_pipe[1] : context->body_fd, NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            spliced = context->upload_tmp != NULL;
+        }
+        if (n == 0)
+            return PARSE_ERROR;
+        // a kTLS record that is no data (an alert), or a forged one
+        if (n < 0 && c->ssl && (errno == EINVAL || errno == EIO ||
+                                errno == EBADMSG))
+            return PARSE_ERROR;
+    }
+
+    if (n < 0 && errno == EINTR)
+        return PARSE_DONE;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return context->body_fd < 0 ? PARSE_AGAIN : PARSE_BLOCKED;
+    if (n < 0 && context->body_fd < 0)
+        return PARSE_ERROR;
+    if (n < 0)
+    {
+        // a program that closed its stdin, a full disk: the rest of the
+        // body is dropped
+        context->body_err = errno;
+        if (context->upload_tmp)
+        {
+            Log("Error: writing upload %s: %s \n", context->upload,
+                strerror(errno));
+            close(context->body_fd);
+        }
+        else
+            LogDebug("CGI program took no more of the body: %s \n",
+                     strerror(errno));
+        context->body_fd = -1;
+        return PARSE_DONE;
+    }
+
+    // an upload's pipe is emptied into the file right away
+    if (spliced && n > 0 && context->body_fd >= 0)
+        for (want = n; want > 0; want -= m)
+            if ((m = splice(context->body_pipe[0], NULL, context->body_fd,
+                            NULL, want, SPLICE_F_MOVE)) <= 0)
+            {
+                if (m < 0 && errno == EINTR)
+                {
+                    m = 0;
+                    continue;
+                }
+                context->body_err = m < 0 ? errno : ENOSPC;
+                Log("Error: writing upload %s: %s \n", context->upload,
+                    strerror(context->body_err));
+                close(context->body_fd);
+                context->body_fd = -1;
+                break;
+            }
+
+    if (buffered)
+    {
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+    }
+    context->body_left -= n;
+    return PARSE_DONE;
+}
+
+/******************************************************************************
+* subroutine: body_line                                                       *
+* purpose:    read a line of the chunked framing into context->line, from the *
+*             read buffer or else from the socket: peeked at first, then only *
+*             the line itself is taken, so the chunk data behind it is left   *
+*             for splice()                                                    *
+* parameters: c       - the client                                            *
+*             context - a pointer refers to HTTP context                      *
+* return:     1 with the line complete, 0 until more arrives, -1 if the line  *
+*             is too long or the client went away                             *
+******************************************************************************/
+int body_line(client_t *c, HTTPContext *context)
+{
+    rio_t *rp = &c->rio;
+    char buf[MIN_LINE], *src, *lf;
+    size_t room;
+    ssize_t n;
+
+    while ((room = sizeof context->line - 1 - context->llen) > 0)
+    {
+        if (rp->rio_cnt > 0)
+        {
+            src = rp->rio_bufptr;
+            n = (size_t)rp->rio_cnt < room ? (size_t)rp->rio_cnt : room;
+        }
+        else
+        {
+            src = buf;
+            if ((n = sock_recv(c, buf, room, 1)) < 0 &&
+                (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return 0;
+            if (n <= 0)
+                return -1;
+        }
+
+        if ((lf = memchr(src, '\n', n)) != NULL)
+            n = lf - src + 1;
+        memcpy(context->line + context->llen, src, n);
+        context->llen += n;
+        if (src == buf)
+            sock_recv(c, buf, n, 0);                // what was peeked
+        else
+        {
+            rp->rio_bufptr += n;
+            rp->rio_cnt -= n;
+        }
+        if (lf)
+            return 1;
+    }
+    return -1;
+}
+
+/* the request body waits for the client: epoll reports the socket readable
+ * anyway, the ring is asked to with a poll */
+int wait_body(client_t *c)
+{
+    if (!STATE.use_uring || c->body_armed)
+        return PARSE_AGAIN;
+    if (watch_pipe(c, c->fd, POLLIN) < 0)
+        return PARSE_ERROR;
+    c->uops++;
+    c->body_armed = 1;
+    return PARSE_AGAIN;
+}
+
+/******************************************************************************
+* subroutine: open_upload                                                     *
+* purpose:    open the file a POST body is stored in: a temporary file in the *
+*             upload folder, renamed after the last component of the path by  *
+*             serve_post() once the whole body is in                          *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 on success, -1 after an error response                        *
+******************************************************************************/
+int open_upload(client_t *c, HTTPContext *context, int *is_closed)
+{
+    const char *end = context->path.ptr + context->path.len, *name = end;
+    size_t dlen = strlen(STATE.upload_path);
+    int fd;
+
+    while (name > context->path.ptr && name[-1] != '/')
+        name--;
+    if (name == end || (end - name <= 2 && name[0] == '.' &&
+                        end[-1] == '.') ||
+        dlen + 1 + (end - name) >= MAX_PATH)
+    {
+        *is_closed = 1;
+        serve_error(c, "403", "Forbidden",
+                    "Server couldn't store the body under this name", 1);
+        return -1;
+    }
+
+    context->upload = arena_alloc(&c->arena, dlen + 1 + (end - name) + 1);
+    context->upload_tmp = arena_alloc(&c->arena, dlen + sizeof "/.upload-XXXXXX");
+    if (context->upload == NULL || context->upload_tmp == NULL)
+    {
+        context->upload_tmp = NULL;
+        goto Failed;
+    }
+    sprintf(context->upload, "%s/%.*s", STATE.upload_path, (int)(end - name),
+            name);
+    sprintf(context->upload_tmp, "%s/.upload-XXXXXX", STATE.upload_path);
+
+    if ((fd = mkostemp(context->upload_tmp, O_CLOEXEC)) < 0)
+    {
+        context->upload_tmp = NULL;
+        goto Failed;
+    }
+    if (pipe2(context->body_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        close(fd);
+        unlink(context->upload_tmp);
+        context->upload_tmp = NULL;
+        goto Failed;
+    }
+    context->body_fd = fd;
+    return 0;
+
+    Failed:
+    Log("Error: opening upload for %s: %s \n", STATE.upload_path,
+        strerror(errno));
+    *is_closed = 1;
+    serve_error(c, "500", "Internal Server Error",
+                "Server couldn't store the request body", 1);
+    return -1;
+}
+
+/******************************************************************************
+* subroutine: serve_get                                                       *
+* purpose:    return response for GET request                                 *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_get(client_t *c, HTTPContext *context, int *is_closed)
+{
+    if (validate_file(c, context, is_closed) != 0)
+        return;
+
+    // small files go out of the content cache
+    if (serve_cached(c, context, is_closed) >= 0)
+        return;
+
+    if (serve_head(c, context, is_closed) == 0)
+        serve_body(c, context, is_closed);
+}
+
+/******************************************************************************
+* subroutine: serve_cached                                                    *
+* purpose:    answer a GET from the content cache. Only the status line, Date *
+*             and Connection headers are formatted per request; the rest of   *
+*             the header block and the body are sent straight from the cached *
+*             block. On a miss the block is built and cached first            *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context, the file is       *
+*                         already validated                                   *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 if the response was queued, -1 if the file is not cacheable,  *
+*             1 if the body is being read by the I/O pool                     *
+******************************************************************************/
+int serve_cached(client_t *c, HTTPContext *context, int *is_closed)
+{
+    struct tm tm;
+    fentry_t *file = context->file;
+    cblock_t *blk;
+    time_t now;
+    int    len, ret;
+    char   buf[BUF_SIZE], dbuf[MIN_LINE];
+
+    if (context->blk)
+    {
+        // filled by the I/O pool and cached on completion
+        blk = context->blk;
+        context->blk = NULL;
+    }
+    else if ((blk = ccache_get(file)) == NULL)
+    {
+        if (!ccache_admits(file->size))
+            return -1;
+
+        len = sprintf(buf, "Server: Liso/1.0\r\n");
+        len += sprintf(buf + len, "Content-Length: %lld\r\n", (long long)file->size);
+        len += sprintf(buf + len, "Content-Type: %s\r\n", file->type);
+        len += sprintf(buf + len, "Last-Modified: %s\r\n\r\n", file->lastmod);
+        if ((blk = ccache_alloc(file, buf, len)) == NULL)
+            return -1;
+
+        if ((ret = read_block(c, context, blk)) != 0)
+        {
+            ccache_put(blk);
+            return ret;
+        }
+        ccache_insert(file, blk);
+    }
+
+    // get time string
+    now = time(0);
+    tm = *gmtime(&now);
+    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+
+    len = sprintf(buf, "HTTP/1.1 200 OK\r\n");
+    len += sprintf(buf + len, "Date: %s\r\n", dbuf);
+    if (*is_closed) len += sprintf(buf + len, "Connection: close\r\n");
+    context->status = 200;
+
+    if (queue_bytes(c, buf, len) < 0 || queue_mem(c, blk, 0, blk->len) < 0)
+    {
+        Log("Error: Cann't queue response \n");
+        *is_closed = 1;
+    }
+
+    ccache_put(blk);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: serve_head                                                      *
+* purpose:    return response header to client                                *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 on success, -1 if an error response was sent instead          *
+******************************************************************************/
+int serve_head(client_t *c, HTTPContext *context, int *is_closed)
+{
+    struct tm tm;
+    fentry_t *file;
+    time_t now;
+    int    len;
+    char   buf[BUF_SIZE], dbuf[MIN_LINE]; 
+
+    if (validate_file(c, context, is_closed) != 0) return -1;
+    file = context->file;
+
+    // get time string
+    now = time(0);
+    tm = *gmtime(&now);
+    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+
+    // send response headers to client
+    len = sprintf(buf, "HTTP/1.1 200 OK\r\n");
+    len += sprintf(buf + len, "Date: %s\r\n", dbuf);
+    len += sprintf(buf + len, "Server: Liso/1.0\r\n");
+    if (*is_closed) len += sprintf(buf + len, "Connection: close\r\n");
+    len += sprintf(buf + len, "Content-Length: %lld\r\n", (long long)file->size);
+    len += sprintf(buf + len, "Content-Type: %s\r\n", file->type);
+    len += sprintf(buf + len, "Last-Modified: %s\r\n\r\n", file->lastmod);
+    context->status = 200;
+    return queue_bytes(c, buf, len);
+}
+
+/******************************************************************************
+* subroutine: validate_file                                                   *
+* purpose:    validate file existence and permisson. The file is looked up in *
+*             the file cache and kept in the context for the response         *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 on success, -1 on error, 1 if the file is being opened by the *
+*             I/O pool                                                        *
+******************************************************************************/
+int validate_file(client_t *c, HTTPContext *context, int *is_closed)
+{
+    int ret;
+
+    if ((ret = find_file(c, context)) >= 0)
+        return ret;
+
+    // check file existence
+    if (errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG)
+        serve_error(c, "404", "Not Found",
+                    "Server couldn't find this file", *is_closed);
+    // check file permission
+    else if (errno == EACCES)
+        serve_error(c, "403", "Forbidden",
+                    "Server couldn't read this file", *is_closed);
+    else
+    {
+        Log("Error: Cann't open file %s: %s \n", context->filename, strerror(errno));
+        serve_error(c, "500", "Internal Server Error",
+                    "Server couldn't open this file", *is_closed);
+    }
+    return -1;
+}
+
+/******************************************************************************
+* subroutine: find_file                                                       *
+* purpose:    get the requested file from the file cache. On a miss the file  *
+*             is opened by the I/O pool and the request resumed after that,   *
+*             or right here if there is no pool                               *
+* parameters: c       - the client                                            *
+*             context - a pointer refers to HTTP context                      *
+* return:     0 when context->file is set, 1 if the I/O pool is opening the   *
+*             file, -1 with errno set if it cannot be opened                  *
+******************************************************************************/
+int find_file(client_t *c, HTTPContext *context)
+{
+    iojob_t *job;
+
+    if (context->t_find == 0)
+        context->t_find = alog_now();
+    if (context->file_err)
+    {
+        errno = context->file_err;
+        goto Found;
+    }
+    if (context->file ||
+        (context->file = fcache_find(context->filename)) != NULL)
+        goto Found;
+
+    if (STATE.io_threads == 0 && !STATE.use_uring)
+    {
+        context->file = fcache_get(context->filename);
+        goto Found;
+    }
+
+    if ((job = new_job(c, IO_OPEN, NULL)) == NULL ||
+        (job->path = strdup(context->filename)) == NULL)
+    {
+        if (job) { c->job = NULL; free(job); }
+        errno = ENOMEM;
+        return -1;
+    }
+    submit_job(job);
+    return 1;
+
+    Found:
+    // timed once, however often the response asks for the file
+    if (context->t_found == 0)
+        context->t_found = alog_now();
+    return context->file ? 0 : -1;
+}
+
+/******************************************************************************
+* subroutine: serve_body                                                      *
+* purpose:    queue the response body. Small files are read into the write    *
+*             buffer so a pipelined batch still goes out in one writev();     *
+*             larger ones are queued as a file range for sendfile(), which    *
+*             resumes at the saved offset whenever the socket fills up        *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 on success -1 on error                                        *
+******************************************************************************/
+int serve_body(client_t *c, HTTPContext *context, int *is_closed)
+{
+    fentry_t *file = context->file;
+    off_t filesize = file->size;
+    int flags = (STATE.io_threads || STATE.use_uring) ? RWF_NOWAIT : 0;
+    struct iovec iov;
+    ssize_t n;
+    off_t done = 0;
+
+    if (filesize == 0)
+        return 0;
+
+    // whatever part of a small file is not in the page cache goes the
+    // sendfile() way, whose reads are done ahead by the I/O pool
+    if (filesize <= SMALL_FILE)
+    {
+        if ((iov.iov_base = queue_reserve(c, filesize)) == NULL)
+        {
+            *is_closed = 1;   // the header already promised a body
+            return -1;
+        }
+        iov.iov_len = filesize;
+        while ((n = preadv2(file->fd, &iov, 1, 0, flags)) < 0 && errno == EINTR)
+            ;
+        if (n > 0)
+            done = n;
+        else if (n == 0 || !flags || (errno != EAGAIN && errno != EOPNOTSUPP))
+        {
+            Log("Error: Cann't read file %s \n", file->path);
+            *is_closed = 1;
+            return -1;
+        }
+        // a short read without RWF_NOWAIT means the file shrank
+        if (done < filesize && !flags)
+        {
+            Log("Error: Cann't read file %s \n", file->path);
+            *is_closed = 1;
+            return -1;
+        }
+        if (queue_commit(c, done) < 0)
+        {
+            *is_closed = 1;
+            return -1;
+        }
+        if (done == filesize)
+            return 0;
+    }
+
+    if (queue_file(c, file, done, filesize - done) < 0)
+    {
+        *is_closed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: serve_post                                                      *
+* purpose:    return response for POST request. With an upload folder the     *
+*             body is in a temporary file by now, which gets its name here    *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_post(client_t *c, HTTPContext *context, int *is_closed)
+{
+    struct tm tm;
+    time_t now;
+    int    len, ret;
+    char   buf[BUF_SIZE], dbuf[MIN_LINE]; 
+
+    if (context->upload_tmp)
+    {
+        ret = -1;
+        if (context->body_err == 0 && fchmod(context->body_fd, 0644) == 0 &&
+            (ret = rename(context->upload_tmp, context->upload)) < 0)
+            Log("Error: storing upload %s: %s \n", context->upload,
+                strerror(errno));
+        if (context->body_fd >= 0)
+            close(context->body_fd);
+        close(context->body_pipe[0]);
+        close(context->body_pipe[1]);
+        if (ret < 0)
+            unlink(context->upload_tmp);
+        context->upload_tmp = NULL;
+        if (ret < 0)
+        {
+            serve_error(c, "500", "Internal Server Error",
+                        "Server couldn't store the request body", *is_closed);
+            return;
+        }
+    }
+    else
+    {
+        // check file existence, an unreadable file gets its 403 from
+        // serve_get
+        if ((ret = find_file(c, context)) > 0)
+            return;
+        if (ret == 0 || (errno != ENOENT && errno != ENOTDIR))
+        {
+            serve_get(c, context, is_closed);
+            return;
+        }
+    }
+
+    // get time string
+    now = time(0);
+    tm = *gmtime(&now);
+    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+
+    // send response headers to client
+    context->status = context->upload ? 201 : 204;
+    len = sprintf(buf, context->upload ? "HTTP/1.1 201 Created\r\n" :
+                                         "HTTP/1.1 204 No Content\r\n");
+    len += sprintf(buf + len, "Date: %s\r\n", dbuf);
+    len += sprintf(buf + len, "Server: Liso/1.0\r\n");
+    if (*is_closed) len += sprintf(buf + len, "Connection: close\r\n");
+    if (context->upload && context->path.len < BUF_SIZE / 2)
+        len += sprintf(buf + len, "Location: %.*s\r\n",
+                       (int)context->path.len, context->path.ptr);
+    len += sprintf(buf + len, "Content-Length: 0\r\n");
+    len += sprintf(buf + len, "Content-Type: text/html\r\n\r\n");
+    queue_bytes(c, buf, len);
+}
+ 
+/******************************************************************************
+* subroutine: serve_cgi                                                       *
+* purpose:    run the CGI program a request names and send what it writes.    *
+*             With a CGI folder the first path component after cgi-bin names *
+*             the program, with a single script that script gets every such  *
+*             request; the rest of the path is its PATH_INFO. The program is *
+*             started by the CGI pool and its output sent from cgi_output(); *
+*             the request is finished from cgi_done()                         *
+* parameters: c         - the client                                          *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_cgi(client_t *c, HTTPContext *context, int *is_closed)
+{
+    const char *end = context->path.ptr + context->path.len, *info;
+    char   real[PATH_MAX], addr[INET6_ADDRSTRLEN], buf[MIN_LINE], var[MIN_LINE];
+    cgireq_t *req;
+    header_t *h;
+    char  *env = NULL;
+    size_t len = 0;
+    int    i, j, err = 0;
+
+    // resumed once the program's response is queued
+    if (context->cgi_done)
+        return;
+
+    info = (const char *)memmem(context->path.ptr, context->path.len,
+                                "cgi-bin", 7) + 7;
+    if (find_script(&info, end, real) < 0)
+        err = errno;
+    if (err == ENOENT || err == ENOTDIR || err == ENAMETOOLONG)
+    {
+        serve_error(c, "404", "Not Found",
+                    "Server couldn't find this CGI program", *is_closed);
+        return;
+    }
+    if (err)
+    {
+        serve_error(c, "403", "Forbidden",
+                    "Server couldn't run this CGI program", *is_closed);
+        return;
+    }
+
+    // the peer address is only known with an access log
+    if (!STATE.alog_path[0])
+        get_peer(c);
+    if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)c->addr))
+        inet_ntop(AF_INET, c->addr + 12, addr, sizeof addr);
+    else
+        inet_ntop(AF_INET6, c->addr, addr, sizeof addr);
+
+    // the program's path, then its environment (RFC 3875)
+    if ((env = malloc(CGI_ENV_MAX)) == NULL)
+        goto Failed;
+    len = strlen(real) + 1;
+    memcpy(env, real, len);
+    sprintf(buf, "%d", c->is_secure ? STATE.s_port : STATE.port);
+    if (cgi_env(env, &len, "GATEWAY_INTERFACE", "CGI/1.1", 7) < 0 ||
+        cgi_env(env, &len, "SERVER_SOFTWARE", "Liso/1.0", 8) < 0 ||
+        cgi_env(env, &len, "SERVER_PROTOCOL", "HTTP/1.1", 8) < 0 ||
+        cgi_env(env, &len, "SERVER_PORT", buf, strlen(buf)) < 0 ||
+        cgi_env(env, &len, "REQUEST_METHOD", context->method.ptr,
+                context->method.len) < 0 ||
+        cgi_env(env, &len, "REQUEST_URI", context->uri.ptr,
+                context->uri.len) < 0 ||
+        cgi_env(env, &len, "QUERY_STRING", context->query.ptr,
+                context->query.len) < 0 ||
+        cgi_env(env, &len, "SCRIPT_NAME", context->path.ptr,
+                info - context->path.ptr) < 0 ||
+        cgi_env(env, &len, "PATH_INFO", info, end - info) < 0 ||
+        cgi_env(env, &len, "REMOTE_ADDR", addr, strlen(addr)) < 0 ||
+        (c->is_secure && cgi_env(env, &len, "HTTPS", "on", 2) < 0))
+        goto Failed;
+
+    for (i = 0; i < context->nheaders; i++)
+    {
+        // Proxy: would be HTTP_PROXY, which programs take for the proxy
+        // they connect through (httpoxy)
+        if (cgi_var(&context->headers[i], buf, sizeof buf) < 0 ||
+            strcmp(buf, "HTTP_PROXY") == 0)
+            continue;
+        for (j = 0; j < i; j++)
+            if (cgi_var(&context->headers[j], var, sizeof var) == 0 &&
+                strcmp(var, buf) == 0)
+                break;
+        if (j < i)
+            continue;
+
+        // a repeated field is one variable, its values joined with ", "
+        h = &context->headers[i];
+        if (cgi_env(env, &len, buf, h->value.ptr, h->value.len) < 0)
+            goto Failed;
+        for (j = i + 1; j < context->nheaders; j++)
+        {
+            h = &context->headers[j];
+            if (cgi_var(h, var, sizeof var) == 0 && strcmp(var, buf) == 0 &&
+                cgi_env_join(env, &len, h->value.ptr, h->value.len) < 0)
+                goto Failed;
+        }
+    }
+
+    if ((req = malloc(sizeof(cgireq_t))) == NULL)
+    {
+        free(env);
+        env = NULL;
+        goto Failed;
+    }
+    req->job.type = EV_CGIOUT;
+    req->job.msg = env;
+    req->job.len = len;
+    req->job.owner = c;
+    req->in.type = EV_CGIIN;
+    req->in.req = req;
+    req->is_head = slice_eq(context->method, "head");
+    req->started = req->in_armed = 0;
+    req->head_done = req->exited = req->paused = req->failed = 0;
+    req->chunked = req->discard = 0;
+    req->left = -1;
+    req->hlen = 0;
+    if (cgipool_submit(&req->job) < 0)
+    {
+        Log("Error: Cann't start CGI program %s: %s \n", real, strerror(errno));
+        free(req->job.msg);
+        free(req);
+        serve_error(c, "503", "Service Unavailable",
+                    "No CGI worker could run the program", *is_closed);
+        return;
+    }
+
+    c->cgi = req;
+    // a client that waits to be told sends the body once the program is on
+    // its way
+    if (context->expect && context->body != BODY_NONE &&
+        queue_bytes(c, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0)
+        *is_closed = 1;
+    return;
+
+    Failed:
+    if (env)
+    {
+        free(env);
+        serve_error(c, "431", "Request Header Fields Too Large",
+                    "The request headers do not fit the CGI environment",
+                    *is_closed);
+    }
+    else
+        serve_error(c, "500", "Internal Server Error",
+                    "The server is out of memory.", *is_closed);
+}
+
+/******************************************************************************
+* subroutine: read_block                                                      *
+* purpose:    read the body of a new content cache block. Whatever is in the  *
+*             page cache is read right away with preadv2(RWF_NOWAIT); the     *
+*             rest is read by the I/O pool, which then resumes the request    *
+* parameters: c       - the client                                            *
+*             context - a pointer refers to HTTP context                      *
+*             blk     - the new block                                         *
+* return:     0 when the body is read, 1 if the I/O pool is reading it, -1 on *
+*             error                                                           *
+******************************************************************************/
+int read_block(client_t *c, HTTPContext *context, cblock_t *blk)
+{
+    fentry_t *file = context->file;
+    char *body = blk->data + blk->hdr_len;
+    int flags = (STATE.io_threads || STATE.use_uring) ? RWF_NOWAIT : 0;
+    struct iovec iov;
+    iojob_t *job;
+    off_t done = 0;
+    ssize_t n;
+
+    while (done < file->size)
+    {
+        iov.iov_base = body + done;
+        iov.iov_len = file->size - done;
+        if ((n = preadv2(file->fd, &iov, 1, done, flags)) > 0)
+        {
+            done += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        // not (all) in the page cache, or no RWF_NOWAIT on this filesystem
+        if (n < 0 && flags && (errno == EAGAIN || errno == EOPNOTSUPP))
+            break;
+
+        Log("Error: Cann't read file %s \n", file->path);
+        return -1;
+    }
+    if (done == file->size)
+        return 0;
+
+    if ((job = new_job(c, IO_PREAD, file)) == NULL)
+        return -1;
+    job->blk = blk;
+    ccache_hold(blk);
+    job->buf = body + done;
+    job->off = done;
+    job->len = file->size - done;
+    submit_job(job);
+    return 1;
+}
+
+/******************************************************************************
+* subroutine: warm_window                                                     *
+* purpose:    make sure the next READAHEAD_WINDOW bytes of a file segment are *
+*             in the page cache before sendfile() goes there, so it does not  *
+*             block the loop. The first and last byte of the window are       *
+*             probed with preadv2(RWF_NOWAIT); if either is missing the I/O   *
+*             pool reads the window ahead                                     *
+* parameters: c - the client                                                  *
+*             s - the file segment at the head of the output queue            *
+* return:     0 if the window is warm, 1 if the I/O pool is reading it        *
+******************************************************************************/
+int warm_window(client_t *c, seg_t *s)
+{
+    size_t len = s->len < READAHEAD_WINDOW ? s->len : READAHEAD_WINDOW;
+    struct iovec iov;
+    iojob_t *job;
+    char byte;
+
+    if (c->job)
+        return 1;
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    if (preadv2(s->file->fd, &iov, 1, s->off, RWF_NOWAIT) == 1 &&
+        preadv2(s->file->fd, &iov, 1, s->off + len - 1, RWF_NOWAIT) == 1)
+    {
+        s->ra_end = s->off + len;
+        return 0;
+    }
+
+    // no pool job then: sendfile() just reads the window itself
+    if ((job = new_job(c, IO_READAHEAD, s->file)) == NULL)
+    {
+        s->ra_end = s->off + len;
+        return 0;
+    }
+    job->off = s->off;
+    job->len = len;
+    job->seg = s;
+    submit_job(job);
+    return 1;
+}
+
+/******************************************************************************
+* subroutine: new_job                                                         *
+* purpose:    make an I/O pool job for a client, which waits for it from now  *
+* parameters: c    - the client                                               *
+*             op   - IO_OPEN, IO_PREAD or IO_READAHEAD                        *
+*             file - the file to read, the job holds a reference; NULL for    *
+*                    IO_OPEN                                                  *
+* return:     the job, NULL on error                                          *
+******************************************************************************/
+iojob_t *new_job(client_t *c, int op, fentry_t *file)
+{
+    iojob_t *job;
+
+    if ((job = calloc(1, sizeof(iojob_t))) == NULL)
+        return NULL;
+
+    job->op = op;
+    job->owner = c;
+    if ((job->file = file) != NULL)
+        fcache_hold(file);
+    c->job = job;
+    return job;
+}
+
+/******************************************************************************
+* subroutine: reap_jobs                                                       *
+* purpose:    finish the jobs the I/O pool is done with                       *
+* parameters: p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void reap_jobs(pool *p)
+{
+    iojob_t *job, *next;
+
+    for (job = iopool_reap(); job; job = next)
+    {
+        next = job->next;
+        io_done(job, p);
+    }
+}
+
+/******************************************************************************
+* subroutine: io_done                                                         *
+* purpose:    hand the result of a finished job to the request that waits for *
+*             it and resume the client. Results are cached even if the client *
+*             went away meanwhile                                             *
+* parameters: job - the finished job                                          *
+*             p   - pointer to the pool instance                              *
+* return:     none                                                            *
+******************************************************************************/
+void io_done(iojob_t *job, pool *p)
+{
+    client_t *c = job->owner;
+    HTTPContext *context = c ? c->context : NULL;
+    fentry_t *file;
+
+    switch (job->op)
+    {
+    case IO_OPEN:
+        if (job->file)
+        {
+            file = fcache_insert(job->file);
+            if (context) context->file = file;
+            else fcache_put(file);
+        }
+        else if (context)
+            context->file_err = job->err;
+        job->file = NULL;
+        break;
+
+    case IO_PREAD:
+        if (job->ret == job->len)
+        {
+            ccache_insert(job->file, job->blk);
+            if (context)
+            {
+                context->blk = job->blk;
+                job->blk = NULL;
+            }
+        }
+        else
+        {
+            Log("Error: Cann't read file %s: %s \n", job->file->path,
+                strerror(job->err));
+            // answered with a 500, the headers are not sent yet
+            if (context)
+            {
+                fcache_put(context->file);
+                context->file = NULL;
+                context->file_err = job->err;
+            }
+        }
+        break;
+
+    case IO_READAHEAD:
+        // on failure sendfile() just reads the window itself
+        if (c)
+            ((seg_t *)job->seg)->ra_end = job->off + job->len;
+        break;
+    }
+
+    if (job->blk) ccache_put(job->blk);
+    if (job->file) fcache_put(job->file);
+    free(job->path);
+    free(job);
+
+    if (c)
+    {
+        c->job = NULL;
+        check_client(c, p);
+    }
+}
+
+/******************************************************************************
+* subroutine: submit_job                                                      *
+* purpose:    start a job, as ring operations with the io_uring backend and   *
+*             on the I/O pool otherwise. io_done() is called when it is done  *
+* parameters: job - the job                                                   *
+* return:     none                                                            *
+******************************************************************************/
+void submit_job(iojob_t *job)
+{
+    ujob_t *uj;
+
+    if (!STATE.use_uring)
+    {
+        iopool_submit(job);
+        return;
+    }
+
+    if ((uj = calloc(1, sizeof(ujob_t))) != NULL)
+    {
+        uj->job = job;
+        uj->fd = -1;
+        if (uring_job(uj) == 0)
+            return;
+        free(uj);
+    }
+
+    // failed from the event loop, not from inside the request
+    job->ret = -1;
+    job->err = ENOMEM;
+    job->next = LATE_JOBS;
+    LATE_JOBS = job;
+}
+
+/******************************************************************************
+* subroutine: find_script                                                     *
+* purpose:    find the CGI program a request path names. The result is kept   *
+*             in SCRIPTS, so the file system is only asked about a program    *
+*             (and whether cgi_path is a folder) once per FCACHE_REVALIDATE   *
+*             seconds, not on every request                                   *
+* parameters: info - the path right after cgi-bin, moved past the program's   *
+*                    name when cgi_path is a folder                           *
+*             end  - end of the request path                                  *
+*             real - receives the program's full path, PATH_MAX bytes         *
+* return:     0 on success, -1 with errno set if there is no program to run   *
+******************************************************************************/
+int find_script(const char **info, const char *end, char *real)
+{
+    char   script[MAX_PATH];
+    const char *name, *p;
+    struct stat sbuf;
+    cgiscript_t *s;
+    time_t now = time(NULL);
+    unsigned h = 2166136261u;
+
+    if (now - SCRIPTS.checked >= FCACHE_REVALIDATE)
+    {
+        SCRIPTS.dir = stat(STATE.cgi_path, &sbuf) == 0 && S_ISDIR(sbuf.st_mode);
+        SCRIPTS.checked = now;
+    }
+
+    if (SCRIPTS.dir)
+    {
+        name = *info < end && **info == '/' ? *info + 1 : end;
+        for (p = name; p < end && *p != '/'; p++)
+            ;
+        *info = p;
+        if (p == name || (p - name <= 2 && name[0] == '.' &&
+                          name[p - name - 1] == '.') ||
+            snprintf(script, sizeof script, "%s/%.*s", STATE.cgi_path,
+                     (int)(p - name), name) >= (int)sizeof script)
+        {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+    else
+        snprintf(script, sizeof script, "%s", STATE.cgi_path);
+
+    // FNV-1a, as in the file cache
+    for (p = script; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    s = &SCRIPTS.slot[h % CGI_SCRIPTS];
+
+    if (strcmp(s->script, script) != 0 || now - s->checked >= FCACHE_REVALIDATE)
+    {
+        // the worker runs it from its own folder, so it gets the full path
+        s->err = 0;
+        if (realpath(script, s->real) == NULL)
+            s->err = errno;
+        else if (stat(s->real, &sbuf) < 0 || !S_ISREG(sbuf.st_mode))
+            s->err = ENOENT;
+        else if (access(s->real, X_OK) < 0)
+            s->err = errno;
+        strcpy(s->script, script);
+        s->checked = now;
+    }
+
+    if (s->err)
+    {
+        errno = s->err;
+        return -1;
+    }
+    strcpy(real, s->real);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgi_env                                                         *
+* purpose:    append a NAME=value entry to the environment of a CGI program   *
+* parameters: buf   - the environment, CGI_ENV_MAX bytes                      *
+*             len   - bytes used in it, advanced past the entry               *
+*             name  - the variable                                            *
+*             value - its value, vlen bytes, not NUL-terminated               *
+*             vlen  - length of the value                                     *
+* return:     0 on success, -1 if it does not fit                             *
+******************************************************************************/
+int cgi_env(char *buf, size_t *len, const char *name, const char *value,
+            size_t vlen)
+{
+    size_t nlen = strlen(name);
+
+    if (*len + nlen + vlen + 2 > CGI_ENV_MAX)
+        return -1;
+    memcpy(buf + *len, name, nlen);
+    buf[*len + nlen] = '=';
+    memcpy(buf + *len + nlen + 1, value, vlen);
+    *len += nlen + vlen + 2;
+    buf[*len - 1] = '\0';
+    return 0;
+}
+
+/* add another value to the entry cgi_env() appended last, after ", " */
+int cgi_env_join(char *buf, size_t *len, const char *value, size_t vlen)
+{
+    if (*len + vlen + 2 > CGI_ENV_MAX)
+        return -1;
+    memcpy(buf + *len - 1, ", ", 2);
+    memcpy(buf + *len + 1, value, vlen);
+    *len += vlen + 2;
+    buf[*len - 1] = '\0';
+    return 0;
+}
+
+/* the variable a header field is passed to a CGI program in: CONTENT_LENGTH,
+ * CONTENT_TYPE, or HTTP_ and the field name, upper case with '_' for '-'.
+ * -1 if the name does not fit in size bytes */
+int cgi_var(const header_t *h, char *buf, size_t size)
+{
+    char *p;
+
+    if (h->id == HDR_CONTENT_LENGTH || h->id == HDR_CONTENT_TYPE)
+    {
+        strcpy(buf, h->id == HDR_CONTENT_LENGTH ? "CONTENT_LENGTH" :
+                                                  "CONTENT_TYPE");
+        return 0;
+    }
+    if (h->name.len + 6 > size)
+        return -1;
+    sprintf(buf, "HTTP_%.*s", (int)h->name.len, h->name.ptr);
+    for (p = buf + 5; *p; p++)
+        *p = *p == '-' ? '_' : toupper((unsigned char)*p);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: watch_pipe                                                      *
+* purpose:    have the event loop call cgi_ready() once a descriptor of the   *
+*             CGI pool (a worker's socket, a program's stdin or stdout) is    *
+*             ready. It is one-shot and rearmed when the descriptor would    *
+*             block again                                                     *
+* parameters: obj    - the worker or the request, starting with its EV_ tag   *
+*             fd     - the descriptor                                         *
+*             events - POLLIN or POLLOUT                                      *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int watch_pipe(void *obj, int fd, int events)
+{
+    struct io_uring_sqe *sqe;
+    struct epoll_event ev;
+
+    if (STATE.use_uring)
+    {
+        if ((sqe = uring_sqe(&RING)) == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->user_data = (uintptr_t)obj | UOP_POLL;
+        return 0;
+    }
+
+    ev.events = (events & POLLOUT ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.ptr = obj;
+    if (epoll_ctl(POOL->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+        return 0;
+    if (errno != ENOENT)
+        return -1;
+    return epoll_ctl(POOL->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// the CGI pool's worker sockets, and the programs' stdout, are read
+int watch_cgi(void *obj, int fd)
+{
+    return watch_pipe(obj, fd, POLLIN);
+}
+
+/******************************************************************************
+* subroutine: cgi_ready                                                       *
+* purpose:    handle a ready descriptor of the CGI pool: take a worker's      *
+*             messages and pass on what they say about the jobs, feed a       *
+*             program's stdin or send its output                              *
+* parameters: obj - the worker (EV_CGI), the request (EV_CGIOUT) or its stdin *
+*                   watch (EV_CGIIN)                                          *
+*             p   - pointer to the pool instance                              *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_ready(void *obj, pool *p)
+{
+    cgijob_t *job, *next;
+
+    if (*(int *)obj == EV_CGIOUT)
+    {
+        cgi_output((cgireq_t *)obj, p);
+        return;
+    }
+    if (*(int *)obj == EV_CGIIN)
+    {
+        cgi_input(((struct cgiwatch *)obj)->req, p);
+        return;
+    }
+
+    cgipool_event((cgiworker_t *)obj);
+    for (job = cgipool_reap(); job; job = next)
+    {
+        next = job->next;
+        cgi_update((cgireq_t *)job, p);
+    }
+}
+
+/******************************************************************************
+* subroutine: cgi_update                                                      *
+* purpose:    a CGI program started or exited. Once started its stdin is fed  *
+*             the request body and its stdout is watched                      *
+* parameters: req - the request                                               *
+*             p   - pointer to the pool instance                              *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_update(cgireq_t *req, pool *p)
+{
+    cgijob_t *job = &req->job;
+    client_t *c = job->owner;
+    int events = job->events;
+
+    job->events = 0;
+    if (events & CJ_STARTED)
+    {
+        req->started = 1;
+        if (c && c->context->body != BODY_NONE &&
+            set_nonblocking(job->in) == 0)
+            cgi_input(req, p);
+        else
+        {
+            close(job->in);
+            job->in = -1;
+        }
+
+        if (set_nonblocking(job->out) < 0 || watch_cgi(req, job->out) < 0)
+        {
+            Log("Error: failed watching CGI output: %s \n", strerror(errno));
+            close(job->out);
+            job->out = -1;
+            req->failed = 1;
+        }
+    }
+
+    if (events & CJ_EXITED)
+    {
+        if (job->status == -1)
+            Log("Error: CGI program did not run: %s \n", strerror(job->err));
+        req->exited = 1;
+        // its output may still be in the pipe
+        if (job->out < 0)
+            cgi_done(req, p);
+    }
+}
+
+/******************************************************************************
+* subroutine: cgi_input                                                       *
+* purpose:    feed the request body to a CGI program's stdin, as far as the   *
+*             client has sent it and the pipe takes it (see                  *
+*             parse_requestbody()), and close stdin after the body. A full   *
+*             pipe is watched; until the program has read, nothing more is   *
+*             taken from the socket, so the client is held back by TCP. The  *
+*             rest of a body the program does not read is dropped            *
+* parameters: req - the request                                               *
+*             p   - pointer to the pool instance                              *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_input(cgireq_t *req, pool *p)
+{
+    client_t *c = req->job.owner;
+    int ret = PARSE_DONE;
+
+    req->in_armed = 0;
+    if (c && c->context->body != BODY_NONE)
+    {
+        c->context->body_fd = req->job.in;
+        ret = parse_requestbody(c, c->context, &c->is_closed);
+        if (ret == PARSE_BLOCKED &&
+            watch_pipe(&req->in, req->job.in, POLLOUT) == 0)
+        {
+            req->in_armed = 1;
+            return;
+        }
+        // waiting for the client, unless the program is done with stdin
+        if (ret == PARSE_AGAIN && c->context->body_fd >= 0)
+            return;
+    }
+
+    // the body is through (or the client gone), the program gets EOF
+    if (req->job.in >= 0)
+    {
+        close(req->job.in);
+        req->job.in = -1;
+    }
+    cgi_release(req);
+}
+
+/******************************************************************************
+* subroutine: cgi_output                                                      *
+* purpose:    read what a CGI program wrote and queue it for the client, up   *
+*             to CGI_WINDOW bytes ahead of what the client has taken; then   *
+*             the program is not read (and blocks on a full pipe) until      *
+*             cgi_resume(). Without a client the output is read and dropped   *
+*             until the program ends                                          *
+* parameters: req - the request                                               *
+*             p   - pointer to the pool instance                              *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_output(cgireq_t *req, pool *p)
+{
+    cgijob_t *job = &req->job;
+    client_t *c;
+    int ret;
+
+    while ((ret = cgi_read(job->owner, req)) != RIO_AGAIN)
+    {
+        if (ret == RIO_EOF)
+        {
+            close(job->out);
+            job->out = -1;
+            break;
+        }
+        if (ret == RIO_ERROR)
+        {
+            // finish the request now, the rest is dropped
+            req->failed = 1;
+            cgi_done(req, p);
+        }
+    }
+
+    // send what was queued
+    if ((c = job->owner) != NULL)
+        check_client(c, p);
+    if (req->exited && job->out < 0)
+        cgi_done(req, p);
+}
+
+/******************************************************************************
+* subroutine: cgi_read                                                        *
+* purpose:    one read from a CGI program's stdout: into the head until that  *
+*             is complete, then into the client's output queue, behind a     *
+*             chunk size line if the body is chunked                          *
+* parameters: c   - the client, NULL if it is gone                            *
+*             req - the request                                               *
+* return:     RIO_FULL when bytes were read, RIO_AGAIN when the pipe is empty *
+*             (it is watched again) or the client has enough queued,         *
+*             RIO_EOF at the end of the output, RIO_ERROR if the response    *
+*             failed                                                          *
+******************************************************************************/
+int cgi_read(client_t *c, cgireq_t *req)
+{
+    char   scratch[CGI_READ], line[MIN_LINE];
+    char  *ptr = NULL, *dst = scratch;
+    size_t want = sizeof scratch, used;
+    ssize_t n;
+    int    ret;
+
+    if (c && req->head_done && !req->discard && req->left != 0)
+    {
+        // the client has its window queued, more is read once it is sent
+        if (c->wlen >= CGI_WINDOW)
+        {
+            req->paused = 1;
+            return RIO_AGAIN;
+        }
+        if (req->left > 0 && want > req->left)
+            want = req->left;
+        if ((ptr = queue_reserve(c, CGI_CHUNK_LINE + want + 2)) == NULL)
+        {
+            // the buffers are at their cap: wait for the queue to drain
+            if (c->out_head == c->out_cnt)
+                return RIO_ERROR;
+            req->paused = 1;
+            return RIO_AGAIN;
+        }
+        dst = req->chunked ? ptr + CGI_CHUNK_LINE : ptr;
+    }
+    else if (c && !req->head_done)
+    {
+        dst = req->head + req->hlen;
+        want = CGI_HEAD - req->hlen;
+    }
+
+    while ((n = read(req->job.out, dst, want)) < 0 && errno == EINTR)
+        ;
+    if (n < 0 && errno == EAGAIN && watch_cgi(req, req->job.out) == 0)
+        return RIO_AGAIN;
+    if (n < 0)
+    {
+        Log("Error: Cann't read CGI output: %s \n", strerror(errno));
+        req->failed = 1;
+    }
+    if (n <= 0)
+        return RIO_EOF;
+    if (dst == scratch)
+        return RIO_FULL;
+
+    if (ptr)
+    {
+        if (req->left > 0)
+            req->left -= n;
+        if (!req->chunked)
+            return queue_commit(c, n) < 0 ? RIO_ERROR : RIO_FULL;
+        sprintf(line, "%06zx\r\n", (size_t)n);
+        memcpy(ptr, line, CGI_CHUNK_LINE);
+        memcpy(ptr + CGI_CHUNK_LINE + n, "\r\n", 2);
+        return queue_commit(c, CGI_CHUNK_LINE + n + 2) < 0 ? RIO_ERROR : RIO_FULL;
+    }
+
+    // the head, and the body bytes that came along with it
+    req->hlen += n;
+    if ((ret = cgi_head(c, req, &used)) < 0 || (ret == 0 && req->hlen == CGI_HEAD))
+    {
+        Log("Error: bad response head from a CGI program \n");
+        return RIO_ERROR;
+    }
+    if (ret > 0 && cgi_forward(c, req, req->head + used, req->hlen - used) < 0)
+        return RIO_ERROR;
+    return RIO_FULL;
+}
+
+/******************************************************************************
+* subroutine: cgi_head                                                        *
+* purpose:    queue the response head once the CGI program's head is in. The  *
+*             program's Status (or a Location, which redirects) becomes the   *
+*             status line, its other fields are passed on with the server's   *
+*             own; lines may end in LF or CRLF. Without a Content-Length the  *
+*             body is sent chunked, so the connection stays open              *
+* parameters: c    - the client                                               *
+*             req  - the request, with the program's output so far in head    *
+*             used - set to the length of the program's head                  *
+* return:     1 once the head is queued, 0 if it is incomplete, -1 if it is   *
+*             malformed                                                       *
+******************************************************************************/
+int cgi_head(client_t *c, cgireq_t *req, size_t *used)
+{
+    char  *line = req->head, *end = req->head + req->hlen, *eol, *colon, *value;
+    char   fields[CGI_HEAD], status[MIN_LINE] = "200 OK", buf[BUF_SIZE];
+    char   dbuf[MIN_LINE], *endp;
+    size_t flen = 0, nlen;
+    struct tm tm;
+    time_t now;
+    int    len, code, eoh = 0;
+
+    req->left = -1;
+    while ((eol = memchr(line, '\n', end - line)) != NULL)
+    {
+        len = eol - line;
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+        if (len == 0)
+        {
+            eoh = 1;
+            line = eol + 1;
+            break;
+        }
+
+        if ((colon = memchr(line, ':', len)) == NULL || colon == line)
+            return -1;
+        nlen = colon - line;
+        for (value = colon + 1; value < line + len && *value == ' '; value++)
+            ;
+
+        if (nlen == 6 && strncasecmp(line, "status", 6) == 0)
+        {
+            if (line + len - value >= MIN_LINE)
+                return -1;
+            sprintf(status, "%.*s", (int)(line + len - value), value);
+            line = eol + 1;
+            continue;
+        }
+        // the framing of the response is the server's
+        if ((nlen == 10 && strncasecmp(line, "connection", 10) == 0) ||
+            (nlen == 17 && strncasecmp(line, "transfer-encoding", 17) == 0))
+        {
+            line = eol + 1;
+            continue;
+        }
+        if (nlen == 14 && strncasecmp(line, "content-length", 14) == 0)
+        {
+            req->left = strtoll(value, &endp, 10);
+            if (endp == value || endp != line + len || req->left < 0)
+                return -1;
+        }
+        if (nlen == 8 && strncasecmp(line, "location", 8) == 0 &&
+            strcmp(status, "200 OK") == 0)
+            strcpy(status, "302 Found");
+
+        memcpy(fields + flen, line, len);
+        flen += len;
+        fields[flen++] = '\r';
+        fields[flen++] = '\n';
+        line = eol + 1;
+    }
+    if (!eoh)
+        return 0;
+
+    if ((code = atoi(status)) < 100 || code > 599)
+        return -1;
+    // no body: HEAD, and the statuses that never have one
+    req->discard = req->is_head || code < 200 || code == 204 || code == 304;
+    req->chunked = req->left < 0 && (req->is_head || !req->discard);
+
+    // get time string
+    now = time(0);
+    tm = *gmtime(&now);
+    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+
+    len = sprintf(buf, "HTTP/1.1 %s\r\n", status);
+    len += sprintf(buf + len, "Date: %s\r\n", dbuf);
+    len += sprintf(buf + len, "Server: Liso/1.0\r\n");
+    if (c->is_closed) len += sprintf(buf + len, "Connection: close\r\n");
+    if (req->chunked) len += sprintf(buf + len, "Transfer-Encoding: chunked\r\n");
+    c->context->status = code;
+    if (queue_bytes(c, buf, len) < 0 || queue_bytes(c, fields, flen) < 0 ||
+        queue_bytes(c, "\r\n", 2) < 0)
+        return -1;
+
+    req->head_done = 1;
+    *used = line - req->head;
+    return 1;
+}
+
+/******************************************************************************
+* subroutine: cgi_forward                                                     *
+* purpose:    queue body bytes read along with the program's head             *
+* parameters: c   - the client                                                *
+*             req - the request                                               *
+*             buf - the bytes                                                 *
+*             len - number of bytes                                           *
+* return:     0 on success, -1 if they cannot be queued                       *
+******************************************************************************/
+int cgi_forward(client_t *c, cgireq_t *req, const char *buf, size_t len)
+{
+    char line[MIN_LINE];
+
+    if (req->discard)
+        return 0;
+    // past the Content-Length is not sent
+    if (req->left >= 0 && len > req->left)
+        len = req->left;
+    if (len == 0)
+        return 0;
+    if (req->left > 0)
+        req->left -= len;
+    if (!req->chunked)
+        return queue_bytes(c, buf, len);
+
+    if (queue_bytes(c, line, sprintf(line, "%zx\r\n", len)) < 0 ||
+        queue_bytes(c, buf, len) < 0 || queue_bytes(c, "\r\n", 2) < 0)
+        return -1;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgi_resume                                                      *
+* purpose:    read a paused CGI program again, its client's output queue has  *
+*             drained                                                         *
+* parameters: req - the request                                               *
+*             p   - pointer to the pool instance                              *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_resume(cgireq_t *req, pool *p)
+{
+    req->paused = 0;
+    if (watch_cgi(req, req->job.out) == 0)
+        return;
+
+    Log("Error: failed watching CGI output: %s \n", strerror(errno));
+    close(req->job.out);
+    req->job.out = -1;
+    req->failed = 1;
+    cgi_done(req, p);
+}
+
+/******************************************************************************
+* subroutine: cgi_done                                                        *
+* purpose:    finish the request of a CGI program, once it has exited and its *
+*             output is read, or early if that output cannot be sent. A      *
+*             program that sent no (valid) head gets a 502; a response that  *
+*             is cut short, or whose program was killed, closes the          *
+*             connection instead of ending the body                           *
+* parameters: req - the request                                               *
+*             p   - pointer to the pool instance                              *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_done(cgireq_t *req, pool *p)
+{
+    client_t *c = req->job.owner;
+    int status = req->job.status;
+
+    if (c)
+    {
+        if (!req->head_done)
+            serve_error(c, "502", "Bad Gateway",
+                        "The CGI program failed", c->is_closed);
+        else if (req->failed || status == -1 || WIFSIGNALED(status) ||
+                 (req->left > 0 && !req->discard))
+            c->is_closed = 1;
+        else if (req->chunked && !req->discard &&
+                 queue_bytes(c, "0\r\n\r\n", 5) < 0)
+            c->is_closed = 1;
+        cgi_detach(req);
+        c->cgi = NULL;
+        c->context->cgi_done = 1;
+        check_client(c, p);
+    }
+
+    cgi_release(req);
+}
+
+/* a CGI request loses its client. The rest of the body is not coming, so
+ * stdin is closed, unless it is watched; then cgi_input() closes it */
+void cgi_detach(cgireq_t *req)
+{
+    req->job.owner = NULL;
+    if (req->job.in >= 0 && !req->in_armed)
+    {
+        close(req->job.in);
+        req->job.in = -1;
+    }
+}
+
+/* free a CGI request once the program is done with both pipes and the
+ * client with the request; cgi_input() may close stdin of a program that
+ * exited while its output is still being taken */
+void cgi_release(cgireq_t *req)
+{
+    if (req->exited && req->job.out < 0 && req->job.in < 0 && !req->job.owner)
+        free(req);
+}
+
+/******************************************************************************
+* subroutine: queue_reserve                                                   *
+* purpose:    make room for len more bytes at the end of the write buffer     *
+* parameters: c   - the client                                                *
+*             len - number of bytes                                           *
+* return:     where to put the bytes, NULL on error                           *
+******************************************************************************/
+char *queue_reserve(client_t *c, size_t len)
+{
+    char *nbuf;
+    size_t ncap;
+
+    // queued segments refer to wbuf by offset, so it can move
+    if (c->wlen + len > c->wcap)
+    {
+        if ((nbuf = bufpool_get(c->wlen + len, &ncap, 1)) == NULL)
+            return NULL;
+        if (c->wbuf)
+        {
+            memcpy(nbuf, c->wbuf, c->wlen);
+            bufpool_put(c->wbuf, c->wcap);
+        }
+        c->wbuf = nbuf;
+        c->wcap = ncap;
+    }
+    return c->wbuf + c->wlen;
+}
+
+/******************************************************************************
+* subroutine: queue_seg                                                       *
+* purpose:    take the next segment of the client's output queue. The queue   *
+*             is taken from the buffer pool along with its first segment and  *
+*             given back once it has drained, see drop_queue()                *
+* parameters: c - the client                                                  *
+* return:     the segment, NULL if the queue is full (or out of memory)       *
+******************************************************************************/
+seg_t *queue_seg(client_t *c)
+{
+    size_t size;
+    char *buf;
+
+    if (c->out_cnt == MAX_SEGS)
+        return NULL;
+
+    // the response is to a request already read, so it gets memory at the cap
+    if (c->out == NULL)
+    {
+        if ((buf = bufpool_get(OUTQ_SIZE, &size, 1)) == NULL)
+            return NULL;
+        c->t_queued = alog_now();
+        c->out = (seg_t *)buf;
+        c->iov = (struct iovec *)(buf + MAX_SEGS * sizeof(seg_t));
+        c->unsent = (unsent_t *)(buf + MAX_SEGS * (sizeof(seg_t) +
+                                                   sizeof(struct iovec)));
+    }
+    return &c->out[c->out_cnt++];
+}
+
+/******************************************************************************
+* subroutine: drop_queue                                                      *
+* purpose:    empty a client's output queue and give its buffers back to the  *
+*             pool. The segments must have been retired or released           *
+* parameters: c - the client                                                  *
+* return:     none                                                            *
+******************************************************************************/
+void drop_queue(client_t *c)
+{
+    uint64_t now = alog_now();
+
+    // everything sent, not dropped on a close
+    if (c->out_cnt > 0 && c->out_head == c->out_cnt)
+        metrics_time(M_SEND, now - c->t_queued);
+
+    // on a close, the requests whose response did not make it out are timed
+    // up to here
+    for (; c->unsent_head < c->unsent_cnt; c->unsent_head++)
+        response_sent(c->unsent[c->unsent_head].t_start,
+                      c->unsent[c->unsent_head].slot, now);
+
+    c->out_head = c->out_cnt = 0;
+    c->unsent_head = c->unsent_cnt = 0;
+    if (c->out)
+        bufpool_put((char *)c->out, OUTQ_SIZE);
+    c->out = NULL;
+    c->iov = NULL;
+    c->unsent = NULL;
+
+    if (c->wbuf)
+        bufpool_put(c->wbuf, c->wcap);
+    c->wbuf = NULL;
+    c->wlen = c->wcap = 0;
+}
+
+/******************************************************************************
+* subroutine: queue_commit                                                    *
+* purpose:    append len bytes, written at queue_reserve(), to the output     *
+*             queue. They are merged with the previous segment when that one  *
+*             ends where they start and does not end a finished response      *
+* parameters: c   - the client                                                *
+*             len - number of bytes                                           *
+* return:     0 on success, -1 if the queue is full                           *
+******************************************************************************/
+int queue_commit(client_t *c, size_t len)
+{
+    seg_t *s;
+
+    if (len == 0)
+        return 0;
+
+    s = c->out_cnt > c->out_head ? &c->out[c->out_cnt - 1] : NULL;
+    // a response is timed by its last segment, see time_response()
+    if (c->unsent_cnt > c->unsent_head &&
+        c->unsent[c->unsent_cnt - 1].end == c->out_cnt)
+        s = NULL;
+    if (s && s->type == SEG_BUF && s->off + s->len == c->wlen)
+        s->len += len;
+    else
+    {
+        if ((s = queue_seg(c)) == NULL)
+            return -1;
+        s->type = SEG_BUF;
+        s->file = NULL;
+        s->off = c->wlen;
+        s->len = len;
+    }
+    c->wlen += len;
+    c->queued += len;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: queue_bytes                                                     *
+* purpose:    append response bytes to the client's output queue, they are    *
+*             copied into the write buffer                                    *
+* parameters: c   - the client                                                *
+*             buf - the bytes to send                                         *
+*             len - number of bytes                                           *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int queue_bytes(client_t *c, const char *buf, size_t len)
+{
+    char *ptr;
+
+    if ((ptr = queue_reserve(c, len)) == NULL)
+        return -1;
+    memcpy(ptr, buf, len);
+    return queue_commit(c, len);
+}
+
+/******************************************************************************
+* subroutine: queue_mem                                                       *
+* purpose:    append part of a cached response block to the client's output   *
+*             queue. It is sent from the block itself; the queue holds its    *
+*             own reference until then                                        *
+* parameters: c   - the client                                                *
+*             blk - the cached block                                          *
+*             off - where the part starts                                     *
+*             len - length of the part                                        *
+* return:     0 on success, -1 if the queue is full                           *
+******************************************************************************/
+int queue_mem(client_t *c, cblock_t *blk, off_t off, size_t len)
+{
+    seg_t *s;
+
+    if ((s = queue_seg(c)) == NULL)
+        return -1;
+
+    s->type = SEG_MEM;
+    s->blk = blk;
+    s->off = off;
+    s->len = len;
+    c->queued += len;
+    ccache_hold(blk);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: queue_file                                                      *
+* purpose:    append a file range to the client's output queue. The file is   *
+*             sent with sendfile(); the queue holds its own reference to the  *
+*             cache entry until then                                          *
+* parameters: c    - the client                                               *
+*             file - the cached file                                          *
+*             off  - where the range starts                                   *
+*             len  - length of the range                                      *
+* return:     0 on success, -1 if the queue is full                           *
+******************************************************************************/
+int queue_file(client_t *c, fentry_t *file, off_t off, size_t len)
+{
+    seg_t *s;
+
+    if ((s = queue_seg(c)) == NULL)
+        return -1;
+
+    s->type = SEG_FILE;
+    s->file = file;
+    s->ra_end = off;
+    fcache_hold(file);
+    s->off = off;
+    s->len = len;
+    c->queued += len;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: flush_client                                                    *
+* purpose:    send the queued responses. Consecutive buffer and cached block  *
+*             segments go out in one writev() (with MSG_MORE if a file        *
+*             follows), file ranges                                           *
+*             with sendfile(). Stops when the socket buffer is full; the rest *
+*             is sent from the saved offsets on the next EPOLLOUT event       *
+* parameters: c - the client                                                  *
+* return:     0 when the queue is empty, 1 when output is still pending, -1   *
+*             on error                                                        *
+******************************************************************************/
+int flush_client(client_t *c)
+{
+    struct iovec iov[MAX_SEGS];
+    struct msghdr msg;
+    seg_t *s;
+    ssize_t sent;
+    size_t chunk;
+    int i, n;
+
+    // unless the kernel encrypts, a TLS client's records are made here
+    if (c->ssl && !(c->ktls & KTLS_TX))
+        return tls_flush(c);
+
+    while (c->out_head < c->out_cnt)
+    {
+        s = &c->out[c->out_head];
+
+        if (s->type == SEG_FILE)
+        {
+            chunk = s->len < SENDFILE_MAX ? s->len : SENDFILE_MAX;
+            if (STATE.io_threads > 0)
+            {
+                // only send what is known to be in the page cache
+                if (s->off >= s->ra_end && warm_window(c, s) != 0)
+                    return 1;
+                if (chunk > s->ra_end - s->off)
+                    chunk = s->ra_end - s->off;
+            }
+
+            sent = sendfile(c->fd, s->file->fd, &s->off, chunk);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                return -1;
+            }
+            if (sent == 0)      // file got shorter than we announced
+                return -1;
+
+            // sendfile() already advanced s->off
+            if ((s->len -= sent) == 0)
+            {
+                fcache_put(s->file);
+                c->out_head++;
+                sent_responses(c);
+            }
+            continue;
+        }
+
+        for (i = c->out_head, n = 0; i < c->out_cnt; i++, n++)
+        {
+            s = &c->out[i];
+            if (s->type == SEG_FILE)
+                break;
+            iov[n].iov_base = (s->type == SEG_BUF ? c->wbuf : s->blk->data) + s->off;
+            iov[n].iov_len = s->len;
+        }
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        if ((sent = sendmsg(c->fd, &msg, i < c->out_cnt ? MSG_MORE : 0)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+
+        retire_output(c, sent);
+    }
+
+    drop_queue(c);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: tls_flush                                                       *
+* purpose:    send the output queue of a TLS client: the segments are copied  *
+*             into records of up to TLS_RECORD bytes (a file range read in    *
+*             with pread()) and written with SSL_write(). A write that waits  *
+*             for the socket is retried from the queue as it is then, which   *
+*             still starts with the same bytes                                *
+* parameters: c - the client                                                  *
+* return:     0 when everything is sent, 1 if the socket (or the disk) is not *
+*             ready for more, -1 on error                                     *
+******************************************************************************/
+int tls_flush(client_t *c)
+{
+    static char rec[TLS_RECORD];
+    int warm = STATE.io_threads > 0 && !STATE.use_uring;
+    size_t len, chunk;
+    ssize_t n;
+    seg_t *s;
+    int i;
+
+    while (c->out_head < c->out_cnt)
+    {
+        for (i = c->out_head, len = 0; i < c->out_cnt && len < sizeof rec; i++)
+        {
+            s = &c->out[i];
+            chunk = s->len < sizeof rec - len ? s->len : sizeof rec - len;
+            if (s->type != SEG_FILE)
+                memcpy(rec + len, (s->type == SEG_BUF ? c->wbuf :
+                                   s->blk->data) + s->off, chunk);
+            else
+            {
+                // only what is known to be in the page cache, as with
+                // sendfile()
+                if (warm && s->off >= s->ra_end)
+                {
+                    if (len > 0)
+                        break;
+                    if (warm_window(c, s) != 0)
+                        return 1;
+                }
+                if (warm && chunk > s->ra_end - s->off)
+                    chunk = s->ra_end - s->off;
+                while ((n = pread(s->file->fd, rec + len, chunk, s->off)) < 0 &&
+                       errno == EINTR)
+                    ;
+                if (n <= 0)     // the file got shorter than we announced
+                    return -1;
+                chunk = n;
+            }
+            len += chunk;
+            if (chunk < s->len)
+                break;
+        }
+
+        if ((n = tls_write(c->ssl, rec, len)) < 0)
+            return errno == EAGAIN ? 1 : -1;
+        retire_output(c, n);
+    }
+
+    drop_queue(c);
+    return 0;
+}
+
+/* go on with a TLS client's handshake: 1 once it is done, 0 while it waits
+ * for the socket or the crypto pool (c->crypto), -1 if it failed */
+int tls_accept(client_t *c)
+{
+    cryptojob_t *job;
+    int ret;
+
+    if ((ret = tls_handshake(c->ssl)) == 1)
+    {
+        c->tls_up = 1;
+        c->ktls = tls_kernel(c->ssl);
+        metrics_time(M_HANDSHAKE, alog_now() - c->t_accept);
+    }
+    if (ret != TLS_OFFLOAD)
+        return ret;
+
+    // the private-key work, reap_handshakes() resumes the client
+    if ((job = malloc(sizeof(cryptojob_t))) == NULL)
+        return -1;
+    job->ssl = c->ssl;
+    job->owner = c;
+    c->crypto = job;
+    cryptopool_submit(job);
+    metrics_count(C_TLS_OFFLOADED, 1);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: init_crypto                                                     *
+* purpose:    start the crypto pool of the worker, if it serves HTTPS, and    *
+*             watch its completions                                           *
+* parameters: p - pointer to the pool instance                                *
+* return:     0 on success (or without a pool), -1 on error                   *
+******************************************************************************/
+int init_crypto(pool *p)
+{
+    long n = STATE.crypto_threads;
+
+    if (p->listeners[1].fd < 0 || n == 0)
+        return 0;
+    if (n < 0 && (n = sysconf(_SC_NPROCESSORS_ONLN) / STATE.workers) < 1)
+        n = 1;
+    if (n > MAX_CRYPTO_THREADS)
+        n = MAX_CRYPTO_THREADS;
+
+    if ((p->crypto.fd = cryptopool_init(n)) < 0 ||
+        watch_pipe(&p->crypto, p->crypto.fd, POLLIN) < 0)
+        return -1;
+    tls_use_pool(1);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: reap_handshakes                                                 *
+* purpose:    take the handshake steps the crypto pool is done with and go on *
+*             with their clients; one removed meanwhile is closed now         *
+* parameters: p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void reap_handshakes(pool *p)
+{
+    cryptojob_t *job, *next;
+    client_t *c;
+
+    for (job = cryptopool_reap(); job; job = next)
+    {
+        next = job->next;
+        c = job->owner;
+        c->crypto = NULL;
+        free(job);
+        if (c->dead && c->uops == 0)
+            close_client(c, p);
+        else if (!c->dead)
+            check_client(c, p);
+    }
+
+    // the watch is one-shot; a step done since the reap fires it right away
+    if (watch_pipe(&p->crypto, p->crypto.fd, POLLIN) < 0)
+        Log("Error: failed watching the crypto pool: %s \n", strerror(errno));
+}
+
+/******************************************************************************
+* subroutine: tls_input                                                       *
+* purpose:    io_uring: read a TLS client's records into its read buffer, as  *
+*             far as the socket has them, shaking hands first. OpenSSL reads  *
+*             the socket itself, so the ring only waits for it, see           *
+*             tls_wait()                                                      *
+* parameters: c - the client                                                  *
+* return:     1 when bytes were read, 0 if the socket is polled, -1 on error  *
+*             or at the end of the stream                                     *
+******************************************************************************/
+int tls_input(client_t *c)
+{
+    int cnt, ret;
+
+    if (!c->tls_up && (ret = tls_accept(c)) <= 0)
+        return ret < 0 ? -1 : c->crypto ? 0 : tls_wait(c);
+
+    if (rio_attach(&c->rio, 1) < 0)
+        return -1;
+    rio_compact(c);
+    cnt = c->rio.rio_cnt;
+    ret = rio_fill(&c->rio);
+    if (c->rio.rio_cnt > cnt)
+        return 1;
+    return ret == RIO_AGAIN ? tls_wait(c) : -1;
+}
+
+/* io_uring: poll a TLS client's socket for what OpenSSL waits for; readable
+ * stands for a pending receive, writable for a pending send */
+int tls_wait(client_t *c)
+{
+    if (tls_wants(c->ssl) == POLLOUT)
+    {
+        if (watch_pipe(&c->tls_out, c->fd, POLLOUT) < 0)
+            return -1;
+        c->send_busy = 1;
+    }
+    else
+    {
+        if (watch_pipe(c, c->fd, POLLIN) < 0)
+            return -1;
+        c->recv_armed = 1;
+    }
+    c->uops++;
+    return 0;
+}
+
+/* peek at, or take, the next bytes a client sent, through TLS if it has it */
+ssize_t sock_recv(client_t *c, void *buf, size_t len, int peek)
+{
+    if (c->ssl)
+        return peek ? tls_peek(c->ssl, buf, len) : tls_read(c->ssl, buf, len);
+    return recv(c->fd, buf, len, peek ? MSG_PEEK | MSG_DONTWAIT : MSG_DONTWAIT);
+}
+
+/******************************************************************************
+* subroutine: retire_output                                                   *
+* purpose:    retire the buffer and block segments that went out completely  *
+*             and advance the one that went out in part                       *
+* parameters: c    - the client                                               *
+*             sent - bytes sent from the head of the queue                    *
+* return:     none                                                            *
+******************************************************************************/
+void retire_output(client_t *c, size_t sent)
+{
+    seg_t *s;
+
+    while (sent > 0)
+    {
+        s = &c->out[c->out_head];
+        if (sent < s->len)
+        {
+            s->off += sent;
+            s->len -= sent;
+            break;
+        }
+        sent -= s->len;
+        if (s->type == SEG_MEM)
+            ccache_put(s->blk);
+        else if (s->type == SEG_FILE)
+            fcache_put(s->file);
+        c->out_head++;
+    }
+    sent_responses(c);
+}
+
+/******************************************************************************
+* subroutine: release_output                                                  *
+* purpose:    drop whatever is still queued for a client that is going away   *
+* parameters: c - the client                                                  *
+* return:     none                                                            *
+******************************************************************************/
+void release_output(client_t *c)
+{
+    int i;
+
+    for (i = c->out_head; i < c->out_cnt; i++)
+    {
+        if (c->out[i].type == SEG_MEM)
+            ccache_put(c->out[i].blk);
+        else if (c->out[i].type == SEG_FILE)
+            fcache_put(c->out[i].file);
+    }
+    drop_queue(c);
+}
+
+/******************************************************************************
+ *                              io_uring backend                              *
+ *****************************************************************************/
+
+/******************************************************************************
+* subroutine: uring_start                                                     *
+* purpose:    set up the ring and queue the multishot accepts on both         *
+*             listeners and the one second tick                               *
+* parameters: p - pointer to the pool instance                                *
+* return:     0 on success, -1 with errno set if there is no io_uring         *
+******************************************************************************/
+int uring_start(pool *p)
+{
+    int i;
+
+    if (uring_init(&RING, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) < 0)
+        return -1;
+
+    for (i = 0; i < 2; i++)
+        if (uring_accept(i, p) < 0)
+            return -1;
+    return uring_tick();
+}
+
+/******************************************************************************
+* subroutine: run_uring                                                       *
+* purpose:    the io_uring event loop. Every socket and disk operation is a   *
+*             ring operation; one io_uring_enter() submits what the last      *
+*             round of completions queued and waits for the next ones         *
+* parameters: p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void run_uring(pool *p)
+{
+    struct io_uring_cqe *cqe;
+    iojob_t *job;
+    uint64_t data;
+    unsigned flags;
+    int res;
+
+    while (KEEPON)
+    {
+        // EBUSY: completions overflowed, reaping them makes room
+        if (uring_submit(&RING, 1) < 0 && errno != EINTR && errno != EBUSY)
+            Log("Error: io_uring_enter error: %s \n", strerror(errno));
+
+        while ((cqe = uring_cqe(&RING)) != NULL)
+        {
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(&RING);
+            uring_complete(data, res, flags, p);
+        }
+
+        while ((job = LATE_JOBS) != NULL)
+        {
+            LATE_JOBS = job->next;
+            io_done(job, p);
+        }
+
+        wake_waiters(p);
+    }
+}
+
+/******************************************************************************
+* subroutine: uring_complete                                                  *
+* purpose:    handle one completion and queue what follows from it           *
+* parameters: data  - user_data of the operation                              *
+*             res   - its result, -errno on error                             *
+*             flags - completion flags                                        *
+*             p     - pointer to the pool instance                            *
+* return:     none                                                            *
 ******************************************************************************/
-int parse_requestheaders(int id, pool *p, HTTPContext *context, int *is_closed)
+void uring_complete(uint64_t data, int res, unsigned flags, pool *p)
 {
-    int  ret, cnt = 0, has_contentlen = 0, port;
-    char buf[MAX_LINE], header[MIN_LINE], data[MIN_LINE], pbuf[MIN_LINE];
-    
-    context->content_len = -1; 
+    client_t *c = (client_t *)(uintptr_t)(data & ~(uint64_t)UOP_MASK);
+    listener_t *l;
+    unsigned bid;
+    seg_t *s;
+    int i, ok = res > 0, tls_out = 0;
 
-    do
-    {   
-        if ((ret = rio_readlineb(&p->clientrio[id], buf, MAX_LINE)) < 0)
-            break;
+    switch (data & UOP_MASK)
+    {
+    case UOP_TICK:
+        // close connections that stayed quiet for too long
+        expire_clients(p);
+        alog_tick();
+        cgipool_tick();
+        for (i = 0; i < 2; i++)
+            if (!p->listeners[i].armed)
+                uring_accept(i, p);
+        uring_tick();
+        return;
+
+    case UOP_ACCEPT:
+        l = &p->listeners[data >> 3];
+        if (!(flags & IORING_CQE_F_MORE))
+            l->armed = 0;
+        if (res < 0)
+        {
+            // out of descriptors and such, the tick accepts again
+            if (res != -ECANCELED)
+                Log("Error: accepting connection: %s \n", strerror(-res));
+            return;
+        }
+        if (!l->armed)
+            uring_accept(l - p->listeners, p);
+        uring_accepted(l, res, p);
+        return;
 
-        cnt += ret;
+    case UOP_JOB:
+        uring_job_done((ujob_t *)c, res, p);
+        return;
 
-        // if request header is larger than 8196, reject request
-        if (cnt > MAX_LINE)
+    case UOP_POLL:
+        // a client's poll waits for more of a request body, or for its
+        // socket on behalf of OpenSSL
+        if (c->type == EV_CRYPTO)
         {
-            *is_closed = 1;
-            serve_error(p->clientfd[id], "400", "Bad Request",
-                       "Request header too long.", *is_closed);
-            return -1;
+            reap_handshakes(p);
+            return;
         }
-       
-        // parse Host header
-        if (strstr(buf, "Host:"))
+        if (c->type == EV_TLSOUT)
         {
-            if (sscanf(buf, "%s: %s:%s", header, data, pbuf) > 0)
-            {
-                port = (int)strtol(pbuf, (char**)NULL, 10);
-                if (port == STATE.s_port)
-                {
-                    context->is_secure = 1;
-                    Log("Secure connection \n");
-                } 
-            }
+            c = ((struct tlswatch *)c)->c;
+            tls_out = 1;
         }
- 
-        if (strstr(buf, "Connection: close")) *is_closed = 1;
+        else if (c->type != EV_CLIENT)
+        {
+            cgi_ready(c, p);
+            return;
+        }
+        break;
+    }
 
-        if (strstr(buf, "Content-Length")) 
+    // the client's own operations
+    c->uops--;
+    switch (data & UOP_MASK)
+    {
+    case UOP_RECV:
+        c->recv_armed = 0;
+        if (flags & IORING_CQE_F_BUFFER)
+        {
+            bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            // the bytes are here already, so the buffer is taken at the cap
+            if (ok && !c->dead && rio_attach(&c->rio, 1) < 0)
+                ok = 0;
+            if (ok && !c->dead)
+                memcpy(c->rio.rio_bufptr + c->rio.rio_cnt,
+                       uring_buf(&RING, bid), res);
+            uring_buf_return(&RING, bid);
+        }
+        if (ok)
+            c->rio.rio_cnt += res;
+        else if (res == -ENOBUFS && !c->dead)
         {
-            has_contentlen = 1;
-            if (sscanf(buf, "%s %s", header, data) > 0)
-                context->content_len = (int)strtol(data, (char**)NULL, 10); 
-            Log("Debug: content-length=%d \n", context->content_len);
-        }  
+            // every shared buffer is in use, read into the client's own
+            ok = uring_recv(c, 1) == 0;
+        }
+        break;
 
-    } while(strcmp(buf, "\r\n"));
+    case UOP_SEND:
+        c->send_busy = 0;
+        if (ok)
+            retire_output(c, res);
+        break;
 
-    if ((!has_contentlen) && (!strcasecmp(context->method, "POST")))
-    {
-        serve_error(p->clientfd[id], "411", "Length Required",
-                       "Content-Length is required.", *is_closed);
-        return -1;
+    case UOP_SPLICE_IN:
+        c->send_busy = 0;
+        s = &c->out[c->out_head];
+        if (ok)             // 0: the file got shorter than we announced
+        {
+            s->off += res;
+            s->len -= res;
+            c->piped += res;
+            if (s->len == 0)
+            {
+                fcache_put(s->file);
+                c->out_head++;
+            }
+        }
+        break;
+
+    case UOP_SPLICE_OUT:
+        c->send_busy = 0;
+        if (ok && (c->piped -= res) == 0)
+            sent_responses(c);
+        break;
+
+    case UOP_POLL:
+        if (tls_out)
+            c->send_busy = 0;
+        else if (c->body_armed)
+            c->body_armed = 0;
+        else
+            c->recv_armed = 0;
+        break;
     }
 
-    return 0;
+    if (!c->dead && !ok)
+        remove_client(c, p);    // peer gone or reset, or a failed send
+    else if (!c->dead)
+        touch_client(c, p);
+
+    uring_kick(c, p);
 }
 
 /******************************************************************************
-* subroutine: serve_get                                                       *
-* purpose:    return response for GET request                                 *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
-* return:     none                                                            *
+* subroutine: uring_accept                                                    *
+* purpose:    queue a multishot accept, which keeps completing with new       *
+*             connections until it fails                                      *
+* parameters: i - index of the listener                                       *
+*             p - pointer to the pool instance                                *
+* return:     0 on success, -1 if the ring is full                            *
 ******************************************************************************/
-void serve_get(int client_fd, HTTPContext *context, int *is_closed)
+int uring_accept(int i, pool *p)
 {
+    struct io_uring_sqe *sqe;
 
-    serve_head(client_fd, context, is_closed);
-    serve_body(client_fd, context, is_closed);
+    if (p->listeners[i].fd < 0)         // HTTPS without TLS
+        return 0;
+    if ((sqe = uring_sqe(&RING)) == NULL)
+        return -1;
 
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = p->listeners[i].fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = ((uint64_t)i << 3) | UOP_ACCEPT;
+    p->listeners[i].armed = 1;
+    return 0;
 }
 
 /******************************************************************************
-* subroutine: serve_head                                                      *
-* purpose:    return response header to client                                *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
+* subroutine: uring_accepted                                                  *
+* purpose:    add a connection the ring accepted, or turn it away with a 503  *
+* parameters: l  - the listener                                               *
+*             fd - the new descriptor                                         *
+*             p  - pointer to the pool instance                               *
 * return:     none                                                            *
 ******************************************************************************/
-void serve_head(int client_fd, HTTPContext *context, int *is_closed)
+void uring_accepted(listener_t *l, int fd, pool *p)
 {
-    struct tm tm;
-    struct stat sbuf;
-    time_t now;
-    char   buf[BUF_SIZE], filetype[MIN_LINE], tbuf[MIN_LINE], dbuf[MIN_LINE]; 
+    char buf[MAX_LINE];
 
-    if (validate_file(client_fd, context, is_closed) < 0) return;
+    LogDebug("accept client: new connection on socket %d\n", fd);
 
-    stat(context->filename, &sbuf);
-    get_filetype(context->filename, filetype);
+    if (STATE.is_full || add_client(fd, l->is_secure, p) < 0)
+    {
+        // no client slot to queue on, best effort straight to the socket
+        send(fd, buf, format_error(buf, "503", "Service Unavailable",
+             "Server is too busy right now. Please try again later.", 1),
+             MSG_DONTWAIT);
+        close(fd);
+    }
+}
 
-    // get time string
-    tm = *gmtime(&sbuf.st_mtime);
-    strftime(tbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
-    now = time(0);
-    tm = *gmtime(&now);
-    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+/******************************************************************************
+* subroutine: uring_tick                                                      *
+* purpose:    queue a one second timeout, on which idle connections expire    *
+* parameters: none                                                            *
+* return:     0 on success, -1 if the ring is full                            *
+******************************************************************************/
+int uring_tick()
+{
+    static struct __kernel_timespec ts = { 1, 0 };
+    struct io_uring_sqe *sqe;
 
-    // send response headers to client
-    sprintf(buf, "HTTP/1.1 200 OK\r\n");
-    sprintf(buf, "%sDate: %s\r\n", buf, dbuf);
-    sprintf(buf, "%sServer: Liso/1.0\r\n", buf);
-    if (is_closed) sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-Length: %ld\r\n", buf, sbuf.st_size);
-    sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
-    sprintf(buf, "%sLast-Modified: %s\r\n\r\n", buf, tbuf);
-    send(client_fd, buf, strlen(buf), 0);
+    if ((sqe = uring_sqe(&RING)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&ts;
+    sqe->len = 1;
+    sqe->user_data = UOP_TICK;
+    return 0;
 }
 
 /******************************************************************************
-* subroutine: validate_file                                                   *
-* purpose:    validate file existence and permisson                           *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
-* return:     0 on success -1 on error                                        *
+* subroutine: uring_recv                                                      *
+* purpose:    queue a receive into the free tail of the client's read buffer. *
+*             It is single-shot: like the epoll loop, nothing more is read    *
+*             while responses are pending, which keeps a pipelining client    *
+*             from queuing unbounded work                                     *
+* parameters: c      - the client                                             *
+*             direct - receive into the read buffer itself instead of one of  *
+*                      the ring's provided buffers                            *
+* return:     0 on success, -1 if the ring is full                            *
 ******************************************************************************/
-int validate_file(int client_fd, HTTPContext *context, int *is_closed)
+int uring_recv(client_t *c, int direct)
 {
-    struct stat sbuf;
+    rio_t *rp = &c->rio;
+    struct io_uring_sqe *sqe;
 
-    // check file existence
-    if (stat(context->filename, &sbuf) < 0)
-    {
-        serve_error(client_fd, "404", "Not Found",
-                    "Server couldn't find this file", *is_closed);
+    // OpenSSL reads the socket itself, the ring only tells when to
+    if (c->ssl)
+        return tls_wait(c);
+
+    // a shared buffer is copied into a fresh read buffer on completion
+    if (direct && rio_attach(rp, 1) < 0)
         return -1;
-    }
+    rio_compact(c);
 
-    // check file permission
-    if ((!S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
-    {
-        serve_error(client_fd, "403", "Forbidden",
-                    "Server couldn't read this file", *is_closed);
+    if ((sqe = uring_sqe(&RING)) == NULL)
         return -1;
-    }
 
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = rp->rio_buf ? rp->rio_buf + rp->rio_size - (rp->rio_bufptr + rp->rio_cnt)
+                           : BUF_SIZE;
+    if (direct)
+        sqe->addr = (uintptr_t)(rp->rio_bufptr + rp->rio_cnt);
+    else
+    {
+        // the kernel takes a shared buffer only once data has arrived, so
+        // idle connections pin none
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+    }
+    sqe->user_data = (uintptr_t)c | UOP_RECV;
+    c->recv_armed = 1;
+    c->uops++;
     return 0;
 }
 
 /******************************************************************************
-* subroutine: get_filetype                                                    *
-* purpose:    find filetype by filename extension                             *
-* parameters: filename: the requested filename                               *
-*             filetype: a pointer to return filetype result                   *
-* return:     none                                                            *
+* subroutine: uring_send                                                      *
+* purpose:    queue the next send of a client's output. Buffer and block      *
+*             segments go out with one sendmsg; a file range is spliced into  *
+*             the client's pipe (read by the kernel's workers if it is not   *
+*             cached) and from there to the socket, SPLICE_CHUNK at a time    *
+* parameters: c - the client, with output pending and no send in flight       *
+* return:     0 on success, -1 on error                                       *
 ******************************************************************************/
-void get_filetype(char *filename, char *filetype)
+int uring_send(client_t *c)
 {
-    if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
-    else if (strstr(filename, ".css"))
-        strcpy(filetype, "text/css");
-    else if (strstr(filename, ".js"))
-        strcpy(filetype, "application/javascript");
-    else if (strstr(filename, ".png"))
-        strcpy(filetype, "image/png");
-    else if (strstr(filename, ".gif"))
-        strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
+    struct io_uring_sqe *sqe;
+    seg_t *s = &c->out[c->out_head];
+    int i, n;
+
+    if (!c->piped && s->type == SEG_FILE && c->pipefd[0] < 0)
+    {
+        if (pipe2(c->pipefd, O_CLOEXEC) < 0)
+            return -1;
+        // fewer, larger splices; a smaller pipe just takes shorter ones
+        fcntl(c->pipefd[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+    }
+
+    if ((sqe = uring_sqe(&RING)) == NULL)
+        return -1;
+
+    if (c->piped)
+    {
+        // what is in the pipe goes first
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = c->fd;
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = c->pipefd[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->len = c->piped;
+        sqe->user_data = (uintptr_t)c | UOP_SPLICE_OUT;
+    }
+    else if (s->type == SEG_FILE)
+    {
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = c->pipefd[1];
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = s->file->fd;
+        sqe->splice_off_in = s->off;
+        sqe->len = s->len < SPLICE_CHUNK ? s->len : SPLICE_CHUNK;
+        sqe->user_data = (uintptr_t)c | UOP_SPLICE_IN;
+    }
     else
-        strcpy(filetype, "text/plain");
+    {
+        for (i = c->out_head, n = 0; i < c->out_cnt; i++, n++)
+        {
+            s = &c->out[i];
+            if (s->type == SEG_FILE)
+                break;
+            c->iov[n].iov_base = (s->type == SEG_BUF ? c->wbuf : s->blk->data) + s->off;
+            c->iov[n].iov_len = s->len;
+        }
+
+        memset(&c->msg, 0, sizeof c->msg);
+        c->msg.msg_iov = c->iov;
+        c->msg.msg_iovlen = n;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c->fd;
+        sqe->addr = (uintptr_t)&c->msg;
+        sqe->len = 1;
+        sqe->msg_flags = i < c->out_cnt ? MSG_MORE : 0;
+        sqe->user_data = (uintptr_t)c | UOP_SEND;
+    }
+
+    c->send_busy = 1;
+    c->uops++;
+    return 0;
 }
 
 /******************************************************************************
-* subroutine: serve_body                                                      *
-* purpose:    return response body to client                                  *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
+* subroutine: uring_kick                                                      *
+* purpose:    move a client on after one of its operations completed: send    *
+*             the pending output, then answer the buffered requests, then     *
+*             receive more. A removed client is closed once the ring no       *
+*             longer uses it                                                  *
+* parameters: c - the client                                                  *
+*             p - pointer to the pool instance                                *
 * return:     none                                                            *
 ******************************************************************************/
-int serve_body(int client_fd, HTTPContext *context, int *is_closed)
+void uring_kick(client_t *c, pool *p)
 {
-    int fd, filesize;
-    char *ptr;
-    struct stat sbuf;
-    
-    if ((fd = open(context->filename, O_RDONLY, 0)) < 0)
+    int ret, tls;
+
+    if (c->fd < 0)
+        return;
+    if (c->dead)
+    {
+        if (c->uops == 0 && !c->crypto)
+            close_client(c, p);
+        return;
+    }
+
+    while (!c->send_busy)
     {
-        Log("Error: Cann't open file \n");
-        return -1; ///TODO what error code here should be?
+        // responses go out in order, nothing more is read meanwhile
+        if (c->piped || c->out_head < c->out_cnt)
+        {
+            // TLS records are written right here, the ring waits for room
+            // in the socket when there is none; with kTLS, the socket is
+            // sent to like a plain one
+            tls = c->ssl && !(c->ktls & KTLS_TX);
+            if (tls && (ret = tls_flush(c)) == 0)
+                continue;
+            if (tls ? ret < 0 || tls_wait(c) < 0 : uring_send(c) < 0)
+                remove_client(c, p);
+            return;
+        }
+        drop_queue(c);
+
+        // a request waiting for the disk is resumed from io_done(), one
+        // waiting for a CGI program from cgi_done(); that program is read
+        // again once its output went out, and takes the request body as it
+        // comes
+        if (c->cgi && c->cgi->paused)
+            cgi_resume(c->cgi, p);
+        if (c->cgi && c->cgi->started && !c->cgi->in_armed &&
+            !c->body_armed && c->context->body != BODY_NONE)
+            cgi_input(c->cgi, p);
+        if (c->job || c->cgi || c->crypto || c->recv_armed || c->body_armed)
+            return;
+        if (c->closing)
+        {
+            remove_client(c, p);
+            return;
+        }
+
+        serve_buffered(c);
+        if (c->out_cnt > 0 || c->closing)
+            continue;
+        if (c->job || c->cgi || c->body_armed)
+            return;
+
+        // the parser still wants more, but the buffer is full: a bigger
+        // one, unless the header is too long
+        if (c->rio.rio_buf && c->rio.rio_cnt == c->rio.rio_size &&
+            rio_grow(&c->rio) < 0)
+        {
+            serve_error(c, "400", "Bad Request", "Request header too long.", 1);
+            c->closing = 1;
+            continue;
+        }
+
+        // at the cap, a client with nothing buffered waits before it reads
+        rio_detach(c);
+        if (c->rio.rio_buf == NULL && bufpool_full())
+        {
+            wait_buffer(c, p);
+            return;
+        }
+        // and TLS records are read (the handshake done) right here too
+        if (c->ssl && (ret = tls_input(c)) > 0)
+            continue;
+        if (c->ssl ? ret < 0 : uring_recv(c, 0) < 0)
+            remove_client(c, p);
+        return;
     }
+}
 
-    stat(context->filename, &sbuf);
+/******************************************************************************
+* subroutine: uring_job                                                       *
+* purpose:    queue the next ring operation of a job: the openat or statx of  *
+*             an IO_OPEN, the (rest of the) read of an IO_PREAD               *
+* parameters: uj - the job                                                    *
+* return:     0 on success, -1 if the ring is full                            *
+******************************************************************************/
+int uring_job(ujob_t *uj)
+{
+    iojob_t *job = uj->job;
+    struct io_uring_sqe *sqe;
 
-    filesize = sbuf.st_size;
-    ptr = mmap(0, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    send(client_fd, ptr, filesize, 0); 
-    munmap(ptr, filesize);
+    if ((sqe = uring_sqe(&RING)) == NULL)
+        return -1;
 
+    if (job->op == IO_OPEN && uj->fd < 0)
+    {
+        // O_NONBLOCK so a FIFO under the www folder cannot stall the server
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)job->path;
+        sqe->open_flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+    }
+    else if (job->op == IO_OPEN)
+    {
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = uj->fd;
+        sqe->addr = (uintptr_t)"";
+        sqe->statx_flags = AT_EMPTY_PATH;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->addr2 = (uintptr_t)&uj->stx;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = job->file->fd;
+        sqe->addr = (uintptr_t)(job->buf + uj->done);
+        sqe->len = job->len - uj->done;
+        sqe->off = job->off + uj->done;
+    }
+    sqe->user_data = (uintptr_t)uj | UOP_JOB;
     return 0;
 }
 
 /******************************************************************************
-* subroutine: serve_post                                                      *
-* purpose:    return response for POST request                                *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
+* subroutine: uring_job_done                                                  *
+* purpose:    take the result of a job's ring operation, queue its next one   *
+*             or finish the job the way an I/O pool thread would              *
+* parameters: uj  - the job                                                   *
+*             res - result of the operation                                   *
+*             p   - pointer to the pool instance                              *
 * return:     none                                                            *
 ******************************************************************************/
-void serve_post(int client_fd, HTTPContext *context, int *is_closed)
+void uring_job_done(ujob_t *uj, int res, pool *p)
 {
-    struct tm tm;
+    iojob_t *job = uj->job;
     struct stat sbuf;
-    time_t now;
-    char   buf[BUF_SIZE], dbuf[MIN_LINE]; 
 
-    // check file existence
-    if (stat(context->filename, &sbuf) == 0)
+    if (job->op == IO_OPEN && uj->fd < 0)
     {
-        serve_get(client_fd, context, is_closed);
-        return;
+        // opened, the metadata comes next
+        if (res >= 0)
+        {
+            uj->fd = res;
+            if (uring_job(uj) == 0)
+                return;
+            close(res);
+            res = -ENOMEM;
+        }
+        job->err = -res;
+    }
+    else if (job->op == IO_OPEN)
+    {
+        if (res < 0)
+        {
+            close(uj->fd);
+            job->err = -res;
+        }
+        else
+        {
+            memset(&sbuf, 0, sizeof sbuf);
+            sbuf.st_mode = uj->stx.stx_mode;
+            sbuf.st_size = uj->stx.stx_size;
+            sbuf.st_mtime = uj->stx.stx_mtime.tv_sec;
+            sbuf.st_dev = makedev(uj->stx.stx_dev_major, uj->stx.stx_dev_minor);
+            sbuf.st_ino = uj->stx.stx_ino;
+            if ((job->file = fcache_build(job->path, uj->fd, &sbuf)) == NULL)
+                job->err = errno;
+        }
+    }
+    else if (res > 0 && (uj->done += res) < job->len)
+    {
+        // a short read, go on from there
+        if (uring_job(uj) == 0)
+            return;
+        job->ret = -1;
+        job->err = ENOMEM;
+    }
+    else if (res > 0)
+        job->ret = job->len;
+    else
+    {
+        job->ret = -1;
+        job->err = res < 0 ? -res : EIO;    // 0: the file got shorter
     }
 
-    // get time string
-    now = time(0);
-    tm = *gmtime(&now);
-    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
-
-    // send response headers to client
-    sprintf(buf, "HTTP/1.1 204 No Content\r\n");
-    sprintf(buf, "%sDate: %s\r\n", buf, dbuf);
-    sprintf(buf, "%sServer: Liso/1.0\r\n", buf);
-    if (is_closed) sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-Length: 0\r\n", buf);
-    sprintf(buf, "%sContent-Type: text/html\r\n", buf);
-    send(client_fd, buf, strlen(buf), 0);
+    free(uj);
+    io_done(job, p);
 }
- 
+
 void tostring(char str[], int num)
 {
     int i, rem, len = 0, n;
@@ -812,38 +4610,52 @@ void tostring(char str[], int num)
  *                            wrappers from csapp                             *
  *****************************************************************************/
 
-/* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+/*
+ * rio_fill - Read whatever the non-blocking descriptor has into the free
+ *    tail of the internal buffer (see rio_compact). Returns RIO_AGAIN once the socket is drained, RIO_FULL when
+ *    the buffer is full, RIO_EOF when the peer closed, RIO_ERROR on error.
  */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+int rio_fill(rio_t *rp)
 {
-    int cnt;
+    char *end = rp->rio_buf + rp->rio_size;
+    ssize_t n;
 
-    while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
-        if (rp->rio_cnt < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        }
-        else if (rp->rio_cnt == 0)  /* EOF */
-            return 0;
+    while (rp->rio_bufptr + rp->rio_cnt < end) {
+        if (rp->rio_ssl)
+            n = tls_read(rp->rio_ssl, rp->rio_bufptr + rp->rio_cnt,
+                         end - (rp->rio_bufptr + rp->rio_cnt));
         else
-            rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
+            n = read(rp->rio_fd, rp->rio_bufptr + rp->rio_cnt,
+                     end - (rp->rio_bufptr + rp->rio_cnt));
+        if (n > 0)
+            rp->rio_cnt += n;
+        else if (n == 0)
+            return RIO_EOF;
+        else if (errno == EINTR)    /* interrupted by sig handler return */
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return RIO_AGAIN;
+        else
+            return RIO_ERROR;
     }
+    return RIO_FULL;
+}
+
+/*
+ * rio_compact - Move the unread bytes to the front of the read buffer to make
+ *     room behind them, unless the request being served (or whose body is
+ *     being taken) still points into the bytes before them
+ */
+void rio_compact(client_t *c)
+{
+    rio_t *rp = &c->rio;
 
-    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->rio_cnt < n)
-        cnt = rp->rio_cnt;
-    memcpy(usrbuf, rp->rio_bufptr, cnt);
-    rp->rio_bufptr += cnt;
-    rp->rio_cnt -= cnt;
-    return cnt;
+    if (c->context && c->state != PS_REQUESTLINE)
+        return;
+    if (rp->rio_bufptr != rp->rio_buf) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
 }
 
 /*
@@ -852,33 +4664,179 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 void rio_readinitb(rio_t *rp, int fd)
 {
     rp->rio_fd = fd;
+    rp->rio_ssl = NULL;
     rp->rio_cnt = 0;
+    rp->rio_bufptr = rp->rio_buf = NULL;
+    rp->rio_size = 0;
+}
+
+/*
+ * rio_attach - Take a buffer from the buffer pool to read into, if there is
+ *     none. Returns 0, or -1 at the pool's cap (unless force) or out of memory
+ */
+int rio_attach(rio_t *rp, int force)
+{
+    if (rp->rio_buf)
+        return 0;
+    if ((rp->rio_buf = bufpool_get(BUF_SIZE, &rp->rio_size, force)) == NULL)
+        return -1;
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_cnt = 0;
+    return 0;
 }
 
-/* 
- * rio_readlineb - robustly read a text line (buffered)
+/*
+ * rio_detach - Give the read buffer back to the pool once everything in it
+ *     is parsed and the request being served no longer points into it
  */
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+void rio_detach(client_t *c)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    rio_t *rp = &c->rio;
 
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+    if (rp->rio_buf == NULL || rp->rio_cnt > 0 ||
+        (c->context && c->state != PS_REQUESTLINE))
+        return;
+    bufpool_put(rp->rio_buf, rp->rio_size);
+    rp->rio_bufptr = rp->rio_buf = NULL;
+    rp->rio_size = 0;
+}
+
+/*
+ * rio_grow - Move the unread bytes into a buffer twice as large, for a
+ *     request head that does not fit. Returns -1 at MAX_LINE or out of memory
+ */
+int rio_grow(rio_t *rp)
+{
+    size_t size;
+    char *buf;
+
+    if (rp->rio_size >= MAX_LINE ||
+        (buf = bufpool_get(2 * rp->rio_size, &size, 1)) == NULL)
+        return -1;
+    memcpy(buf, rp->rio_bufptr, rp->rio_cnt);
+    bufpool_put(rp->rio_buf, rp->rio_size);
+    rp->rio_bufptr = rp->rio_buf = buf;
+    rp->rio_size = size;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: parse_args                                                      *
+* purpose:    read the options and the positional arguments into STATE        *
+* parameters: argc, argv - the command line                                   *
+* return:     none, exits with the usage message on a bad command line        *
+******************************************************************************/
+void parse_args(int argc, char *argv[])
+{
+    int opt;
+    static struct option options[] =
+    {
+        {"keepalive-timeout", required_argument, NULL, 't'},
+        {"max-requests",      required_argument, NULL, 'r'},
+        {"cache-bytes",       required_argument, NULL, 'c'},
+        {"workers",           required_argument, NULL, 'w'},
+        {"pin-cpus",          no_argument,       NULL, 'p'},
+        {"io-threads",        required_argument, NULL, 'i'},
+        {"io-uring",          no_argument,       NULL, 'u'},
+        {"buffer-bytes",      required_argument, NULL, 'b'},
+        {"access-log",        required_argument, NULL, 'a'},
+        {"access-log-mmap",   no_argument,       NULL, 'm'},
+        {"cgi-workers",       required_argument, NULL, 'g'},
+        {"max-body",          required_argument, NULL, 'l'},
+        {"upload-dir",        required_argument, NULL, 'd'},
+        {"crypto-threads",    required_argument, NULL, 'k'},
+        {NULL, 0, NULL, 0}
+    };
+
+    STATE.keepalive_timeout = KEEPALIVE_TIMEOUT;
+    STATE.max_requests = MAX_REQUESTS;
+    STATE.cache_bytes = CCACHE_BYTES;
+    STATE.workers = 1;
+    STATE.pin_cpus = 0;
+    STATE.io_threads = IO_THREADS;
+    STATE.use_uring = 0;
+    STATE.buf_bytes = BUF_BYTES;
+    STATE.alog_path[0] = '\0';
+    STATE.alog_mmap = 0;
+    STATE.cgi_workers = CGI_WORKERS;
+    STATE.max_body = MAX_BODY;
+    STATE.upload_path[0] = '\0';
+    STATE.crypto_threads = -1;
+
+    while ((opt = getopt_long(argc, argv, "t:r:c:w:pi:ub:a:mg:l:d:k:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            STATE.keepalive_timeout = (int)strtol(optarg, (char**)NULL, 10);
+            break;
+        case 'r':
+            STATE.max_requests = (int)strtol(optarg, (char**)NULL, 10);
+            break;
+        case 'c':
+            STATE.cache_bytes = (size_t)strtoull(optarg, (char**)NULL, 10);
+            break;
+        case 'w':
+            STATE.workers = (int)strtol(optarg, (char**)NULL, 10);
+            break;
+        case 'p':
+            STATE.pin_cpus = 1;
+            break;
+        case 'i':
+            STATE.io_threads = (int)strtol(optarg, (char**)NULL, 10);
+            break;
+        case 'u':
+            STATE.use_uring = 1;
+            break;
+        case 'b':
+            STATE.buf_bytes = (size_t)strtoull(optarg, (char**)NULL, 10);
+            break;
+        case 'a':
+            if (strlen(optarg) >= MAX_PATH)
+                usage_exit();
+            strcpy(STATE.alog_path, optarg);
+            break;
+        case 'm':
+            STATE.alog_mmap = 1;
+            break;
+        case 'g':
+            STATE.cgi_workers = (int)strtol(optarg, (char**)NULL, 10);
+            break;
+        case 'l':
+            STATE.max_body = strtoll(optarg, (char**)NULL, 10);
+            break;
+        case 'd':
+            if (strlen(optarg) >= MAX_PATH / 2)
+                usage_exit();
+            strcpy(STATE.upload_path, optarg);
+            break;
+        case 'k':
+            STATE.crypto_threads = (int)strtol(optarg, (char**)NULL, 10);
+            break;
+        default:
+            usage_exit();
+        }
     }
-    *bufp = 0;
-    return n;
+    if (argc - optind != 8 ||
+        STATE.keepalive_timeout <= 0 || STATE.max_requests <= 0 ||
+        STATE.workers <= 0 || STATE.workers > MAX_WORKERS ||
+        STATE.io_threads < 0 || STATE.io_threads > MAX_IO_THREADS ||
+        STATE.buf_bytes < BUF_CLASS_MIN ||
+        STATE.cgi_workers <= 0 || STATE.cgi_workers > CGI_WORKERS ||
+        STATE.max_body < 0 || STATE.max_body > INT_MAX ||
+        STATE.crypto_threads < -1 || STATE.crypto_threads > MAX_CRYPTO_THREADS)
+        usage_exit();
+    argv += optind;
+
+    STATE.port = (int)strtol(argv[0], (char**)NULL, 10);
+    STATE.s_port = (int)strtol(argv[1], (char**)NULL, 10);
+
+    strcpy(STATE.log_path, argv[2]);
+    strcpy(STATE.lck_path, argv[3]);
+    strcpy(STATE.www_path, argv[4]);
+    strcpy(STATE.cgi_path, argv[5]);
+    strcpy(STATE.key_path, argv[6]);
+    strcpy(STATE.ctf_path, argv[7]);
 }
 
 /******************************************************************************
@@ -890,9 +4848,43 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 void usage_exit()
 {
     fprintf(stdout,
-            "Usage: ./lisod <HTTP port> <HTTPS port> <log file> <lock file> \n"
+            "Usage: ./lisod [options] <HTTP port> <HTTPS port> <log file> <lock file> \n"
             "       <www folder> <CGI folder or script name> <private key file> \n"
             "       <certificate file> \n"
+            "Options: \n"
+            "    -t, --keepalive-timeout <sec> - close idle connections after sec \n"
+            "                                    seconds (default %d) \n"
+            "    -r, --max-requests <n>        - close a connection after n requests \n"
+            "                                    (default %d) \n"
+            "    -c, --cache-bytes <n>         - keep up to n bytes of small files \n"
+            "                                    in memory, 0 disables (default %d) \n"
+            "    -w, --workers <n>             - run n worker processes, each with its \n"
+            "                                    own event loop (default 1, max %d) \n"
+            "    -p, --pin-cpus                - pin each worker to its own CPU \n"
+            "    -i, --io-threads <n>          - threads per worker for disk I/O, 0 \n"
+            "                                    reads in the event loop (default %d) \n"
+            "    -u, --io-uring                - run the event loop on io_uring instead \n"
+            "                                    of epoll, disk I/O included \n"
+            "    -b, --buffer-bytes <n>        - cap the read and write buffers of \n"
+            "                                    the connections at n bytes per \n"
+            "                                    worker (default %d) \n"
+            "    -a, --access-log <file>       - write a binary access log, read it \n"
+            "                                    with lisod-logdump; with workers, \n"
+            "                                    one file per worker, <file>.<n> \n"
+            "    -m, --access-log-mmap         - write the access log through mmap() \n"
+            "    -g, --cgi-workers <n>         - run CGI programs from up to n worker \n"
+            "                                    processes per worker (default and \n"
+            "                                    max %d) \n"
+            "    -l, --max-body <n>            - refuse request bodies over n bytes \n"
+            "                                    with a 413 (default %lld) \n"
+            "    -d, --upload-dir <dir>        - store the bodies of POSTs to static \n"
+            "                                    paths in dir, named after the last \n"
+            "                                    path component; without it they \n"
+            "                                    are dropped \n"
+            "    -k, --crypto-threads <n>      - threads per worker for the private- \n"
+            "                                    key work of TLS handshakes, 0 does \n"
+            "                                    it in the event loop (default: the \n"
+            "                                    CPUs over the workers, max %d) \n"
             "Command line descriptions: \n"
             "    HTTP port - the port for HTTP server to listen on \n"
             "    HTTPS port - the port for HTTPS server to listen on \n"
@@ -901,8 +4893,9 @@ void usage_exit()
             "    www folder - folder containing a tree to serve as the root of a website \n"
             "    CGI folder - folder containign CGI programs \n"
             "    private key file - private key file path \n"
-            "    certificate file - certificate file path \n"
-            );
+            "    certificate file - certificate file path \n",
+            KEEPALIVE_TIMEOUT, MAX_REQUESTS, CCACHE_BYTES, MAX_WORKERS,
+            IO_THREADS, BUF_BYTES, CGI_WORKERS, MAX_BODY, MAX_CRYPTO_THREADS);
     exit(EXIT_FAILURE);
 }
 
@@ -914,22 +4907,92 @@ void usage_exit()
 ******************************************************************************/
 void clean()
 {
-    fclose(STATE.log);
+    log_close();
     close_socket(STATE.sock);
 }
 
 /******************************************************************************
 * subroutine: remove_client                                                   *
 * purpose:    remove a client from the pool after close a connection          *
-* parameters: id - the index number of the client in the pool                 *
+* parameters: c - the client to remove                                        *
 *             p - pointer to the pool instance                                *
 * return:     none                       `                                    *
 ******************************************************************************/
-void remove_client(int id, pool *p)
+void remove_client(client_t *c, pool *p)
+{
+    // unlink from the idle list
+    if (c->prev) c->prev->next = c->next;
+    else p->idle_head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else p->idle_tail = c->prev;
+    c->prev = c->next = NULL;
+
+    // a job still running finishes without its client, see io_done()
+    if (c->job)
+    {
+        c->job->owner = NULL;
+        c->job = NULL;
+    }
+    // and a CGI program's output is drained, see cgi_output()
+    if (c->cgi)
+    {
+        cgi_detach(c->cgi);
+        c->cgi = NULL;
+    }
+
+    if (c->context)
+        free_context(c);
+    if (c->waiting)
+        unwait_buffer(c, p);
+
+    // the ring may still read into the client or send from its queue; the
+    // shutdown() ends those operations and the last completion frees the
+    // slot, see uring_kick(). A handshake step on the crypto pool still
+    // uses the socket, reap_handshakes() frees the slot after it
+    if (c->uops > 0 || c->crypto)
+    {
+        c->dead = 1;
+        shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+    close_client(c, p);
+}
+
+/******************************************************************************
+* subroutine: close_client                                                    *
+* purpose:    close a removed client's descriptors and free its slot          *
+* parameters: c - the client                                                  *
+*             p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void close_client(client_t *c, pool *p)
 {
-    FD_CLR(p->clientfd[id], &p->read_set);
-    if (close(p->clientfd[id]) < 0) Log("Error: close client fd error");
-    p->clientfd[id] = -1;
+    metrics_count(C_CLOSES, 1);
+    release_output(c);
+
+    if (c->pipefd[0] >= 0)
+    {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+        c->pipefd[0] = c->pipefd[1] = -1;
+    }
+    c->piped = 0;
+    c->dead = 0;
+
+    if (c->rio.rio_buf)
+        bufpool_put(c->rio.rio_buf, c->rio.rio_size);
+    rio_readinitb(&c->rio, -1);
+
+    if (c->ssl)
+    {
+        tls_close(c->ssl);
+        c->ssl = NULL;
+    }
+
+    // close() also drops the descriptor from the epoll set
+    if (close(c->fd) < 0) Log("Error: close client fd error");
+    free_slot(c, p);
+    p->nclients--;
     STATE.is_full = 0;
 }
 
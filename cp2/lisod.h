@@ -1,92 +1,456 @@
 #ifndef _LISOD_H_
 #define _LISOD_H_
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             // sched_setaffinity(), CPU_SET()
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <getopt.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include "params.h"
 #include "log.h"
-
-struct lisod_state STATE;
+#include "fcache.h"
+#include "ccache.h"
+#include "iopool.h"
+#include "uring.h"
+#include "scan.h"
+#include "arena.h"
+#include "bufpool.h"
+#include "alog.h"
+#include "metrics.h"
+#include "cgipool.h"
+#include "tls.h"
+#include "cryptopool.h"
 
 /* this data structure wraps some attributes used for sending data with client */
 typedef struct
 {
     int rio_fd;                 // descriptor for this internal buf 
+    SSL *rio_ssl;               // TLS session the bytes come through, NULL
+                                // for a plain connection
     int rio_cnt;                // unread bytes in internal buf 
     char *rio_bufptr;           // next unread byte in internal buf 
-    char rio_buf[MAX_LINE];     // internal buffer 
+    char *rio_buf;              // internal buffer from the buffer pool, NULL
+                                // while there is nothing to parse
+    size_t rio_size;            // its size, up to MAX_LINE
 } rio_t;
 
-/* this data struture wraps some attributes used to manage a pool of connected 
- * clients. (originally from CSAPP)*/
-typedef struct
-{
-    int maxfd;                   // Largest descriptor in read_set
-    int nready;                  // Number of ready descriptors from select
-    int maxi;                    // Highwater index into client array
-    int clientfd[FD_SETSIZE];    // Set of active client descriptors
-    fd_set read_set;             // Set of all active descriptors
-    fd_set ready_set;            // Subset of descriptors ready for reading
-    rio_t clientrio[FD_SETSIZE]; // Set of active read buffers
-} pool;
-
-/* this datastructure wraps some attributes used for processing HTTP requests */
+/* this datastructure wraps some attributes used for processing HTTP requests.
+ * It lives in the client's arena; the slices point into the client's read
+ * buffer, which is not compacted until the request is done */
 typedef struct
 {
     int  is_secure;
     int  is_static;
     int  content_len;
-    char method[MIN_LINE];
-    char version[MIN_LINE];
-    char uri[MAX_LINE];
-    char filename[MAX_LINE];
-    char cgiargs[MAX_LINE];
+    int  has_contentlen;
+    int  chunked;               // Transfer-Encoding: chunked
+    int  expect;                // Expect: 100-continue
+    int  body;                  // BODY_* state of the request body
+    long long body_left;        // bytes left of the body, or of the chunk
+    long long body_len;         // body bytes announced so far
+    int  body_fd;               // where the body goes, -1 to drop it
+    int  body_err;              // errno of a failed write to it
+    int  body_pipe[2];          // an upload is spliced through this pipe
+    char *upload;               // the upload's file name, in the arena
+    char *upload_tmp;           // the file it is written to until the body
+                                // is complete, NULL if none
+    int  llen;                  // bytes in line
+    char line[MIN_LINE];        // chunk size line (or trailer) being read
+    fentry_t *file;             // cached file being served, NULL if none
+    int  file_err;              // errno of a failed open in the I/O pool
+    cblock_t *blk;              // response block filled by the I/O pool
+    slice_t method;
+    slice_t version;
+    slice_t uri;                // as sent, path and query
+    slice_t path;               // the uri up to '?'
+    slice_t query;              // the uri after '?', empty if none
+    int  nheaders;
+    header_t *headers;          // in the arena
+    char *filename;             // file to serve, in the arena
+    int  status;                // status of the response, 0 before one
+    uint64_t t_start;           // alog_now() at the first byte parsed
+    uint64_t t_head;            // alog_now() once the head was parsed
+    uint64_t t_find;            // alog_now() when the file lookup started
+    uint64_t t_found;           // and when it was done
+    size_t queued;              // client's queued bytes before the response
+    int  cgi_done;              // the CGI program's response is queued
 } HTTPContext;
 
+/* one piece of a queued response: bytes in the client's write buffer, bytes
+ * of a response block from the content cache, or a range of a cached file
+ * that is sent with sendfile(). A segment holds a reference to its cache
+ * entry until it is sent */
+enum { SEG_BUF, SEG_MEM, SEG_FILE };
+
+typedef struct
+{
+    int    type;                // SEG_BUF, SEG_MEM or SEG_FILE
+    union
+    {
+        cblock_t *blk;          // SEG_MEM: the cached response
+        fentry_t *file;         // SEG_FILE: the cached file
+    };
+    off_t  off;                 // next byte to send, in wbuf or the file
+    size_t len;                 // bytes left to send
+    off_t  ra_end;              // SEG_FILE: known to be in the page cache
+                                // up to here
+} seg_t;
+
+/* a request whose response is still in the output queue, timed once the
+ * queue gets past its last segment */
+typedef struct
+{
+    int      end;               // out_cnt when the request was done
+    uint64_t t_start;           // the request's t_start
+    uint64_t slot;              // its access log record, 0 if none
+} unsent_t;
+
+/* the output queue, the iovecs it is sent with and the requests it holds the
+ * responses of share one pooled buffer */
+#define OUTQ_SIZE (MAX_SEGS * (sizeof(seg_t) + sizeof(struct iovec)) + \
+                   MAX_PIPELINE * sizeof(unsent_t))
+
+/* parser states, a request is resumed from here on the next read event (or,
+ * in PS_SERVE, once the disk I/O its response waits for is done). The request
+ * line and headers are scanned together once the whole head is in; the body
+ * of a static request is taken in PS_BODY, a CGI program's goes to its stdin
+ * while the request is in PS_SERVE */
+enum { PS_REQUESTLINE, PS_BODY, PS_SERVE };
+
+/* where parse_requestbody() is in the body: the data of the body (or of a
+ * chunk), a chunk size line, the CRLF after a chunk, the trailer. BODY_NONE
+ * once it is all taken, or without a body */
+enum { BODY_NONE, BODY_DATA, BODY_SIZE, BODY_CRLF, BODY_TRAILER };
+
+/* return values of the request parsers */
+enum { PARSE_ERROR = -1, PARSE_AGAIN = 0, PARSE_DONE = 1, PARSE_BLOCKED = 2 };
+
+/* return values of rio_fill */
+enum { RIO_ERROR = -1, RIO_EOF = 0, RIO_AGAIN = 1, RIO_FULL = 2 };
+
+/* every object registered with epoll starts with one of these tags, so the
+ * event loop can tell what epoll_event.data.ptr points to */
+enum { EV_LISTENER, EV_CLIENT, EV_IOPOOL, EV_CGI, EV_CGIOUT, EV_CGIIN,
+       EV_TLSOUT, EV_CRYPTO };
+
+/* this data structure wraps a listening socket (HTTP or HTTPS port) */
+typedef struct
+{
+    int type;                   // EV_LISTENER
+    int fd;                     // listening descriptor
+    int is_secure;              // 1 for the HTTPS port
+    int armed;                  // io_uring: a multishot accept is pending
+} listener_t;
+
+/* this data structure wraps the eventfd of a thread pool, the disk I/O pool
+ * or the crypto pool */
+typedef struct
+{
+    int type;                   // EV_IOPOOL or EV_CRYPTO
+    int fd;                     // eventfd, -1 without the pool
+} iowatch_t;
+
+/* the chunk size line in front of forwarded CGI output, fixed width so the
+ * output can be read in right behind it */
+#define CGI_CHUNK_LINE 8
+
+/* this data structure wraps a CGI request: the pool's job, the request body
+ * on its way to the program's stdin and the response head read from the
+ * program, which is rewritten before it is sent. The body after the head is
+ * forwarded as it comes, at most CGI_WINDOW bytes ahead of the client */
+typedef struct cgireq
+{
+    cgijob_t job;               // first, job.type is EV_CGIOUT
+    struct cgiwatch
+    {
+        int type;               // EV_CGIIN, the tag stdin is watched with
+        struct cgireq *req;
+    } in;
+    int   started;              // stdin and stdout are set
+    int   in_armed;             // stdin is watched, the pipe was full
+    int   is_head;              // HEAD request, the body is dropped
+    int   head_done;            // the response head is queued
+    int   exited;               // the program exited (or never ran)
+    int   paused;               // stdout is not read until the client's
+                                // output queue has drained
+    int   failed;               // the response is cut short
+    int   chunked;              // the body is sent chunked
+    int   discard;              // the response has no body
+    long long left;             // body bytes the Content-Length still
+                                // promises, -1 without one
+    size_t hlen;                // bytes of the head read so far
+    char  head[CGI_HEAD];
+} cgireq_t;
+
+/* a CGI program found by find_script(), trusted for FCACHE_REVALIDATE seconds
+ * like a cached file. The table is direct-mapped on the script path */
+typedef struct
+{
+    char   script[MAX_PATH];    // the path a request maps to, "" if unused
+    char   real[PATH_MAX];      // the program it resolves to
+    int    err;                 // why it cannot be run, 0 if it can
+    time_t checked;             // when it was resolved
+} cgiscript_t;
+
+/* this data structure wraps the state of one connected client */
+typedef struct client
+{
+    int   type;                 // EV_CLIENT
+    int   fd;                   // client descriptor, -1 if the slot is free
+    int   id;                   // number of this slot in the pool
+    int   is_secure;            // accepted on the HTTPS port
+    SSL  *ssl;                  // its TLS session, NULL on the HTTP port
+    int   tls_up;               // the TLS handshake is done
+    int   ktls;                 // KTLS_TX, KTLS_RX: what the kernel encrypts
+    int   state;                // parser state of the current request
+    int   is_closed;            // close the connection after this request
+    int   closing;              // close once the output queue has drained
+    int   nrequests;            // requests served on this connection
+    uint8_t addr[16];           // peer address, IPv4 mapped into IPv6; only
+                                // known with an access log
+    time_t last_active;         // last time the client was heard from
+    struct client *prev;        // neighbours in the pool's idle list, which
+    struct client *next;        // is ordered by last_active; a free slot is
+                                // linked into the free list through next
+    struct client *wprev;       // neighbours in the pool's list of clients
+    struct client *wnext;       // waiting for a read buffer
+    int   waiting;              // on that list
+    HTTPContext *context;       // request being parsed, NULL between requests
+    arena_t arena;              // memory of the current request
+    iojob_t *job;               // disk I/O the client waits for, NULL if none
+    cgireq_t *cgi;              // CGI program the client waits for, NULL if
+                                // none
+    cryptojob_t *crypto;        // handshake step on the crypto pool, NULL if
+                                // none; it keeps the socket (and the slot)
+    rio_t rio;                  // read buffer
+    seg_t *out;                 // queued responses, sent in order; from the
+                                // buffer pool while there are any
+    int   out_head;             // first unsent segment
+    int   out_cnt;              // number of queued segments
+    unsent_t *unsent;           // requests whose response is queued, in the
+                                // block out is in
+    int   unsent_head;          // first one not sent yet
+    int   unsent_cnt;           // number of them
+    char *wbuf;                 // response headers of the queued responses,
+                                // from the buffer pool like out
+    size_t wlen;                // bytes used in wbuf
+    size_t wcap;                // size of wbuf
+    size_t queued;              // bytes ever queued on the connection
+    uint64_t t_accept;          // alog_now() when the client was accepted
+    uint64_t t_queued;          // alog_now() when the output queue got its
+                                // first segment
+    // io_uring backend only
+    int   uops;                 // ring operations in flight for the client
+    int   dead;                 // removed, the slot is freed once uops is 0
+    int   recv_armed;           // a receive is pending
+    int   body_armed;           // a poll for more of the request body is
+                                // pending
+    struct tlswatch
+    {
+        int type;               // EV_TLSOUT
+        struct client *c;
+    } tls_out;                  // polled while TLS records wait for room in
+                                // the socket; a TLS client's receives are
+                                // polls on the client itself
+    int   send_busy;            // a send or splice is pending
+    int   pipefd[2];            // pipe file ranges are spliced through, -1
+    size_t piped;               // file bytes waiting in the pipe
+    struct msghdr msg;          // the pending sendmsg
+    struct iovec *iov;          // MAX_SEGS, in the block out is in
+} client_t;
+
+/* what an io_uring completion is for, kept in the low bits of user_data next
+ * to the client (or job) pointer; accepts keep the listener index instead */
+enum { UOP_TICK, UOP_ACCEPT, UOP_RECV, UOP_SEND, UOP_SPLICE_IN, UOP_SPLICE_OUT,
+       UOP_JOB, UOP_POLL };
+#define UOP_MASK 7
+
+/* a disk I/O job run as ring operations: IO_OPEN is an openat followed by a
+ * statx, IO_PREAD one read (resubmitted after a short one) */
+typedef struct
+{
+    iojob_t *job;
+    int    fd;                  // IO_OPEN: the opened file, -1 before
+    size_t done;                // IO_PREAD: bytes read so far
+    struct statx stx;           // IO_OPEN: filled by the statx
+} ujob_t;
+
+/* this data struture wraps some attributes used to manage a pool of connected 
+ * clients. (originally from CSAPP, moved from select() to epoll) Client slots
+ * are allocated CLIENT_CHUNK at a time as connections come in and are never
+ * moved, since epoll and the ring hold pointers to them; slot id lives in
+ * chunks[id / CLIENT_CHUNK][id % CLIENT_CHUNK] */
+typedef struct
+{
+    int epfd;                               // epoll instance
+    int nready;                             // Number of ready events from epoll
+    int nslots;                             // Number of client slots allocated
+    int nclients;                           // Number of active clients
+    client_t *free_slots;                   // unused slots, last freed first
+    client_t *wait_head;                    // clients waiting for a read
+    client_t *wait_tail;                    // buffer, first come first served
+    client_t *idle_head;                    // least recently active client
+    client_t *idle_tail;                    // most recently active client
+    listener_t listeners[2];                // HTTP and HTTPS listeners
+    iowatch_t io;                           // completions of the I/O pool
+    iowatch_t crypto __attribute__((aligned(8)));  // and of the crypto pool;
+                                            // tagged by the ring like a client
+    struct epoll_event events[MAX_EVENTS];  // ready events from epoll_wait
+    client_t *chunks[MAX_CLIENTS / CLIENT_CHUNK];
+} pool;
+
 /* declaration of subroutines */
 void clean();
 void usage_exit();
+void parse_args(int argc, char *argv[]);
 void lisod_shutdown();
 void signal_handler(int sig);
 void daemonize();
 int  close_socket(int sock);
+int  set_nonblocking(int fd);
+int  open_listener(int port);
+pid_t spawn_worker(int id, int *socks, int *s_socks);
+int  run_worker(int id, int sock, int s_sock);
+void run_epoll(pool *p);
+void pin_worker(int id);
 
-void init_pool(pool *p);
-int  add_client(int client_fd, pool *p);
-void remove_client(int index, pool *p);
-void check_clients(pool *p);
+int  init_pool(pool *p);
+void accept_clients(listener_t *l, pool *p);
+int  add_client(int client_fd, int is_secure, pool *p);
+client_t *alloc_slot(pool *p);
+void free_slot(client_t *c, pool *p);
+void wait_buffer(client_t *c, pool *p);
+void unwait_buffer(client_t *c, pool *p);
+void wake_waiters(pool *p);
+void remove_client(client_t *c, pool *p);
+void check_client(client_t *c, pool *p);
+void touch_client(client_t *c, pool *p);
+void expire_clients(pool *p);
+int  serve_buffered(client_t *c);
+void close_client(client_t *c, pool *p);
 
 void *get_in_addr(struct sockaddr *sa);
-void process_request(int id, pool *p, int *is_closed); 
-int  parse_requestline(int id, pool *p, HTTPContext *context, int *is_closed);
-void parse_uri(HTTPContext *context);
-int  parse_requestheaders(int id, pool *p, HTTPContext *context, int *is_closed);
-int parse_requestbody(int id, pool *p, HTTPContext *context, int *is_closed);
-void serve_head(int client_fd, HTTPContext *context, int *is_closed);
-void serve_get(int client_fd, HTTPContext *context,  int *is_closed);
-void serve_post(int client_fd, HTTPContext *context,  int *is_closed);
-int  serve_body(int client_fd, HTTPContext *context, int *is_closed);
-void serve_error(int client_fd, char *errnum, char *shortmsg, char *longmsg, int is_closed);
-
-int  validate_file(int client_d, HTTPContext *context, int *is_closed);
-void get_filetype(char *filename, char *filetype);
+void get_peer(client_t *c);
+int  process_request(client_t *c, int *is_closed); 
+void free_context(client_t *c);
+uint64_t log_access(client_t *c, HTTPContext *context);
+void count_request(client_t *c, HTTPContext *context);
+void time_response(client_t *c, uint64_t t_start, uint64_t slot);
+void sent_responses(client_t *c);
+void response_sent(uint64_t t_start, uint64_t slot, uint64_t now);
+void serve_status(client_t *c, HTTPContext *context, int *is_closed);
+int  parse_requestline(client_t *c, HTTPContext *context, scan_t *scan,
+                       int *is_closed);
+int  parse_uri(client_t *c, HTTPContext *context);
+int  parse_requestheaders(client_t *c, HTTPContext *context, scan_t *scan,
+                          int *is_closed);
+int  parse_requestbody(client_t *c, HTTPContext *context, int *is_closed);
+int  body_data(client_t *c, HTTPContext *context);
+int  body_line(client_t *c, HTTPContext *context);
+int  wait_body(client_t *c);
+int  open_upload(client_t *c, HTTPContext *context, int *is_closed);
+int  serve_head(client_t *c, HTTPContext *context, int *is_closed);
+void serve_get(client_t *c, HTTPContext *context,  int *is_closed);
+void serve_post(client_t *c, HTTPContext *context,  int *is_closed);
+void serve_cgi(client_t *c, HTTPContext *context, int *is_closed);
+int  find_script(const char **info, const char *end, char *real);
+int  serve_cached(client_t *c, HTTPContext *context, int *is_closed);
+int  serve_body(client_t *c, HTTPContext *context, int *is_closed);
+void serve_error(client_t *c, char *errnum, char *shortmsg, char *longmsg, int is_closed);
+int  format_error(char *buf, char *errnum, char *shortmsg, char *longmsg, int is_closed);
+
+char *queue_reserve(client_t *c, size_t len);
+seg_t *queue_seg(client_t *c);
+void drop_queue(client_t *c);
+int  queue_commit(client_t *c, size_t len);
+int  queue_bytes(client_t *c, const char *buf, size_t len);
+int  queue_mem(client_t *c, cblock_t *blk, off_t off, size_t len);
+int  queue_file(client_t *c, fentry_t *file, off_t off, size_t len);
+int  flush_client(client_t *c);
+int  tls_flush(client_t *c);
+int  tls_accept(client_t *c);
+int  tls_input(client_t *c);
+int  tls_wait(client_t *c);
+int  init_crypto(pool *p);
+void reap_handshakes(pool *p);
+ssize_t sock_recv(client_t *c, void *buf, size_t len, int peek);
+void retire_output(client_t *c, size_t sent);
+void release_output(client_t *c);
+
+int  validate_file(client_t *c, HTTPContext *context, int *is_closed);
+int  find_file(client_t *c, HTTPContext *context);
+int  read_block(client_t *c, HTTPContext *context, cblock_t *blk);
+int  warm_window(client_t *c, seg_t *s);
+iojob_t *new_job(client_t *c, int op, fentry_t *file);
+void reap_jobs(pool *p);
+void io_done(iojob_t *job, pool *p);
+void submit_job(iojob_t *job);
+
+int  cgi_env(char *buf, size_t *len, const char *name, const char *value,
+             size_t vlen);
+int  cgi_env_join(char *buf, size_t *len, const char *value, size_t vlen);
+int  cgi_var(const header_t *h, char *buf, size_t size);
+int  watch_pipe(void *obj, int fd, int events);
+int  watch_cgi(void *obj, int fd);
+void cgi_ready(void *obj, pool *p);
+void cgi_update(cgireq_t *req, pool *p);
+void cgi_input(cgireq_t *req, pool *p);
+void cgi_output(cgireq_t *req, pool *p);
+int  cgi_read(client_t *c, cgireq_t *req);
+int  cgi_head(client_t *c, cgireq_t *req, size_t *used);
+int  cgi_forward(client_t *c, cgireq_t *req, const char *buf, size_t len);
+void cgi_resume(cgireq_t *req, pool *p);
+void cgi_done(cgireq_t *req, pool *p);
+void cgi_release(cgireq_t *req);
+void cgi_detach(cgireq_t *req);
+
+int  uring_start(pool *p);
+void run_uring(pool *p);
+void uring_complete(uint64_t data, int res, unsigned flags, pool *p);
+int  uring_accept(int i, pool *p);
+void uring_accepted(listener_t *l, int fd, pool *p);
+int  uring_tick();
+int  uring_recv(client_t *c, int direct);
+int  uring_send(client_t *c);
+void uring_kick(client_t *c, pool *p);
+int  uring_job(ujob_t *uj);
+void uring_job_done(ujob_t *uj, int res, pool *p);
 
 // wrappers from csapp
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n);
+int  rio_fill(rio_t *rp);
+int  rio_attach(rio_t *rp, int force);
+void rio_detach(client_t *c);
+int  rio_grow(rio_t *rp);
+void rio_compact(client_t *c);
 void rio_readinitb(rio_t *rp, int fd);
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 void tostring(char str[], int num);
 #endif
@@ -0,0 +1,778 @@
+/*******************************************************************************
+* lisoload.c                                                                   *
+*                                                                              *
+* Description: This file contains a load generator for the Liso server. Each  *
+*              thread drives its share of the connections from one epoll loop *
+*              with HTTP/1.1 keep-alive and, with -p, depth requests in flight *
+*              per connection. The uris are drawn at random from a weighted   *
+*              mix (-u, -f).                                                   *
+*                                                                              *
+*              Closed loop (the default): every connection sends its next     *
+*              request as soon as a response comes back, so the load is what  *
+*              the server can take. Open loop (-r rate): requests are due at a *
+*              constant rate whatever the server does, and their latency is   *
+*              counted from when they were due, not from when a connection    *
+*              was free to send them. A stalled server then shows up in the   *
+*              latency instead of thinning out the samples (no coordinated    *
+*              omission).                                                      *
+*                                                                              *
+*              Latencies go into a log-linear histogram (within 3%); the      *
+*              report has the throughput and the p50/p90/p99/p99.9 latency.   *
+*                                                                              *
+* Usage:       ./lisoload [-c conns] [-t threads] [-p depth] [-d secs]         *
+*                         [-w secs] [-r rate] [-u uri]... [-f mix file]        *
+*                         <host> <port>                                        *
+* example:     ./lisoload -c 1000 -t 4 -p 4 -d 10 -f bench.mix 127.0.0.1 8080  *
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_DEPTH  64
+#define MAX_URIS   256
+#define MAX_REQ    1024
+#define MAX_EVENTS 256
+#define IN_BUF     65536
+#define H_SUB_BITS 5                            // 32 buckets per power of two
+#define H_SUB      (1 << H_SUB_BITS)
+#define H_BUCKETS  (H_SUB * 60)
+
+/* one connection and the requests in flight on it, oldest first */
+typedef struct conn
+{
+    int   fd;                   // -1 while closed
+    int   connected;
+    int   is_free;              // open loop: on the thread's free list
+    struct conn *next_free;
+    char  out[MAX_DEPTH * MAX_REQ];
+    int   olen, ooff;           // requests written up to ooff
+    char  in[IN_BUF];
+    int   ilen;
+    int   in_body;              // the head of the response is consumed
+    long  body_left;            // chunked: of the chunk and its CRLF, -1
+                                // while its size line is due
+    int   chunked;              // the body is chunked, up to its last chunk
+    int   status;
+    int   closing;              // the response said Connection: close
+    uint64_t t[MAX_DEPTH];      // when the requests in flight started
+    int   head, cnt;
+} conn_t;
+
+/* one load thread; the results are summed up at the end */
+typedef struct
+{
+    int   id;
+    int   nconns;
+    conn_t *conns;
+    int   epfd;
+    double rate;                // requests per second, 0 for a closed loop
+    uint64_t interval;          // ns between two requests due
+    uint64_t next_due;
+    uint64_t *backlog;          // open loop: due requests not sent yet
+    size_t bhead, bcnt, bcap;
+    conn_t *free;               // open loop: connections with room
+    int   ndead;                // connections to open again
+    unsigned seed;
+    // results
+    unsigned long done;         // responses in the measured interval
+    unsigned long errors;       // non-2xx responses
+    unsigned long reissued;     // requests lost to a closed connection
+    unsigned long conn_errors;  // connections that failed to open
+    unsigned long bytes;
+    unsigned long hist[H_BUCKETS];
+    uint64_t sum, max;
+} thread_t;
+
+static struct
+{
+    struct addrinfo *ai;
+    char  *reqs[MAX_URIS];      // the request for each uri
+    int    lens[MAX_URIS];
+    unsigned cum[MAX_URIS];     // cumulated weights
+    int    nuris;
+    int    depth;
+    uint64_t start;             // ns, the measured interval starts here
+    uint64_t end;
+} cfg;
+
+static void *run_thread(void *arg);
+static void open_conn(thread_t *th, conn_t *c);
+static void close_conn(thread_t *th, conn_t *c);
+static void conn_event(thread_t *th, conn_t *c, uint32_t events);
+static int  send_requests(thread_t *th, conn_t *c, uint64_t now);
+static void add_request(thread_t *th, conn_t *c, uint64_t t);
+static int  flush_conn(thread_t *th, conn_t *c);
+static int  read_conn(thread_t *th, conn_t *c);
+static int  parse_responses(thread_t *th, conn_t *c);
+static void complete(thread_t *th, conn_t *c, int status);
+static void push_free(thread_t *th, conn_t *c);
+static void dispatch(thread_t *th);
+static void backlog_push(thread_t *th, uint64_t t, int front);
+static void watch(thread_t *th, conn_t *c, int op);
+static int  add_uri(const char *uri, unsigned weight, const char *host,
+                    const char *port);
+static int  read_mix(const char *path, const char *host, const char *port);
+static int  bucket_of(uint64_t v);
+static uint64_t bucket_top(int b);
+static uint64_t now_ns();
+static void usage_exit();
+
+int main(int argc, char *argv[])
+{
+    int opt, i, rv, nconns = 100, nthreads = 1;
+    double secs = 5, warmup = 0, rate = 0, elapsed;
+    const char *mix = NULL, *uris[MAX_URIS];
+    int nuris = 0;
+    struct addrinfo hints;
+    struct rlimit rl;
+    pthread_t *tids;
+    thread_t *ths, tot;
+    unsigned long n, seen, pct[4];
+    static const double PCT[4] = { 0.5, 0.9, 0.99, 0.999 };
+    int b, k;
+
+    cfg.depth = 1;
+    while ((opt = getopt(argc, argv, "c:t:p:d:w:r:u:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': nconns = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'p': cfg.depth = atoi(optarg); break;
+        case 'd': secs = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'u': if (nuris < MAX_URIS) uris[nuris++] = optarg; break;
+        case 'f': mix = optarg; break;
+        default:  usage_exit();
+        }
+    }
+    if (argc - optind != 2 || nconns <= 0 || nthreads <= 0 ||
+        nthreads > nconns || cfg.depth <= 0 || cfg.depth > MAX_DEPTH ||
+        secs <= 0 || warmup < 0 || rate < 0)
+        usage_exit();
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(argv[optind], argv[optind+1], &hints, &cfg.ai)) != 0)
+    {
+        fprintf(stderr, "lisoload: %s\n", gai_strerror(rv));
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nuris; i++)
+        if (add_uri(uris[i], 1, argv[optind], argv[optind+1]) < 0)
+            usage_exit();
+    if (mix && read_mix(mix, argv[optind], argv[optind+1]) < 0)
+        return EXIT_FAILURE;
+    if (cfg.nuris == 0)
+        add_uri("/index.html", 1, argv[optind], argv[optind+1]);
+
+    // every connection is a descriptor, take as many as we are allowed
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ths = calloc(nthreads, sizeof(thread_t));
+    tids = calloc(nthreads, sizeof(pthread_t));
+    cfg.start = now_ns() + (uint64_t)(warmup * 1e9);
+    cfg.end = cfg.start + (uint64_t)(secs * 1e9);
+    for (i = 0; i < nthreads; i++)
+    {
+        ths[i].id = i;
+        ths[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+        ths[i].rate = rate / nthreads;
+        ths[i].seed = 12345 + i;
+        if (pthread_create(&tids[i], NULL, run_thread, &ths[i]) != 0)
+        {
+            fprintf(stderr, "lisoload: failed starting thread %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    memset(&tot, 0, sizeof tot);
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        tot.done += ths[i].done;
+        tot.errors += ths[i].errors;
+        tot.reissued += ths[i].reissued;
+        tot.conn_errors += ths[i].conn_errors;
+        tot.bytes += ths[i].bytes;
+        tot.bcnt += ths[i].bcnt;
+        tot.sum += ths[i].sum;
+        if (ths[i].max > tot.max)
+            tot.max = ths[i].max;
+        for (b = 0; b < H_BUCKETS; b++)
+            tot.hist[b] += ths[i].hist[b];
+    }
+    elapsed = secs;
+
+    memset(pct, 0, sizeof pct);
+    for (b = 0, k = 0, seen = 0, n = tot.done; b < H_BUCKETS && k < 4 && n; b++)
+    {
+        seen += tot.hist[b];
+        while (k < 4 && seen >= PCT[k] * n)
+            pct[k++] = bucket_top(b);
+    }
+
+    printf("load:             %s, %d connections, depth %d, %d threads\n",
+           rate ? "open loop" : "closed loop", nconns, cfg.depth, nthreads);
+    if (rate)
+        printf("target rate:      %.1f req/s (%zu due but unsent at the end)\n",
+               rate, tot.bcnt);
+    printf("uris:             %d\n", cfg.nuris);
+    printf("duration:         %.1f s after %.1f s warmup\n", secs, warmup);
+    printf("requests:         %lu (%lu not 2xx, %lu reissued, %lu failed "
+           "connects)\n", tot.done, tot.errors, tot.reissued, tot.conn_errors);
+    printf("throughput:       %.1f req/s, %.2f MB/s\n", tot.done / elapsed,
+           tot.bytes / elapsed / (1 << 20));
+    printf("latency (us):     mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+           "p99.9 %.1f, max %.1f\n",
+           tot.done ? tot.sum / 1e3 / tot.done : 0.0, pct[0] / 1e3,
+           pct[1] / 1e3, pct[2] / 1e3, pct[3] / 1e3, tot.max / 1e3);
+
+    freeaddrinfo(cfg.ai);
+    return tot.done && !tot.errors ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/******************************************************************************
+* subroutine: run_thread                                                      *
+* purpose:    open the thread's connections and keep them busy until the end *
+*             of the run                                                      *
+* parameters: arg - the thread                                                *
+* return:     NULL                                                            *
+******************************************************************************/
+static void *run_thread(void *arg)
+{
+    thread_t *th = arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now, last_retry = 0;
+    int i, n, timeout;
+
+    if ((th->epfd = epoll_create1(0)) < 0 ||
+        (th->conns = calloc(th->nconns, sizeof(conn_t))) == NULL)
+    {
+        fprintf(stderr, "lisoload: thread %d: %s\n", th->id, strerror(errno));
+        return NULL;
+    }
+    if (th->rate > 0)
+    {
+        th->interval = 1e9 / th->rate;
+        th->next_due = now_ns();
+    }
+    for (i = 0; i < th->nconns; i++)
+        open_conn(th, &th->conns[i]);
+
+    while ((now = now_ns()) < cfg.end)
+    {
+        // open loop: whatever is due goes to the backlog, and from there to
+        // the connections with room
+        if (th->rate > 0)
+        {
+            for (; th->next_due <= now; th->next_due += th->interval)
+                backlog_push(th, th->next_due, 0);
+            dispatch(th);
+        }
+
+        // connections the server closed (or refused) are opened again
+        if (th->ndead && now - last_retry > 100000000)
+        {
+            last_retry = now;
+            for (i = 0; i < th->nconns; i++)
+                if (th->conns[i].fd < 0)
+                {
+                    th->ndead--;
+                    open_conn(th, &th->conns[i]);
+                }
+        }
+
+        timeout = (cfg.end - now) / 1000000 + 1;
+        if (th->rate > 0 && th->next_due > now &&
+            (th->next_due - now) / 1000000 < timeout)
+            timeout = (th->next_due - now) / 1000000;
+        if (th->ndead && timeout > 100)
+            timeout = 100;
+
+        if ((n = epoll_wait(th->epfd, events, MAX_EVENTS, timeout)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < n; i++)
+            conn_event(th, events[i].data.ptr, events[i].events);
+    }
+
+    for (i = 0; i < th->nconns; i++)
+        if (th->conns[i].fd >= 0)
+            close(th->conns[i].fd);
+    close(th->epfd);
+    free(th->conns);
+    free(th->backlog);
+    return NULL;
+}
+
+/* start a non-blocking connect; it is done when the socket turns writable */
+static void open_conn(thread_t *th, conn_t *c)
+{
+    int one = 1;
+
+    // is_free is left alone, the connection may still be on the free list
+    c->connected = 0;
+    c->olen = c->ooff = c->ilen = 0;
+    c->in_body = c->closing = 0;
+    c->head = c->cnt = 0;
+
+    if ((c->fd = socket(cfg.ai->ai_family, cfg.ai->ai_socktype | SOCK_NONBLOCK,
+                        cfg.ai->ai_protocol)) < 0)
+        goto Fail;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    if (connect(c->fd, cfg.ai->ai_addr, cfg.ai->ai_addrlen) < 0 &&
+        errno != EINPROGRESS)
+    {
+        close(c->fd);
+        goto Fail;
+    }
+    watch(th, c, EPOLL_CTL_ADD);
+    return;
+
+    Fail:
+    c->fd = -1;
+    th->ndead++;
+    th->conn_errors++;
+}
+
+/* close a connection, to be opened again; its requests in flight are sent
+ * again, in an open loop still timed from when they were due */
+static void close_conn(thread_t *th, conn_t *c)
+{
+    int i;
+
+    close(c->fd);
+    c->fd = -1;
+    th->ndead++;
+
+    th->reissued += c->cnt;
+    if (th->rate > 0)
+        for (i = c->cnt - 1; i >= 0; i--)
+            backlog_push(th, c->t[(c->head + i) % MAX_DEPTH], 1);
+    c->cnt = 0;
+
+    // off the free list, whose entries are checked when they are popped
+    c->connected = 0;
+}
+
+static void conn_event(thread_t *th, conn_t *c, uint32_t events)
+{
+    int err = 0;
+    socklen_t len = sizeof err;
+
+    if (c->fd < 0)
+        return;
+
+    if (!c->connected)
+    {
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+        {
+            th->conn_errors++;
+            close_conn(th, c);
+            return;
+        }
+        if (!(events & (EPOLLOUT | EPOLLIN)))
+            return;
+        c->connected = 1;
+        watch(th, c, EPOLL_CTL_MOD);
+        if (th->rate > 0)
+            push_free(th, c);
+        else if (send_requests(th, c, now_ns()) < 0)
+            goto Reopen;
+        return;
+    }
+
+    // the server closing a connection is business as usual (max requests),
+    // it is opened again right away
+    if (((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && read_conn(th, c) < 0) ||
+        ((events & EPOLLOUT) && flush_conn(th, c) < 0))
+    {
+        Reopen:
+        close_conn(th, c);
+        th->ndead--;
+        open_conn(th, c);
+    }
+}
+
+/* closed loop: fill the pipeline up to depth, timed from now */
+static int send_requests(thread_t *th, conn_t *c, uint64_t now)
+{
+    while (c->cnt < cfg.depth)
+        add_request(th, c, now);
+    return flush_conn(th, c);
+}
+
+/* append a request for a uri picked by weight, started at t */
+static void add_request(thread_t *th, conn_t *c, uint64_t t)
+{
+    unsigned r = rand_r(&th->seed) % cfg.cum[cfg.nuris - 1];
+    int i;
+
+    for (i = 0; cfg.cum[i] <= r; i++)
+        ;
+    memcpy(c->out + c->olen, cfg.reqs[i], cfg.lens[i]);
+    c->olen += cfg.lens[i];
+    c->t[(c->head + c->cnt++) % MAX_DEPTH] = t;
+}
+
+/* write the unsent requests; EPOLLOUT is watched while some are left */
+static int flush_conn(thread_t *th, conn_t *c)
+{
+    ssize_t n;
+    int was_pending = c->ooff < c->olen;
+
+    while (c->ooff < c->olen)
+    {
+        if ((n = write(c->fd, c->out + c->ooff, c->olen - c->ooff)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            return -1;
+        }
+        c->ooff += n;
+    }
+    if (c->ooff == c->olen)
+        c->ooff = c->olen = 0;
+    if (was_pending != (c->ooff < c->olen))
+        watch(th, c, EPOLL_CTL_MOD);
+    return 0;
+}
+
+/* read until the socket is drained; -1 when the connection is done with */
+static int read_conn(thread_t *th, conn_t *c)
+{
+    ssize_t n;
+    uint64_t now;
+
+    while (1)
+    {
+        n = read(c->fd, c->in + c->ilen, IN_BUF - c->ilen);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (n == 0)
+            return -1;
+        c->ilen += n;
+        now = now_ns();
+        if (now >= cfg.start && now < cfg.end)
+            th->bytes += n;
+        if (parse_responses(th, c) < 0 || c->closing)
+            return -1;
+    }
+}
+
+/* take the complete responses out of the input buffer */
+static int parse_responses(thread_t *th, conn_t *c)
+{
+    char *p = c->in, *end = c->in + c->ilen, *hend, *line, *eol;
+    long take, size;
+
+    while (p < end)
+    {
+        if (!c->in_body)
+        {
+            if ((hend = memmem(p, end - p, "\r\n\r\n", 4)) == NULL)
+                break;
+            if (end - p < 12 || strncmp(p, "HTTP/1.", 7) != 0)
+                return -1;
+            c->status = atoi(p + 9);
+            c->body_left = 0;
+            c->chunked = 0;
+            for (line = p; line < hend; line = eol + 2)
+            {
+                eol = memmem(line, hend + 2 - line, "\r\n", 2);
+                if (strncasecmp(line, "Content-Length:", 15) == 0)
+                    c->body_left = atol(line + 15);
+                else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 &&
+                         memmem(line, eol - line, "chunked", 7))
+                {
+                    c->chunked = 1;
+                    c->body_left = -1;
+                }
+                else if (strncasecmp(line, "Connection:", 11) == 0 &&
+                         memmem(line, eol - line, "close", 5))
+                    c->closing = 1;
+            }
+            p = hend + 4;
+            c->in_body = 1;
+        }
+
+        if (c->chunked && c->body_left < 0)
+        {
+            if ((eol = memmem(p, end - p, "\r\n", 2)) == NULL)
+                break;
+            size = strtol(p, NULL, 16);
+            p = eol + 2;
+            // the data and its CRLF; the last chunk is followed by the empty
+            // line that ends the (never sent) trailer
+            c->body_left = size + 2;
+            if (size == 0)
+                c->chunked = 0;
+        }
+
+        take = end - p < c->body_left ? end - p : c->body_left;
+        p += take;
+        c->body_left -= take;
+        if (c->body_left > 0)
+            break;
+        if (c->chunked)
+        {
+            c->body_left = -1;
+            continue;
+        }
+        c->in_body = 0;
+        complete(th, c, c->status);
+        if (c->closing)
+            break;
+    }
+
+    // a head longer than the buffer cannot be parsed
+    if (p == c->in && c->ilen == IN_BUF)
+        return -1;
+    memmove(c->in, p, end - p);
+    c->ilen = end - p;
+
+    // the connection has room for more requests
+    if (!c->closing && c->cnt < cfg.depth)
+    {
+        if (th->rate > 0)
+            push_free(th, c);
+        else
+            return send_requests(th, c, now_ns());
+    }
+    return 0;
+}
+
+/* a response for the oldest request in flight is in */
+static void complete(thread_t *th, conn_t *c, int status)
+{
+    uint64_t t = c->t[c->head], now = now_ns(), lat;
+
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->cnt--;
+    if (t < cfg.start || now >= cfg.end)
+        return;
+
+    lat = now - t;
+    th->hist[bucket_of(lat)]++;
+    th->sum += lat;
+    if (lat > th->max)
+        th->max = lat;
+    th->done++;
+    if (status < 200 || status >= 300)
+        th->errors++;
+}
+
+static void push_free(thread_t *th, conn_t *c)
+{
+    if (c->is_free)
+        return;
+    c->is_free = 1;
+    c->next_free = th->free;
+    th->free = c;
+}
+
+/* open loop: hand the due requests to connections with room */
+static void dispatch(thread_t *th)
+{
+    conn_t *c;
+
+    while (th->bcnt && (c = th->free) != NULL)
+    {
+        th->free = c->next_free;
+        c->is_free = 0;
+        if (c->fd < 0 || !c->connected)
+            continue;
+
+        while (th->bcnt && c->cnt < cfg.depth)
+        {
+            add_request(th, c, th->backlog[th->bhead]);
+            th->bhead = (th->bhead + 1) % th->bcap;
+            th->bcnt--;
+        }
+        if (flush_conn(th, c) < 0)
+        {
+            close_conn(th, c);
+            th->ndead--;
+            open_conn(th, c);
+        }
+        else if (c->cnt < cfg.depth)
+            push_free(th, c);
+    }
+}
+
+/* queue a due request, at the back, or at the front when it is resent */
+static void backlog_push(thread_t *th, uint64_t t, int front)
+{
+    uint64_t *nb;
+    size_t i, ncap;
+
+    if (th->bcnt == th->bcap)
+    {
+        ncap = th->bcap ? 2 * th->bcap : 1024;
+        if ((nb = malloc(ncap * sizeof(uint64_t))) == NULL)
+            return;
+        for (i = 0; i < th->bcnt; i++)
+            nb[i] = th->backlog[(th->bhead + i) % th->bcap];
+        free(th->backlog);
+        th->backlog = nb;
+        th->bcap = ncap;
+        th->bhead = 0;
+    }
+    if (front)
+    {
+        th->bhead = (th->bhead + th->bcap - 1) % th->bcap;
+        th->backlog[th->bhead] = t;
+    }
+    else
+        th->backlog[(th->bhead + th->bcnt) % th->bcap] = t;
+    th->bcnt++;
+}
+
+/* watch the connection for input, and for output while it connects or has
+ * unsent requests */
+static void watch(thread_t *th, conn_t *c, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (!c->connected || c->ooff < c->olen)
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(th->epfd, op, c->fd, &ev);
+}
+
+/* build the request for a uri and add it to the mix */
+static int add_uri(const char *uri, unsigned weight, const char *host,
+                   const char *port)
+{
+    char buf[MAX_REQ];
+    int len;
+
+    if (cfg.nuris == MAX_URIS || weight == 0)
+        return -1;
+    len = snprintf(buf, sizeof buf, "GET %s HTTP/1.1\r\nHost: %s:%s\r\n\r\n",
+                   uri, host, port);
+    if (len >= (int)sizeof buf || (cfg.reqs[cfg.nuris] = strdup(buf)) == NULL)
+        return -1;
+    cfg.lens[cfg.nuris] = len;
+    cfg.cum[cfg.nuris] = weight + (cfg.nuris ? cfg.cum[cfg.nuris - 1] : 0);
+    cfg.nuris++;
+    return 0;
+}
+
+/* a mix file has a weight and a uri per line; # starts a comment */
+static int read_mix(const char *path, const char *host, const char *port)
+{
+    FILE *f;
+    char line[MAX_REQ], uri[MAX_REQ];
+    unsigned weight;
+    int lineno = 0;
+
+    if ((f = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof line, f))
+    {
+        lineno++;
+        if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (sscanf(line, "%u %1023s", &weight, uri) != 2 ||
+            add_uri(uri, weight, host, port) < 0)
+        {
+            fprintf(stderr, "%s:%d: expected <weight> <uri>\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* the histogram bucket of a latency in ns: values below H_SUB have one each,
+ * every power of two above is split into H_SUB buckets */
+static int bucket_of(uint64_t v)
+{
+    int e;
+
+    if (v < H_SUB)
+        return v;
+    e = 63 - __builtin_clzll(v);
+    if ((e - H_SUB_BITS + 1) * H_SUB >= H_BUCKETS)
+        return H_BUCKETS - 1;
+    return (e - H_SUB_BITS + 1) * H_SUB + ((v >> (e - H_SUB_BITS)) & (H_SUB - 1));
+}
+
+/* the largest value that falls in bucket b */
+static uint64_t bucket_top(int b)
+{
+    int e = b / H_SUB + H_SUB_BITS - 1;
+
+    if (b < H_SUB)
+        return b;
+    return ((uint64_t)(H_SUB + b % H_SUB + 1) << (e - H_SUB_BITS)) - 1;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage_exit()
+{
+    fprintf(stderr,
+            "Usage: ./lisoload [-c conns] [-t threads] [-p depth] [-d secs] \n"
+            "                  [-w secs] [-r rate] [-u uri]... [-f mix file] \n"
+            "                  <host> <port> \n"
+            "    -c conns   - keep-alive connections (default 100) \n"
+            "    -t threads - threads sharing the connections (default 1) \n"
+            "    -p depth   - requests in flight per connection (default 1, \n"
+            "                 max %d) \n"
+            "    -d secs    - length of the measured run (default 5) \n"
+            "    -w secs    - warmup before it, not measured (default 0) \n"
+            "    -r rate    - open loop at rate requests per second, timed \n"
+            "                 from when they are due; closed loop without \n"
+            "    -u uri     - a uri to request, may be repeated \n"
+            "    -f file    - a mix of uris, '<weight> <uri>' per line \n",
+            MAX_DEPTH);
+    exit(EXIT_FAILURE);
+}
@@ -1,11 +1,60 @@
 /*
  * log.c
  *
- * Description: This file defines routines to record logs for Liso server
+ * Description: This file defines routines to record logs for Liso server.
+ *              Log() never makes a system call: every thread formats its
+ *              lines into a ring of its own, and a background thread writes
+ *              the rings to the log file every LOG_FLUSH_MS. A ring has one
+ *              writer (its thread) and one reader (the flusher), so it needs
+ *              no lock. A line that does not fit in a full ring is dropped
+ *              and counted rather than waited for.
  *
  */
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 #include "log.h"
 
+/* the log lines of one thread, in buf[tail % LOG_RING .. head % LOG_RING) */
+typedef struct lring
+{
+    atomic_size_t head;         // bytes ever written, by the thread
+    atomic_size_t tail;         // bytes ever flushed, by the flusher
+    atomic_ulong  dropped;      // lines that found the ring full
+    struct lring *next;         // all rings, newest first
+    char buf[LOG_RING];
+} lring_t;
+
+static struct
+{
+    FILE *file;
+    int   fd;
+    pthread_mutex_t lock;       // guards the list of rings
+    lring_t *rings;
+    pthread_t flusher;
+    atomic_int running;
+    pid_t pid;                  // process the flusher runs in
+    unsigned long reported;     // drops written to the log so far
+} lg;
+
+static __thread lring_t *RING;          // ring of this thread
+static __thread time_t STAMP_SEC = -1;  // second STAMP was made for
+static __thread char STAMP[32];
+static __thread int  STAMP_LEN;
+
+static void stamp();
+static lring_t *ring_new();
+static void ring_put(lring_t *r, const char *line, size_t len);
+static void ring_drain(lring_t *r);
+static void drain_all();
+static int  start_flusher();
+static void *flush_thread(void *arg);
+
 FILE *log_open(const char *path)
 {
     FILE *logfile;
@@ -17,30 +66,258 @@ FILE *log_open(const char *path)
         exit(EXIT_FAILURE);
     }
 
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // the flusher writes whole batches of lines, nothing goes through stdio
+    lg.file = logfile;
+    lg.fd = fileno(logfile);
+    pthread_mutex_init(&lg.lock, NULL);
+    if (start_flusher() < 0)
+    {
+        fprintf(stdout, "Error starting the log flusher. \n");
+        exit(EXIT_FAILURE);
+    }
+    atexit(log_close);
 
     return logfile;
 }
 
-void Log(const char *format, ...)
+/******************************************************************************
+* subroutine: log_fork                                                        *
+* purpose:    restart logging in a child process. The flusher did not survive *
+*             the fork; what the rings held is the parent's to write, so the  *
+*             child starts with them empty, and with only its own ring        *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void log_fork()
+{
+    lring_t *r, *next;
+
+    pthread_mutex_init(&lg.lock, NULL);
+    for (r = lg.rings; r; r = next)
+    {
+        next = r->next;
+        if (r != RING)
+            free(r);
+    }
+    lg.rings = RING;
+    if (RING)
+    {
+        RING->next = NULL;
+        atomic_store(&RING->tail, atomic_load(&RING->head));
+        atomic_store(&RING->dropped, 0);
+    }
+    lg.reported = 0;
+
+    if (start_flusher() < 0)
+        lg.running = 0;
+}
+
+/******************************************************************************
+* subroutine: log_close                                                       *
+* purpose:    stop the flusher, write what is left and close the log file.    *
+*             Runs at exit; does nothing a second time or in a child process  *
+*             that never called log_fork()                                    *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void log_close()
 {
-    time_t ltime;
-    struct tm *Tm;
+    if (!atomic_load(&lg.running) || lg.pid != getpid())
+        return;
+    atomic_store(&lg.running, 0);
+    pthread_join(lg.flusher, NULL);
+    drain_all();
+    fclose(lg.file);
+}
 
-    ltime = time(NULL);
-    Tm = localtime(&ltime);
+/* lines dropped on full rings in this process */
+unsigned long log_dropped()
+{
+    unsigned long n = 0;
+    lring_t *r;
 
-    fprintf(STATE.log, "[%04d%02d%02d %02d:%02d:%02d] ",
-                 Tm->tm_year+1900,
-                 Tm->tm_mon+1,
-                 Tm->tm_mday,
-                 Tm->tm_hour,
-                 Tm->tm_min,
-                 Tm->tm_sec
-           );
+    pthread_mutex_lock(&lg.lock);
+    for (r = lg.rings; r; r = r->next)
+        n += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    pthread_mutex_unlock(&lg.lock);
+    return n;
+}
 
+void Log(const char *format, ...)
+{
+    char line[LOG_LINE];
     va_list ap;
+    int n;
+
+    if (RING == NULL && (RING = ring_new()) == NULL)
+        return;
+
+    stamp();
+    memcpy(line, STAMP, STAMP_LEN);
+
     va_start(ap, format);
-    vfprintf(STATE.log, format, ap);
+    n = vsnprintf(line + STAMP_LEN, sizeof line - STAMP_LEN, format, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    // a longer line is cut, but still ends the line
+    n += STAMP_LEN;
+    if (n >= (int)sizeof line)
+    {
+        n = sizeof line - 1;
+        line[n - 1] = '\n';
+    }
+    ring_put(RING, line, n);
+}
+
+/* bring STAMP up to date; the time is formatted once a second */
+static void stamp()
+{
+    time_t ltime = time(NULL);
+    struct tm Tm;
+
+    if (ltime == STAMP_SEC)
+        return;
+    localtime_r(&ltime, &Tm);
+    STAMP_LEN = snprintf(STAMP, sizeof STAMP,
+                         "[%04d%02d%02d %02d:%02d:%02d] ",
+                         Tm.tm_year+1900,
+                         Tm.tm_mon+1,
+                         Tm.tm_mday,
+                         Tm.tm_hour,
+                         Tm.tm_min,
+                         Tm.tm_sec);
+    STAMP_SEC = ltime;
+}
+
+/* a ring for the calling thread, on the flusher's list */
+static lring_t *ring_new()
+{
+    lring_t *r;
+
+    if ((r = malloc(sizeof(lring_t))) == NULL)
+        return NULL;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->dropped, 0);
+
+    pthread_mutex_lock(&lg.lock);
+    r->next = lg.rings;
+    lg.rings = r;
+    pthread_mutex_unlock(&lg.lock);
+    return r;
+}
+
+/* append a line to the ring, or count it as dropped if it is full */
+static void ring_put(lring_t *r, const char *line, size_t len)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t off = head % LOG_RING, first;
+
+    if (LOG_RING - (head - tail) < len)
+    {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    first = len < LOG_RING - off ? len : LOG_RING - off;
+    memcpy(r->buf + off, line, first);
+    memcpy(r->buf, line + first, len - first);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+}
+
+/* write out what the ring holds, from tail up to the end of buf first */
+static void ring_drain(lring_t *r)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t off, first;
+    struct iovec iov[2];
+    int cnt;
+    ssize_t n;
+
+    while (tail < head)
+    {
+        off = tail % LOG_RING;
+        first = head - tail < LOG_RING - off ? head - tail : LOG_RING - off;
+        iov[0].iov_base = r->buf + off;
+        iov[0].iov_len = first;
+        iov[1].iov_base = r->buf;
+        iov[1].iov_len = head - tail - first;
+        cnt = iov[1].iov_len ? 2 : 1;
+
+        if ((n = writev(lg.fd, iov, cnt)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // nothing to report it to; the lines are lost
+            n = head - tail;
+        }
+        tail += n;
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+}
+
+/* drain every ring, then note the lines dropped since the last time */
+static void drain_all()
+{
+    unsigned long dropped = 0;
+    char line[MIN_LINE * 2];
+    lring_t *r;
+    int n;
+
+    pthread_mutex_lock(&lg.lock);
+    for (r = lg.rings; r; r = r->next)
+    {
+        ring_drain(r);
+        dropped += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lg.lock);
+
+    if (dropped > lg.reported)
+    {
+        stamp();
+        n = snprintf(line, sizeof line, "%s"
+                     "Error: %lu log lines dropped on full rings \n",
+                     STAMP, dropped - lg.reported);
+        if (write(lg.fd, line, n) < 0)
+            return;
+        lg.reported = dropped;
+    }
+}
+
+static int start_flusher()
+{
+    sigset_t all, old;
+    int ret;
+
+    lg.pid = getpid();
+    atomic_store(&lg.running, 1);
+
+    // signals are for the event loop thread, the flusher never sees them
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&lg.flusher, NULL, flush_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0)
+    {
+        atomic_store(&lg.running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static void *flush_thread(void *arg)
+{
+    struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+    while (atomic_load(&lg.running))
+    {
+        drain_all();
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
 }
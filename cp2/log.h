@@ -5,7 +5,25 @@
 #include <stdarg.h>
 #include "params.h"
 
+/* log levels. Log() always records; LogInfo() and LogDebug() compile to
+ * nothing below LOG_LEVEL, which the Makefile sets */
+#define LL_DEBUG 0
+#define LL_INFO  1
+#define LL_ERROR 2
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LL_INFO
+#endif
+
+#define LogInfo(...) \
+    do { if (LOG_LEVEL <= LL_INFO) Log(__VA_ARGS__); } while (0)
+#define LogDebug(...) \
+    do { if (LOG_LEVEL <= LL_DEBUG) Log(__VA_ARGS__); } while (0)
+
 FILE *log_open(const char *path);
-void Log(const char *format, ...);
+void log_fork();
+void log_close();
+unsigned long log_dropped();
+void Log(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
 #endif
@@ -0,0 +1,246 @@
+/*******************************************************************************
+* logdump.c                                                                    *
+*                                                                              *
+* Description: This file contains lisod-logdump, which reads the binary access *
+*              logs lisod writes with --access-log and prints their records   *
+*              as text (the default) or CSV, or, with -s, a summary: requests *
+*              and bytes per second, the requests per method and status, and  *
+*              the latency percentiles. Several files (one per worker) are    *
+*              read as one log.                                                *
+*                                                                              *
+* Usage:       ./lisod-logdump [-c | -s] <access log>...                       *
+* example:     ./lisod-logdump -s access.log.0 access.log.1                    *
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "alog.h"
+
+enum { OUT_TEXT, OUT_CSV, OUT_SUMMARY };
+
+static const char *METHODS[] = { "OTHER", "GET", "HEAD", "POST" };
+
+/* what the summary is made of */
+static struct
+{
+    unsigned long requests;
+    unsigned long bytes;
+    uint64_t first, last;       // earliest and latest request start
+    unsigned long methods[4];
+    unsigned long status[600];  // 0 for no response
+    unsigned long head_sum;     // over the requests whose head was parsed
+    unsigned long heads;
+    uint32_t *total;            // total_us of every request
+    size_t   ntotal, cap;
+} sum;
+
+static int  dump_file(const char *path, int out);
+static void print_text(const alog_rec_t *r);
+static void print_csv(const alog_rec_t *r);
+static void add_summary(const alog_rec_t *r);
+static void print_summary();
+static const char *addr_str(const uint8_t *addr, char *buf);
+static int  cmp_u32(const void *a, const void *b);
+static void usage_exit();
+
+int main(int argc, char *argv[])
+{
+    int opt, i, out = OUT_TEXT, ret = EXIT_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "cs")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': out = OUT_CSV; break;
+        case 's': out = OUT_SUMMARY; break;
+        default:  usage_exit();
+        }
+    }
+    if (optind == argc)
+        usage_exit();
+
+    if (out == OUT_CSV)
+        printf("start_us,client,method,uri,status,bytes,head_us,total_us,secure\n");
+    for (i = optind; i < argc; i++)
+        if (dump_file(argv[i], out) < 0)
+            ret = EXIT_FAILURE;
+    if (out == OUT_SUMMARY)
+        print_summary();
+    return ret;
+}
+
+/* print (or sum up) the records of one access log */
+static int dump_file(const char *path, int out)
+{
+    FILE *f;
+    alog_hdr_t hdr;
+    alog_rec_t rec;
+
+    if ((f = fopen(path, "rb")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    if (fread(&hdr, sizeof hdr, 1, f) != 1 ||
+        memcmp(hdr.magic, ALOG_MAGIC, sizeof hdr.magic) != 0)
+    {
+        fprintf(stderr, "%s: not an access log\n", path);
+        fclose(f);
+        return -1;
+    }
+    if (hdr.version != ALOG_VERSION || hdr.rec_size != sizeof rec)
+    {
+        fprintf(stderr, "%s: access log version %u, record size %u not "
+                "supported\n", path, hdr.version, hdr.rec_size);
+        fclose(f);
+        return -1;
+    }
+
+    while (fread(&rec, sizeof rec, 1, f) == 1)
+    {
+        // the unused end of a mapped log of a server that did not stop
+        if (rec.start == 0)
+            continue;
+        if (out == OUT_TEXT)
+            print_text(&rec);
+        else if (out == OUT_CSV)
+            print_csv(&rec);
+        else
+            add_summary(&rec);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* date client method uri status bytes head total */
+static void print_text(const alog_rec_t *r)
+{
+    char date[32], addr[INET6_ADDRSTRLEN];
+    time_t sec = r->start / 1000000;
+    struct tm tm;
+
+    localtime_r(&sec, &tm);
+    strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06u %s %s %.*s%s %u %llu head=%uus total=%uus%s\n",
+           date, (unsigned)(r->start % 1000000), addr_str(r->addr, addr),
+           METHODS[r->method < 4 ? r->method : 0],
+           r->uri_len, r->uri, r->flags & ALOG_CUT ? "..." : "",
+           r->status, (unsigned long long)r->bytes, r->head_us, r->total_us,
+           r->flags & ALOG_SECURE ? " https" : "");
+}
+
+/* one CSV row, the uri quoted */
+static void print_csv(const alog_rec_t *r)
+{
+    char addr[INET6_ADDRSTRLEN];
+    int i;
+
+    printf("%llu,%s,%s,\"", (unsigned long long)r->start,
+           addr_str(r->addr, addr), METHODS[r->method < 4 ? r->method : 0]);
+    for (i = 0; i < r->uri_len; i++)
+    {
+        if (r->uri[i] == '"')
+            putchar('"');
+        putchar(r->uri[i]);
+    }
+    printf("\",%u,%llu,%u,%u,%d\n", r->status, (unsigned long long)r->bytes,
+           r->head_us, r->total_us, r->flags & ALOG_SECURE ? 1 : 0);
+}
+
+static void add_summary(const alog_rec_t *r)
+{
+    if (sum.requests == 0 || r->start < sum.first)
+        sum.first = r->start;
+    if (r->start > sum.last)
+        sum.last = r->start;
+    sum.requests++;
+    sum.bytes += r->bytes;
+    sum.methods[r->method < 4 ? r->method : 0]++;
+    sum.status[r->status < 600 ? r->status : 0]++;
+    if (r->head_us)
+    {
+        sum.head_sum += r->head_us;
+        sum.heads++;
+    }
+
+    if (sum.ntotal == sum.cap)
+    {
+        sum.cap = sum.cap ? 2 * sum.cap : 4096;
+        if ((sum.total = realloc(sum.total, sum.cap * sizeof(uint32_t))) == NULL)
+        {
+            fprintf(stderr, "lisod-logdump: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sum.total[sum.ntotal++] = r->total_us;
+}
+
+static void print_summary()
+{
+    double span, mean = 0;
+    size_t i;
+
+    if (sum.requests == 0)
+    {
+        printf("requests:   0\n");
+        return;
+    }
+    span = (sum.last - sum.first) / 1e6;
+
+    printf("requests:   %lu in %.3f s", sum.requests, span);
+    if (span > 0)
+        printf(" (%.1f req/s, %.1f KB/s)", sum.requests / span,
+               sum.bytes / span / 1024);
+    printf("\nbytes:      %lu\n", sum.bytes);
+
+    printf("methods:   ");
+    for (i = 0; i < 4; i++)
+        if (sum.methods[i])
+            printf(" %s %lu", METHODS[i], sum.methods[i]);
+    printf("\nstatus:    ");
+    for (i = 0; i < 600; i++)
+        if (sum.status[i])
+            printf(" %zu %lu", i, sum.status[i]);
+    printf("\n");
+
+    qsort(sum.total, sum.ntotal, sizeof(uint32_t), cmp_u32);
+    for (i = 0; i < sum.ntotal; i++)
+        mean += sum.total[i];
+    mean /= sum.ntotal;
+    printf("head (us):  mean %.1f\n",
+           sum.heads ? (double)sum.head_sum / sum.heads : 0.0);
+    printf("total (us): mean %.1f, p50 %u, p90 %u, p99 %u, max %u\n", mean,
+           sum.total[sum.ntotal / 2], sum.total[sum.ntotal * 90 / 100],
+           sum.total[sum.ntotal * 99 / 100], sum.total[sum.ntotal - 1]);
+}
+
+/* the address as text, IPv4 for a mapped one */
+static const char *addr_str(const uint8_t *addr, char *buf)
+{
+    static const uint8_t mapped[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+
+    if (memcmp(addr, mapped, sizeof mapped) == 0)
+        return inet_ntop(AF_INET, addr + 12, buf, INET6_ADDRSTRLEN);
+    return inet_ntop(AF_INET6, addr, buf, INET6_ADDRSTRLEN);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage_exit()
+{
+    fprintf(stderr,
+            "Usage: lisod-logdump [-c | -s] <access log>... \n"
+            "    -c - print the records as CSV \n"
+            "    -s - print a summary instead of the records \n");
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,224 @@
+/*
+ * metrics.c
+ *
+ * Description: This file defines the internal metrics of Liso server:
+ *              counters and latency histograms of the request phases. Every
+ *              thread that records has a block of its own, so recording is
+ *              a plain load and store with no lock and no shared cache line;
+ *              the blocks are only summed up when the metrics are read, by
+ *              the /server-status page. Metrics are per worker process.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "metrics.h"
+
+/* what one thread recorded */
+typedef struct mblock
+{
+    atomic_ulong hist[M_NPHASES][M_BUCKETS];
+    atomic_ulong sum[M_NPHASES];        // of the values, for the mean
+    atomic_ulong counters[C_NCOUNTERS];
+    struct mblock *next;                // all blocks, newest first
+} mblock_t;
+
+static const char *PHASES[M_NPHASES][2] = {
+    { "first_byte", "accept to the first byte of the first request" },
+    { "parse",      "first byte of a request to its head parsed" },
+    { "lookup",     "file lookup, opening it on a miss" },
+    { "send",       "response queued to the output queue drained" },
+    { "total",      "first byte of a request to its response sent" },
+    { "handshake",  "accept to the TLS handshake done" },
+};
+
+static const char *COUNTERS[C_NCOUNTERS][2] = {
+    { "accepts_total",    "connections accepted" },
+    { "closes_total",     "connections closed" },
+    { "requests_total",   "requests answered" },
+    { "bytes_total",      "response bytes queued" },
+    { "status_1xx_total", "responses with a 1xx status" },
+    { "status_2xx_total", "responses with a 2xx status" },
+    { "status_3xx_total", "responses with a 3xx status" },
+    { "status_4xx_total", "responses with a 4xx status" },
+    { "status_5xx_total", "responses with a 5xx status" },
+    { "tls_handshakes_total", "TLS handshakes completed" },
+    { "tls_resumed_total",    "TLS handshakes that resumed a session" },
+    { "tls_failures_total",   "TLS handshakes that failed" },
+    { "tls_ktls_tx_total",    "TLS connections sending through kernel TLS" },
+    { "tls_ktls_rx_total",    "TLS connections receiving through kernel TLS" },
+    { "tls_offloaded_total",  "TLS handshake steps run on the crypto pool" },
+};
+
+static pthread_mutex_t LOCK = PTHREAD_MUTEX_INITIALIZER;   // guards BLOCKS
+static mblock_t *BLOCKS;
+static __thread mblock_t *MB;           // block of this thread
+
+static mblock_t *block();
+static int  bucket_of(uint64_t v);
+static uint64_t bucket_top(int b);
+static void bump(atomic_ulong *x, unsigned long n);
+
+/* record a phase that took us microseconds */
+void metrics_time(int phase, uint64_t us)
+{
+    mblock_t *mb = block();
+
+    if (mb == NULL)
+        return;
+    bump(&mb->hist[phase][bucket_of(us)], 1);
+    bump(&mb->sum[phase], us);
+}
+
+void metrics_count(int counter, uint64_t n)
+{
+    mblock_t *mb = block();
+
+    if (mb)
+        bump(&mb->counters[counter], n);
+}
+
+/******************************************************************************
+* subroutine: metrics_render                                                  *
+* purpose:    write the metrics of all threads, summed up, as a text page or  *
+*             in the Prometheus text format                                   *
+* parameters: f          - where to write                                     *
+*             prometheus - 1 for the Prometheus format                        *
+*             gauges     - values of the caller to add, ngauges of them       *
+* return:     0 on success, -1 on a write error                               *
+******************************************************************************/
+int metrics_render(FILE *f, int prometheus, const mgauge_t *gauges, int ngauges)
+{
+    static unsigned long hist[M_NPHASES][M_BUCKETS];
+    unsigned long sum[M_NPHASES], counters[C_NCOUNTERS];
+    unsigned long n, seen, pct[4];
+    static const double PCT[4] = { 0.5, 0.9, 0.99, 0.999 };
+    mblock_t *mb;
+    int i, b, k;
+
+    memset(hist, 0, sizeof hist);
+    memset(sum, 0, sizeof sum);
+    memset(counters, 0, sizeof counters);
+    pthread_mutex_lock(&LOCK);
+    for (mb = BLOCKS; mb; mb = mb->next)
+    {
+        for (i = 0; i < M_NPHASES; i++)
+        {
+            for (b = 0; b < M_BUCKETS; b++)
+                hist[i][b] += atomic_load_explicit(&mb->hist[i][b],
+                                                   memory_order_relaxed);
+            sum[i] += atomic_load_explicit(&mb->sum[i], memory_order_relaxed);
+        }
+        for (i = 0; i < C_NCOUNTERS; i++)
+            counters[i] += atomic_load_explicit(&mb->counters[i],
+                                                memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&LOCK);
+
+    if (prometheus)
+    {
+        for (i = 0; i < C_NCOUNTERS; i++)
+            fprintf(f, "# HELP lisod_%s %s\n# TYPE lisod_%s counter\n"
+                    "lisod_%s %lu\n", COUNTERS[i][0], COUNTERS[i][1],
+                    COUNTERS[i][0], COUNTERS[i][0], counters[i]);
+        for (i = 0; i < ngauges; i++)
+            fprintf(f, "# HELP lisod_%s %s\n# TYPE lisod_%s gauge\n"
+                    "lisod_%s %g\n", gauges[i].name, gauges[i].help,
+                    gauges[i].name, gauges[i].name, gauges[i].value);
+
+        // cumulative buckets; only the ones a value fell in are listed
+        for (i = 0; i < M_NPHASES; i++)
+        {
+            fprintf(f, "# HELP lisod_%s_seconds %s\n"
+                    "# TYPE lisod_%s_seconds histogram\n",
+                    PHASES[i][0], PHASES[i][1], PHASES[i][0]);
+            for (b = 0, n = 0; b < M_BUCKETS; b++)
+            {
+                if (hist[i][b] == 0)
+                    continue;
+                n += hist[i][b];
+                fprintf(f, "lisod_%s_seconds_bucket{le=\"%g\"} %lu\n",
+                        PHASES[i][0], bucket_top(b) / 1e6, n);
+            }
+            fprintf(f, "lisod_%s_seconds_bucket{le=\"+Inf\"} %lu\n"
+                    "lisod_%s_seconds_sum %g\n"
+                    "lisod_%s_seconds_count %lu\n",
+                    PHASES[i][0], n, PHASES[i][0], sum[i] / 1e6,
+                    PHASES[i][0], n);
+        }
+        return ferror(f) ? -1 : 0;
+    }
+
+    for (i = 0; i < C_NCOUNTERS; i++)
+        fprintf(f, "%-20s %lu\n", COUNTERS[i][0], counters[i]);
+    for (i = 0; i < ngauges; i++)
+        fprintf(f, "%-20s %g\n", gauges[i].name, gauges[i].value);
+
+    // percentiles are the top of the bucket they fall in
+    fprintf(f, "\n%-12s %10s %10s %10s %10s %10s %10s\n", "phase (us)",
+            "count", "mean", "p50", "p90", "p99", "p99.9");
+    for (i = 0; i < M_NPHASES; i++)
+    {
+        for (b = 0, n = 0; b < M_BUCKETS; b++)
+            n += hist[i][b];
+        memset(pct, 0, sizeof pct);
+        for (b = 0, k = 0, seen = 0; b < M_BUCKETS && k < 4 && n; b++)
+        {
+            seen += hist[i][b];
+            while (k < 4 && seen >= PCT[k] * n)
+                pct[k++] = bucket_top(b);
+        }
+        fprintf(f, "%-12s %10lu %10.1f %10lu %10lu %10lu %10lu\n",
+                PHASES[i][0], n, n ? (double)sum[i] / n : 0.0,
+                pct[0], pct[1], pct[2], pct[3]);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+/* the block of the calling thread, made on its first record */
+static mblock_t *block()
+{
+    mblock_t *mb;
+
+    if (MB)
+        return MB;
+    if ((mb = calloc(1, sizeof(mblock_t))) == NULL)
+        return NULL;
+    pthread_mutex_lock(&LOCK);
+    mb->next = BLOCKS;
+    BLOCKS = mb;
+    pthread_mutex_unlock(&LOCK);
+    return MB = mb;
+}
+
+/* the bucket of a value, see M_SUB */
+static int bucket_of(uint64_t v)
+{
+    int e;
+
+    if (v < M_SUB)
+        return v;
+    if (v >> 32)
+        return M_BUCKETS - 1;
+    e = 63 - __builtin_clzll(v);            // 3 and up
+    return (e - 2) * M_SUB + ((v >> (e - 3)) & (M_SUB - 1));
+}
+
+/* the largest value that falls in bucket b */
+static uint64_t bucket_top(int b)
+{
+    int e = b / M_SUB + 2;
+
+    if (b < M_SUB)
+        return b;
+    return ((uint64_t)(M_SUB + b % M_SUB + 1) << (e - 3)) - 1;
+}
+
+/* only the owning thread writes a block, so a plain add is enough; the
+ * atomics keep a concurrent reader from seeing torn values */
+static void bump(atomic_ulong *x, unsigned long n)
+{
+    atomic_store_explicit(x, atomic_load_explicit(x, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
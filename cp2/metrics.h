@@ -0,0 +1,42 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* request phases timed in microseconds, each into a histogram */
+enum { M_FIRST_BYTE,            // connection accepted to its first request
+       M_PARSE,                 // first byte of a request to its head parsed
+       M_LOOKUP,                // file looked up (or opened) for a request
+       M_SEND,                  // response queued to the queue drained
+       M_TOTAL,                 // first byte to response sent
+       M_HANDSHAKE,             // connection accepted to its TLS handshake
+                                // done
+       M_NPHASES };
+
+/* counters */
+enum { C_ACCEPTS, C_CLOSES, C_REQUESTS, C_BYTES,
+       C_STATUS_1XX, C_STATUS_2XX, C_STATUS_3XX, C_STATUS_4XX, C_STATUS_5XX,
+       C_TLS_HANDSHAKES, C_TLS_RESUMED, C_TLS_FAILURES, C_TLS_KTLS_TX,
+       C_TLS_KTLS_RX, C_TLS_OFFLOADED,
+       C_NCOUNTERS };
+
+/* histograms are log-linear, like HDR histograms: values below 8 have a
+ * bucket each, every power of two above is split into 8 buckets, so a
+ * value is off by at most 12.5% */
+#define M_SUB 8
+#define M_BUCKETS (M_SUB * 30)
+
+/* a value the caller has at hand when the metrics are read */
+typedef struct
+{
+    const char *name;           // Prometheus name, lisod_ is prepended
+    const char *help;
+    double value;
+} mgauge_t;
+
+void metrics_time(int phase, uint64_t us);
+void metrics_count(int counter, uint64_t n);
+int  metrics_render(FILE *f, int prometheus, const mgauge_t *gauges, int ngauges);
+
+#endif
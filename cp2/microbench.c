@@ -0,0 +1,550 @@
+/*
+ * microbench.c
+ *
+ * Description: This file contains microbenchmarks of the routines lisod runs
+ *              for every request, linked straight from lisod.c (its main()
+ *              is renamed by the Makefile): reading a request with
+ *              rio_fill(), parse_requestline(), parse_requestheaders(),
+ *              parse_uri(), get_filetype(), the response heads of
+ *              serve_error() and serve_head(), and Log(). Each one runs over
+ *              a corpus of requests, built in or recorded (-f: raw requests
+ *              one after the other, as read off a connection), on one core.
+ *
+ *              The results are one JSON object per line on stdout: ns/op,
+ *              and the heap allocations and bytes per op, counted by the
+ *              malloc() below. Given the output of an earlier run (-b), the
+ *              change of every benchmark against it goes to stderr.
+ *
+ * Usage:       ./microbench [-t ms] [-f corpus] [-b baseline] [benchmark]...
+ * example:     ./microbench > before.json; (change, make)
+ *              ./microbench -b before.json > after.json
+ *
+ */
+#include "lisod.h"
+#include <time.h>
+
+#define MAX_SAMPLES 1024
+#define MAX_CORPUS  (1 << 20)
+
+/* one request of the corpus; the head is in a buffer of its own, like a
+ * connection's read buffer */
+typedef struct
+{
+    char  *buf;
+    size_t len;                 // of the head
+    scan_t scan;                // of buf
+    char   filename[MAX_PATH];  // what parse_uri() makes of the uri
+    int    is_static;
+} sample_t;
+
+/* a benchmark: op(i) is timed on sample i % the number of samples. prep, if
+ * any, runs untimed before each round of n ops, at most batch of them */
+typedef struct
+{
+    const char *name;
+    void (*op)(long i);
+    void (*prep)(long i, long n);
+    long batch;
+} bench_t;
+
+typedef struct
+{
+    char   name[MIN_LINE];
+    long   ops;
+    double ns;                  // per op
+    double allocs;              // per op
+    double bytes;               // per op
+} result_t;
+
+/* built-in corpus: a bare request, a browser's, one for a stylesheet, a POST
+ * with long cookies */
+static const char *BUILTIN[] =
+{
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "\r\n",
+
+    "GET /images/liso_header.png HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://www.example.com:8080/index.html\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n",
+
+    "GET /style.css HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "\r\n",
+
+    "POST /cgi-bin/form?id=42 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Cookie: session=8a7f6e5d4c3b2a1908f7e6d5c4b3a291; theme=dark; "
+    "tracking=0123456789abcdef0123456789abcdef0123456789abcdef\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 27\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+};
+
+static sample_t SAMPLES[MAX_SAMPLES];
+static int  NSAMPLES;
+static int  STATIC[MAX_SAMPLES];        // samples of static files
+static int  NSTATIC;
+static client_t C;                      // the connection ops run on
+static int  SV[2];                      // rio_fill: the socket pair
+static char RBUF[MAX_LINE];             // rio_fill: read buffer
+
+/* heap use of this thread, see malloc() below */
+static __thread unsigned long NALLOCS, NBYTES;
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t n);
+extern void  __libc_free(void *ptr);
+
+static void op_rio_fill(long i);
+static void prep_rio_fill(long i, long n);
+static void op_parse_requestline(long i);
+static void op_parse_requestheaders(long i);
+static void op_parse_uri(long i);
+static void op_get_filetype(long i);
+static void op_serve_error(long i);
+static void op_serve_head(long i);
+static void op_log(long i);
+
+static const bench_t BENCHES[] =
+{
+    { "rio_fill",             op_rio_fill, prep_rio_fill, 2048 },
+    { "parse_requestline",    op_parse_requestline },
+    { "parse_requestheaders", op_parse_requestheaders },
+    { "parse_uri",            op_parse_uri },
+    { "get_filetype",         op_get_filetype },
+    { "serve_error",          op_serve_error },
+    { "serve_head",           op_serve_head },
+    { "Log",                  op_log },
+};
+
+#define NBENCHES (int)(sizeof BENCHES / sizeof BENCHES[0])
+
+static int  add_sample(const char *req, size_t len);
+static int  read_corpus(const char *path);
+static void setup();
+static void run(const bench_t *b, long min_ns, result_t *r);
+static void compare(const char *path, result_t *res, int n);
+static uint64_t now_ns();
+static void usage();
+
+int main(int argc, char *argv[])
+{
+    const char *corpus = NULL, *baseline = NULL;
+    result_t res[NBENCHES];
+    long min_ms = 200;
+    int opt, i, j, n = 0;
+
+    while ((opt = getopt(argc, argv, "t:f:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': min_ms = atol(optarg); break;
+        case 'f': corpus = optarg; break;
+        case 'b': baseline = optarg; break;
+        default:  usage();
+        }
+    }
+    if (min_ms <= 0)
+        usage();
+
+    scan_init(SCAN_AUTO);
+    setup();
+    if (corpus && read_corpus(corpus) < 0)
+        return EXIT_FAILURE;
+    for (i = 0; !corpus && i < (int)(sizeof BUILTIN / sizeof BUILTIN[0]); i++)
+        add_sample(BUILTIN[i], strlen(BUILTIN[i]));
+    if (NSAMPLES == 0 || NSTATIC == 0)
+    {
+        fprintf(stderr, "microbench: the corpus needs a request for a static "
+                "file in www\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < NBENCHES; i++)
+    {
+        // only the benchmarks named, if any
+        for (j = optind; j < argc && strcmp(argv[j], BENCHES[i].name); j++)
+            ;
+        if (optind < argc && j == argc)
+            continue;
+        run(&BENCHES[i], min_ms * 1000000, &res[n]);
+        printf("{\"bench\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.2f,"
+               "\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}\n", res[n].name,
+               res[n].ops, res[n].ns, res[n].allocs, res[n].bytes);
+        fflush(stdout);
+        n++;
+    }
+
+    if (baseline)
+        compare(baseline, res, n);
+    return EXIT_SUCCESS;
+}
+
+/* the heap calls of the whole program come here (and go on to glibc), so
+ * the ones a routine makes are counted whoever makes them */
+void *malloc(size_t n)
+{
+    NALLOCS++;
+    NBYTES += n;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    NALLOCS++;
+    NBYTES += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t n)
+{
+    NALLOCS++;
+    NBYTES += n;
+    return __libc_realloc(ptr, n);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+/******************************************************************************
+* subroutine: setup                                                           *
+* purpose:    set the server up as a worker with no I/O pool, and a           *
+*             connection the ops run on                                       *
+* parameters: none                                                            *
+* return:     none, exits on failure                                          *
+******************************************************************************/
+static void setup()
+{
+    int size = 4 << 20;
+
+    strcpy(STATE.www_path, "www");
+    STATE.port = 8080;
+    STATE.s_port = 4443;
+    STATE.max_requests = MAX_REQUESTS;
+    STATE.io_threads = 0;
+    STATE.use_uring = 0;
+    STATE.log = log_open("/dev/null");
+    bufpool_init(BUF_BYTES);
+    if (fcache_init(FCACHE_ENTRIES, FCACHE_REVALIDATE) < 0 ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, SV) < 0 ||
+        set_nonblocking(SV[0]) < 0)
+    {
+        perror("microbench: setup");
+        exit(EXIT_FAILURE);
+    }
+    // rio_fill rounds write a batch of requests ahead
+    setsockopt(SV[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    setsockopt(SV[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+
+    C.type = EV_CLIENT;
+    C.fd = SV[0];
+    arena_init(&C.arena);
+    rio_readinitb(&C.rio, SV[0]);
+}
+
+/* add a request head to the corpus, with what the ops need of it */
+static int add_sample(const char *req, size_t len)
+{
+    sample_t *s;
+    HTTPContext context;
+
+    if (NSAMPLES == MAX_SAMPLES || len > MAX_LINE)
+        return -1;
+    s = &SAMPLES[NSAMPLES];
+    if ((s->buf = __libc_malloc(MAX_LINE)) == NULL)
+        return -1;
+    memcpy(s->buf, req, len);
+    if (scan_head(s->buf, len, &s->scan) != SCAN_DONE || s->scan.len != len)
+    {
+        __libc_free(s->buf);
+        return -1;
+    }
+    s->len = len;
+
+    memset(&context, 0, sizeof context);
+    context.uri = s->scan.uri;
+    if (parse_uri(&C, &context) < 0)
+        return -1;
+    snprintf(s->filename, sizeof s->filename, "%s", context.filename);
+    arena_reset(&C.arena);
+    s->is_static = context.is_static && access(s->filename, R_OK) == 0;
+    if (s->is_static)
+        STATIC[NSTATIC++] = NSAMPLES;
+    NSAMPLES++;
+    return 0;
+}
+
+/* a recorded corpus is raw requests back to back; the bodies are skipped */
+static int read_corpus(const char *path)
+{
+    static char buf[MAX_CORPUS];
+    static scan_t scan;
+    size_t len, off = 0;
+    long body;
+    FILE *f;
+    int i;
+
+    if ((f = fopen(path, "rb")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    len = fread(buf, 1, sizeof buf, f);
+    fclose(f);
+
+    while (off < len && NSAMPLES < MAX_SAMPLES)
+    {
+        if (scan_head(buf + off, len - off, &scan) != SCAN_DONE ||
+            add_sample(buf + off, scan.len) < 0)
+        {
+            fprintf(stderr, "%s: no request head at byte %zu\n", path, off);
+            return -1;
+        }
+        off += scan.len;
+        for (i = 0, body = 0; i < scan.nheaders; i++)
+            if (scan.headers[i].id == HDR_CONTENT_LENGTH)
+                body = slice_tol(scan.headers[i].value);
+        off += body > 0 ? body : 0;
+    }
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: run                                                             *
+* purpose:    time a benchmark in rounds of doubling length until they add up *
+*             to min_ns, after a warm-up round                                *
+* parameters: b      - the benchmark                                          *
+*             min_ns - how long to run it                                     *
+*             r      - where to put the result                                *
+* return:     none                                                            *
+******************************************************************************/
+static void run(const bench_t *b, long min_ns, result_t *r)
+{
+    unsigned long allocs = 0, bytes = 0, a0, b0;
+    long i, n = 0, round = 16, total = 0;
+    uint64_t t = 0, t0;
+
+    // caches, the file cache, the log ring are warm before timing starts
+    if (b->prep)
+        b->prep(0, round);
+    for (i = 0; i < round; i++)
+        b->op(i);
+
+    while ((long)t < min_ns)
+    {
+        if (b->batch && round > b->batch)
+            round = b->batch;
+        if (b->prep)
+            b->prep(n, round);
+
+        a0 = NALLOCS;
+        b0 = NBYTES;
+        t0 = now_ns();
+        for (i = n; i < n + round; i++)
+            b->op(i);
+        t += now_ns() - t0;
+        allocs += NALLOCS - a0;
+        bytes += NBYTES - b0;
+
+        n += round;
+        total += round;
+        round *= 2;
+    }
+
+    snprintf(r->name, sizeof r->name, "%s", b->name);
+    r->ops = total;
+    r->ns = (double)t / total;
+    r->allocs = (double)allocs / total;
+    r->bytes = (double)bytes / total;
+}
+
+/* print the change against an earlier run, matched by name */
+static void compare(const char *path, result_t *res, int n)
+{
+    char line[MAX_LINE], name[MIN_LINE];
+    double ns, allocs;
+    FILE *f;
+    int i;
+
+    if ((f = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        return;
+    }
+    fprintf(stderr, "%-22s %12s %12s %8s %10s %10s\n", "bench", "base ns/op",
+            "ns/op", "change", "base alloc", "allocs");
+    while (fgets(line, sizeof line, f))
+    {
+        if (sscanf(line, "{\"bench\":\"%63[^\"]\",\"ops\":%*d,\"ns_per_op\":%lf,"
+                   "\"allocs_per_op\":%lf", name, &ns, &allocs) != 3)
+            continue;
+        for (i = 0; i < n && strcmp(res[i].name, name); i++)
+            ;
+        if (i == n)
+            continue;
+        fprintf(stderr, "%-22s %12.2f %12.2f %+7.1f%% %10.3f %10.3f\n", name,
+                ns, res[i].ns, ns > 0 ? (res[i].ns - ns) / ns * 100 : 0.0,
+                allocs, res[i].allocs);
+    }
+    fclose(f);
+}
+
+/* write the next round's requests to the socket rio_fill reads */
+static void prep_rio_fill(long i, long n)
+{
+    sample_t *s;
+    long j;
+
+    for (j = i; j < i + n; j++)
+    {
+        s = &SAMPLES[j % NSAMPLES];
+        if (write(SV[1], s->buf, s->len) != (ssize_t)s->len)
+        {
+            perror("microbench: rio_fill");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* read one request; the buffer ends where it does */
+static void op_rio_fill(long i)
+{
+    C.rio.rio_buf = C.rio.rio_bufptr = RBUF;
+    C.rio.rio_cnt = 0;
+    C.rio.rio_size = SAMPLES[i % NSAMPLES].len;
+    if (rio_fill(&C.rio) != RIO_FULL)
+    {
+        fprintf(stderr, "microbench: rio_fill read a short request\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void op_parse_requestline(long i)
+{
+    static scan_t scan;
+    sample_t *s = &SAMPLES[i % NSAMPLES];
+    HTTPContext context;
+    int is_closed = 0;
+
+    C.rio.rio_buf = C.rio.rio_bufptr = s->buf;
+    C.rio.rio_cnt = s->len;
+    C.rio.rio_size = MAX_LINE;
+    memset(&context, 0, sizeof context);
+    if (parse_requestline(&C, &context, &scan, &is_closed) != PARSE_DONE)
+    {
+        fprintf(stderr, "microbench: sample %ld does not parse\n",
+                i % NSAMPLES);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* a POST without Content-Length is answered here, the answer is dropped */
+static void op_parse_requestheaders(long i)
+{
+    sample_t *s = &SAMPLES[i % NSAMPLES];
+    HTTPContext context;
+    int is_closed = 0;
+
+    memset(&context, 0, sizeof context);
+    context.method = s->scan.method;
+    parse_requestheaders(&C, &context, &s->scan, &is_closed);
+    arena_reset(&C.arena);
+    drop_queue(&C);
+}
+
+static void op_parse_uri(long i)
+{
+    HTTPContext context;
+
+    memset(&context, 0, sizeof context);
+    context.uri = SAMPLES[i % NSAMPLES].scan.uri;
+    parse_uri(&C, &context);
+    arena_reset(&C.arena);
+}
+
+static void op_get_filetype(long i)
+{
+    char type[MIN_LINE];
+
+    get_filetype(SAMPLES[STATIC[i % NSTATIC]].filename, type);
+    __asm__ __volatile__("" : : "r"(type) : "memory");
+}
+
+/* a 404 queued and dropped */
+static void op_serve_error(long i)
+{
+    serve_error(&C, "404", "Not Found", "Server couldn't find this file",
+                i & 1);
+    drop_queue(&C);
+}
+
+/* the head of a 200 for a file in the file cache, queued and dropped */
+static void op_serve_head(long i)
+{
+    HTTPContext context;
+    int is_closed = i & 1;
+
+    memset(&context, 0, sizeof context);
+    context.filename = SAMPLES[STATIC[i % NSTATIC]].filename;
+    if (serve_head(&C, &context, &is_closed) != 0)
+    {
+        fprintf(stderr, "microbench: %s cannot be served\n", context.filename);
+        exit(EXIT_FAILURE);
+    }
+    fcache_put(context.file);
+    drop_queue(&C);
+}
+
+/* the line parse_requestline() logs. Past what the flusher keeps up with
+ * lines are dropped, but only after they are formatted */
+static void op_log(long i)
+{
+    scan_t *scan = &SAMPLES[i % NSAMPLES].scan;
+
+    Log("Request: method=%.*s, uri=%.*s, version=%.*s \n",
+        (int)scan->method.len, scan->method.ptr,
+        (int)scan->uri.len, scan->uri.ptr,
+        (int)scan->version.len, scan->version.ptr);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage()
+{
+    int i;
+
+    fprintf(stderr,
+            "Usage: ./microbench [-t ms] [-f corpus] [-b baseline] [benchmark]... \n"
+            "    -t ms       - time each benchmark for at least ms (default 200) \n"
+            "    -f corpus   - recorded requests, back to back, instead of the \n"
+            "                  built-in ones \n"
+            "    -b baseline - the output of an earlier run to compare with \n"
+            "Benchmarks:");
+    for (i = 0; i < NBENCHES; i++)
+        fprintf(stderr, " %s", BENCHES[i].name);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
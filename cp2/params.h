@@ -7,6 +7,55 @@
 #define MIN_LINE 64
 #define MAX_NAME 256
 #define MAX_CONN 1024
+#define MAX_CLIENTS (1 << 20)
+#define CLIENT_CHUNK 64
+#define MAX_EVENTS 256
+#define MAX_WORKERS 64
+#define MAX_PIPELINE 16
+#define MAX_SEGS (2 * MAX_PIPELINE)
+#define SMALL_FILE (4 * BUF_SIZE)
+#define SENDFILE_MAX (1 << 30)
+#define FCACHE_ENTRIES 1024
+#define FCACHE_REVALIDATE 1
+#define CCACHE_BYTES (64 << 20)
+#define CCACHE_MAX_FILE (256 * 1024)
+#define IO_THREADS 4
+#define MAX_IO_THREADS 64
+#define MAX_CRYPTO_THREADS 64
+#define READAHEAD_WINDOW (1 << 20)
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024
+#define URING_BUF_SIZE BUF_SIZE
+#define SPLICE_CHUNK (256 * 1024)
+#define ARENA_SIZE BUF_SIZE
+#define BUF_CLASS_MIN BUF_SIZE
+#define BUF_BYTES (256 << 20)
+#define BUF_KEEP (4 << 20)
+#define LOG_RING (256 * 1024)
+#define LOG_LINE 1024
+#define LOG_FLUSH_MS 20
+#define ALOG_BUF (64 * 1024)
+#define ALOG_MAP (4 << 20)
+#define ALOG_FLUSH_SEC 1
+#define STATUS_URI "/server-status"
+#define CGI_WORKERS 32
+#define CGI_MIN_WORKERS 2
+#define CGI_IDLE_SEC 30
+#define CGI_ENV_MAX (32 * 1024)
+#define CGI_SCRIPTS 64
+#define CGI_ENV_VARS 256
+#define CGI_HEAD 8192
+#define CGI_READ (16 * 1024)
+#define CGI_WINDOW (64 * 1024)
+#define MAX_BODY (1LL << 30)
+#define TLS_RECORD (16 * 1024)
+#define TLS_CACHE_SLOTS 4096
+#define TLS_SESSION_MAX 1024
+#define TLS_SESSION_SEC 3600
+#define TLS_TICKET_SEC 3600
+#define TLS_RATE_SEC 10
+#define KEEPALIVE_TIMEOUT 15
+#define MAX_REQUESTS 100
 #define BUF_SIZE 4096
 #define MAX_PATH 4096
 #define MAX_LINE 8192
@@ -19,10 +68,27 @@ struct lisod_state
     int  s_port;
     int  sock;
     int  s_sock;
+    int  keepalive_timeout;     // seconds an idle connection is kept open
+    int  max_requests;          // requests served per connection
+    size_t cache_bytes;         // budget of the content cache
+    size_t buf_bytes;           // cap of the connection buffers
+    int  workers;               // number of worker processes
+    int  worker;                // number of this worker
+    int  pin_cpus;              // pin each worker to one CPU
+    int  io_threads;            // disk I/O threads per worker, 0 for none
+    int  crypto_threads;        // TLS handshake threads per worker, 0 for
+                                // none, -1 for the CPUs over the workers
+    int  use_uring;             // run the io_uring event loop, not epoll
+    int  alog_mmap;             // write the access log through a mapping
+    int  cgi_workers;           // most CGI workers per worker process
+    long long max_body;         // largest request body taken, in bytes
     char log_path[MAX_PATH];
+    char alog_path[MAX_PATH];   // access log, empty for none
     char lck_path[MAX_PATH];
     char www_path[MAX_PATH];
     char cgi_path[MAX_PATH];
+    char upload_path[MAX_PATH]; // folder POST bodies are stored in, empty
+                                // to drop them
     char key_path[MAX_PATH];
     char ctf_path[MAX_PATH];
 };
@@ -0,0 +1,354 @@
+/*
+ * scan.c
+ *
+ * Description: This file defines the request head scanner of Liso server.
+ *              The receive buffer is classified 64 bytes at a time into
+ *              bit masks of line feeds, colons and spaces, with SSE2 or AVX2
+ *              compares where the CPU has them and a byte loop otherwise.
+ *              The request line and header fields are then cut out of the
+ *              buffer by walking the set bits only: the spaces of the
+ *              request line, the first colon of each header line and the
+ *              line ends. Header names are matched against a small fixed
+ *              table, ignoring case.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* the bit masks of one 64 byte block */
+typedef struct
+{
+    uint64_t nl;                // '\n'
+    uint64_t colon;             // ':'
+    uint64_t space;             // ' '
+} masks_t;
+
+static void masks_scalar(const char *p, masks_t *m);
+#if defined(SCAN_X86) && defined(__SSE2__)
+static void masks_sse2(const char *p, masks_t *m);
+#endif
+#ifdef SCAN_X86
+static void masks_avx2(const char *p, masks_t *m);
+#endif
+
+static void (*get_masks)(const char *p, masks_t *m) = masks_scalar;
+
+/* the header fields the server looks at, names in lower case */
+static const struct
+{
+    const char *name;
+    size_t len;
+    int    id;
+} known[] =
+{
+    {"host",              4,  HDR_HOST},
+    {"connection",        10, HDR_CONNECTION},
+    {"content-length",    14, HDR_CONTENT_LENGTH},
+    {"content-type",      12, HDR_CONTENT_TYPE},
+    {"transfer-encoding", 17, HDR_TRANSFER_ENCODING},
+    {"expect",            6,  HDR_EXPECT},
+};
+
+static int  end_line(const char *line, const char *eol, const char *sp1,
+                     const char *sp2, const char *colon, scan_t *s);
+static slice_t trim(const char *ptr, const char *end);
+static int  header_id(slice_t name);
+
+/******************************************************************************
+* subroutine: scan_init                                                       *
+* purpose:    choose the instruction set the scanner uses                     *
+* parameters: isa - SCAN_AUTO for the best one the CPU has, or SCAN_SCALAR,   *
+*                   SCAN_SSE2, SCAN_AVX2                                      *
+* return:     the instruction set chosen, -1 if the CPU does not have it      *
+******************************************************************************/
+int scan_init(int isa)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (isa == SCAN_AUTO)
+        isa = __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+    if (isa == SCAN_AVX2 && !__builtin_cpu_supports("avx2"))
+        return -1;
+#ifndef __SSE2__
+    if (isa == SCAN_SSE2)
+        return -1;
+#endif
+#else
+    if (isa == SCAN_AUTO)
+        isa = SCAN_SCALAR;
+    if (isa != SCAN_SCALAR)
+        return -1;
+#endif
+
+    switch (isa)
+    {
+#ifdef SCAN_X86
+    case SCAN_AVX2:
+        get_masks = masks_avx2;
+        break;
+#endif
+#if defined(SCAN_X86) && defined(__SSE2__)
+    case SCAN_SSE2:
+        get_masks = masks_sse2;
+        break;
+#endif
+    default:
+        get_masks = masks_scalar;
+    }
+    return isa;
+}
+
+/******************************************************************************
+* subroutine: scan_head                                                       *
+* purpose:    scan a request head (request line, header lines, empty line)    *
+*             at the start of a buffer in one pass. Empty lines before the    *
+*             request line are skipped                                        *
+* parameters: buf - the received bytes                                        *
+*             len - number of bytes                                           *
+*             s   - where to put the result, pointing into buf                *
+* return:     SCAN_DONE, SCAN_AGAIN if the head is not complete yet,          *
+*             SCAN_ERROR if it is malformed, SCAN_TOO_MANY if it has more     *
+*             than SCAN_MAX_HEADERS header lines                              *
+******************************************************************************/
+int scan_head(const char *buf, size_t len, scan_t *s)
+{
+    const char *line = buf, *sp1 = NULL, *sp2 = NULL, *colon = NULL, *p;
+    char tail[64];
+    masks_t m;
+    uint64_t want;
+    size_t base;
+    int i, ret;
+
+    s->method.ptr = NULL;
+    s->nheaders = 0;
+
+    for (base = 0; base < len; base += 64)
+    {
+        // the last block is padded with NULs, which match nothing
+        if (len - base >= 64)
+            get_masks(buf + base, &m);
+        else
+        {
+            memset(tail, 0, sizeof tail);
+            memcpy(tail, buf + base, len - base);
+            get_masks(tail, &m);
+        }
+
+        // the request line wants its two spaces, a header line its first
+        // colon, every line its end
+        want = m.nl;
+        if (s->method.ptr == NULL && sp2 == NULL) want |= m.space;
+        if (s->method.ptr != NULL && colon == NULL) want |= m.colon;
+
+        while (want)
+        {
+            i = __builtin_ctzll(want);
+            p = buf + base + i;
+
+            if (*p == '\n')
+            {
+                if ((ret = end_line(line, p, sp1, sp2, colon, s)) != SCAN_AGAIN)
+                {
+                    s->len = p + 1 - buf;
+                    return ret;
+                }
+                line = p + 1;
+                sp1 = sp2 = colon = NULL;
+            }
+            else if (*p == ' ')
+            {
+                if (sp1 == NULL) sp1 = p;
+                else sp2 = p;
+            }
+            else
+                colon = p;
+
+            want = m.nl;
+            if (s->method.ptr == NULL && sp2 == NULL) want |= m.space;
+            if (s->method.ptr != NULL && colon == NULL) want |= m.colon;
+            want &= (i == 63) ? 0 : ~0ULL << (i + 1);
+        }
+    }
+    return SCAN_AGAIN;
+}
+
+/* case-insensitive compare with a lower case string */
+int slice_eq(slice_t a, const char *lower)
+{
+    size_t i;
+    char ch;
+
+    for (i = 0; i < a.len; i++)
+    {
+        ch = a.ptr[i];
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+        if (lower[i] == '\0' || ch != lower[i])
+            return 0;
+    }
+    return lower[i] == '\0';
+}
+
+/* case-insensitive search for a lower case string */
+int slice_has(slice_t a, const char *lower)
+{
+    size_t n = strlen(lower);
+    slice_t part;
+
+    for (part.ptr = a.ptr, part.len = n; part.ptr + n <= a.ptr + a.len; part.ptr++)
+        if (slice_eq(part, lower))
+            return 1;
+    return 0;
+}
+
+/* a non-negative decimal number, -1 if the slice is not one */
+long slice_tol(slice_t a)
+{
+    long n = 0;
+    size_t i;
+
+    if (a.len == 0 || a.len > 18)
+        return -1;
+    for (i = 0; i < a.len; i++)
+    {
+        if (a.ptr[i] < '0' || a.ptr[i] > '9')
+            return -1;
+        n = n * 10 + (a.ptr[i] - '0');
+    }
+    return n;
+}
+
+/******************************************************************************
+* subroutine: end_line                                                        *
+* purpose:    take a complete line apart                                      *
+* parameters: line  - its first byte                                          *
+*             eol   - its '\n'                                                *
+*             sp1, sp2 - the first two spaces, if it is the request line      *
+*             colon - the first colon, if it is a header line                 *
+*             s     - the scan result so far                                  *
+* return:     SCAN_AGAIN to go on, SCAN_DONE after the empty line ending the  *
+*             head, SCAN_ERROR or SCAN_TOO_MANY                               *
+******************************************************************************/
+static int end_line(const char *line, const char *eol, const char *sp1,
+                    const char *sp2, const char *colon, scan_t *s)
+{
+    const char *end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+    header_t *h;
+
+    if (s->method.ptr == NULL)
+    {
+        // tolerate empty lines before the request line
+        if (end == line)
+            return SCAN_AGAIN;
+        if (sp2 == NULL || sp1 == line || sp2 == sp1 + 1 || sp2 + 1 >= end)
+            return SCAN_ERROR;
+
+        s->method.ptr = line;
+        s->method.len = sp1 - line;
+        s->uri.ptr = sp1 + 1;
+        s->uri.len = sp2 - sp1 - 1;
+        s->version.ptr = sp2 + 1;
+        s->version.len = end - sp2 - 1;
+        return SCAN_AGAIN;
+    }
+
+    if (end == line)
+        return SCAN_DONE;
+    if (colon == NULL || colon == line)
+        return SCAN_ERROR;
+    if (s->nheaders == SCAN_MAX_HEADERS)
+        return SCAN_TOO_MANY;
+
+    h = &s->headers[s->nheaders++];
+    h->name.ptr = line;
+    h->name.len = colon - line;
+    h->value = trim(colon + 1, end);
+    h->id = header_id(h->name);
+    return SCAN_AGAIN;
+}
+
+/* the slice between ptr and end without leading and trailing white space */
+static slice_t trim(const char *ptr, const char *end)
+{
+    slice_t s;
+
+    while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+        ptr++;
+    while (end > ptr && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    s.ptr = ptr;
+    s.len = end - ptr;
+    return s;
+}
+
+static int header_id(slice_t name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof known / sizeof known[0]; i++)
+        if (name.len == known[i].len && slice_eq(name, known[i].name))
+            return known[i].id;
+    return HDR_OTHER;
+}
+
+static void masks_scalar(const char *p, masks_t *m)
+{
+    uint64_t bit;
+    int i;
+
+    m->nl = m->colon = m->space = 0;
+    for (i = 0; i < 64; i++)
+    {
+        bit = 1ULL << i;
+        if (p[i] == '\n') m->nl |= bit;
+        else if (p[i] == ':') m->colon |= bit;
+        else if (p[i] == ' ') m->space |= bit;
+    }
+}
+
+#if defined(SCAN_X86) && defined(__SSE2__)
+static void masks_sse2(const char *p, masks_t *m)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i space = _mm_set1_epi8(' ');
+    __m128i v;
+    uint64_t shift;
+    int i;
+
+    m->nl = m->colon = m->space = 0;
+    for (i = 0; i < 4; i++)
+    {
+        v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        shift = 16 * i;
+        m->nl |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << shift;
+        m->colon |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, colon)) << shift;
+        m->space |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, space)) << shift;
+    }
+}
+#endif
+
+#ifdef SCAN_X86
+__attribute__((target("avx2")))
+static void masks_avx2(const char *p, masks_t *m)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i space = _mm256_set1_epi8(' ');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+    m->nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)) |
+            (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+    m->colon = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, colon)) |
+               (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, colon)) << 32;
+    m->space = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, space)) |
+               (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, space)) << 32;
+}
+#endif
@@ -0,0 +1,50 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+#define SCAN_MAX_HEADERS 64
+
+/* a view into a buffer, not NUL-terminated */
+typedef struct
+{
+    const char *ptr;
+    size_t len;
+} slice_t;
+
+/* header fields the server looks at, matched case-insensitively; anything
+ * else is HDR_OTHER */
+enum { HDR_OTHER, HDR_HOST, HDR_CONNECTION, HDR_CONTENT_LENGTH,
+       HDR_CONTENT_TYPE, HDR_TRANSFER_ENCODING, HDR_EXPECT };
+
+typedef struct
+{
+    int     id;                 // HDR_*
+    slice_t name;
+    slice_t value;              // without the surrounding white space
+} header_t;
+
+/* a scanned request head. The slices point into the scanned buffer */
+typedef struct
+{
+    size_t  len;                // bytes of the head, empty line included
+    slice_t method;
+    slice_t uri;
+    slice_t version;
+    int     nheaders;
+    header_t headers[SCAN_MAX_HEADERS];
+} scan_t;
+
+/* return values of scan_head */
+enum { SCAN_TOO_MANY = -2, SCAN_ERROR = -1, SCAN_AGAIN = 0, SCAN_DONE = 1 };
+
+/* instruction sets for scan_init */
+enum { SCAN_AUTO, SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+int  scan_init(int isa);
+int  scan_head(const char *buf, size_t len, scan_t *s);
+int  slice_eq(slice_t a, const char *lower);
+int  slice_has(slice_t a, const char *lower);
+long slice_tol(slice_t a);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * scanbench.c
+ *
+ * Description: This file contains a microbenchmark of the request head
+ *              parser. It parses the same browser-like requests over and
+ *              over on one core, with the old line-at-a-time parser
+ *              (memchr() per line, sscanf() and strstr() per field) and
+ *              with the scanner of scan.c on each instruction set the CPU
+ *              has, and prints requests per second for each.
+ *
+ * Usage:       ./scanbench [-n requests]
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "scan.h"
+
+#define MAX_LINE 8192
+#define MIN_LINE 64
+
+/* typical requests: a bare one, a browser's, one with long cookies */
+static const char *samples[] =
+{
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "\r\n",
+
+    "GET /images/liso_header.png HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://www.example.com:8080/index.html\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n",
+
+    "POST /cgi-bin/form?id=42 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Cookie: session=8a7f6e5d4c3b2a1908f7e6d5c4b3a291; theme=dark; "
+    "tracking=0123456789abcdef0123456789abcdef0123456789abcdef\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 27\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+};
+
+#define NSAMPLES (sizeof samples / sizeof samples[0])
+
+/* what both parsers extract */
+typedef struct
+{
+    char method[MIN_LINE];
+    char uri[MAX_LINE];
+    char version[MIN_LINE];
+    int  port;
+    int  is_closed;
+    int  content_len;
+} request_t;
+
+/* the old parser: one line at a time out of the buffer, then sscanf() and
+ * strstr() on each line */
+static int old_getline(const char **pos, const char *end, char *buf)
+{
+    const char *eol;
+    size_t n;
+
+    if ((eol = memchr(*pos, '\n', end - *pos)) == NULL)
+        return 0;
+    n = eol - *pos + 1;
+    if (n >= MAX_LINE)
+        return -1;
+    memcpy(buf, *pos, n);
+    buf[n] = 0;
+    *pos += n;
+    return n;
+}
+
+static int old_parse(const char *req, size_t len, request_t *r)
+{
+    const char *pos = req, *end = req + len;
+    char buf[MAX_LINE], header[MIN_LINE], data[MIN_LINE], pbuf[MIN_LINE];
+
+    memset(r, 0, sizeof *r);
+    if (old_getline(&pos, end, buf) <= 0 ||
+        sscanf(buf, "%s %s %s", r->method, r->uri, r->version) < 3)
+        return -1;
+
+    r->content_len = -1;
+    do
+    {
+        if (old_getline(&pos, end, buf) <= 0)
+            return -1;
+        if (strstr(buf, "Host:") && sscanf(buf, "%s %[^:]:%s", header, data, pbuf) == 3)
+            r->port = (int)strtol(pbuf, NULL, 10);
+        if (strstr(buf, "Connection: close"))
+            r->is_closed = 1;
+        if (strstr(buf, "Content-Length") && sscanf(buf, "%s %s", header, data) > 0)
+            r->content_len = (int)strtol(data, NULL, 10);
+    } while (strcmp(buf, "\r\n"));
+    return 0;
+}
+
+/* the new one, applying the headers the way lisod does */
+static int new_parse(const char *req, size_t len, request_t *r)
+{
+    scan_t scan;
+    slice_t port;
+    const char *colon;
+    header_t *h;
+    int i;
+
+    if (scan_head(req, len, &scan) != SCAN_DONE ||
+        scan.method.len >= MIN_LINE || scan.version.len >= MIN_LINE)
+        return -1;
+
+    memcpy(r->method, scan.method.ptr, scan.method.len);
+    r->method[scan.method.len] = '\0';
+    memcpy(r->uri, scan.uri.ptr, scan.uri.len);
+    r->uri[scan.uri.len] = '\0';
+    memcpy(r->version, scan.version.ptr, scan.version.len);
+    r->version[scan.version.len] = '\0';
+    r->port = 0;
+    r->is_closed = 0;
+    r->content_len = -1;
+
+    for (i = 0; i < scan.nheaders; i++)
+    {
+        h = &scan.headers[i];
+        if (h->id == HDR_HOST &&
+            (colon = memchr(h->value.ptr, ':', h->value.len)) != NULL)
+        {
+            port.ptr = colon + 1;
+            port.len = h->value.ptr + h->value.len - port.ptr;
+            r->port = (int)slice_tol(port);
+        }
+        else if (h->id == HDR_CONNECTION && slice_has(h->value, "close"))
+            r->is_closed = 1;
+        else if (h->id == HDR_CONTENT_LENGTH)
+            r->content_len = (int)slice_tol(h->value);
+    }
+    return 0;
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* parse n requests round robin, return requests per second */
+static double run(int (*parse)(const char *, size_t, request_t *), long n)
+{
+    static request_t r;
+    size_t lens[NSAMPLES];
+    double start;
+    long i;
+
+    for (i = 0; i < NSAMPLES; i++)
+        lens[i] = strlen(samples[i]);
+
+    start = now();
+    for (i = 0; i < n; i++)
+    {
+        if (parse(samples[i % NSAMPLES], lens[i % NSAMPLES], &r) < 0)
+        {
+            fprintf(stderr, "parse error on sample %ld\n", i % NSAMPLES);
+            exit(EXIT_FAILURE);
+        }
+        // keep the compiler from dropping the work
+        __asm__ __volatile__("" : : "r"(&r) : "memory");
+    }
+    return n / (now() - start);
+}
+
+/* both parsers must agree before anything is timed */
+static void check()
+{
+    request_t a, b;
+    size_t i;
+
+    for (i = 0; i < NSAMPLES; i++)
+    {
+        old_parse(samples[i], strlen(samples[i]), &a);
+        new_parse(samples[i], strlen(samples[i]), &b);
+        if (strcmp(a.method, b.method) || strcmp(a.uri, b.uri) ||
+            strcmp(a.version, b.version) || a.port != b.port ||
+            a.is_closed != b.is_closed || a.content_len != b.content_len)
+        {
+            fprintf(stderr, "parsers disagree on sample %zu\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[] = {"auto", "scalar", "sse2", "avx2"};
+    long n = 3000000;
+    double base, rate;
+    int opt, isa;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        if (opt != 'n')
+        {
+            fprintf(stderr, "Usage: %s [-n requests]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        n = strtol(optarg, NULL, 10);
+    }
+
+    printf("%ld requests, %zu samples, one core\n", n, NSAMPLES);
+    base = run(old_parse, n);
+    printf("%-24s %12.0f req/s\n", "line parser (sscanf)", base);
+
+    for (isa = SCAN_SCALAR; isa <= SCAN_AVX2; isa++)
+    {
+        if (scan_init(isa) < 0)
+        {
+            printf("scan %-19s not supported\n", names[isa]);
+            continue;
+        }
+        check();
+        rate = run(new_parse, n);
+        printf("scan %-19s %12.0f req/s  %5.2fx\n", names[isa], rate, rate / base);
+    }
+    return 0;
+}
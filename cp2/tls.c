@@ -0,0 +1,521 @@
+/*
+ * tls.c
+ *
+ * Description: This file defines the TLS layer of Liso server, on OpenSSL:
+ *              the server context, and reads and writes that behave like
+ *              read() and write() on a non-blocking socket, so the event
+ *              loops drive a TLS connection the way they drive a plain one.
+ *
+ *              Returning clients resume their session instead of running a
+ *              full handshake, whichever worker they reach. Session ids
+ *              are looked up in a cache in shared memory, mapped before the
+ *              workers are forked; its slots are only ever tried, never
+ *              waited for. Session tickets are sealed with keys derived
+ *              from a secret made at start, a new key every TLS_TICKET_SEC,
+ *              so every worker seals and opens the same tickets without
+ *              talking to the others. A ticket sealed with the previous key
+ *              is still taken, and renewed.
+ *
+ *              After the handshake, the keys are handed to the kernel (kTLS)
+ *              where it can take them: a socket that encrypts in the kernel
+ *              is written like a plain one, files go out with sendfile().
+ *              Where it cannot, for the kernel or the cipher, OpenSSL keeps
+ *              doing the records in user space.
+ *
+ *              A full handshake is paused once OpenSSL has found it is one:
+ *              the ticket or session id of the ClientHello, if any, has been
+ *              tried by then and not taken. The step that answers it, with
+ *              the private-key work, is run on the crypto pool (tls_step());
+ *              a session that was resumed needs no such work and goes on in
+ *              the event loop. The callbacks of that step run on the pool
+ *              threads too.
+ *
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include "params.h"
+#include "log.h"
+#include "metrics.h"
+#include "tls.h"
+
+/* a slot of the shared session cache, taken by the hash of the session id */
+typedef struct
+{
+    atomic_int lock;            // 1 while a worker uses the slot
+    time_t expires;             // 0 if the slot is empty
+    unsigned idlen;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned len;
+    unsigned char der[TLS_SESSION_MAX];     // i2d_SSL_SESSION()
+} tslot_t;
+
+/* the ticket keys of one period */
+typedef struct
+{
+    long epoch;                 // time / TLS_TICKET_SEC, -1 before derived
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char mac[32];
+} tkey_t;
+
+static SSL_CTX *CTX;
+static tslot_t *CACHE;                  // TLS_CACHE_SLOTS, in shared memory
+static unsigned char SECRET[32];        // the ticket keys are derived from it
+static __thread tkey_t KEYS[2] = { { .epoch = -1 }, { .epoch = -1 } };
+static atomic_ulong HITS, MISSES;       // of the session cache, any thread
+static int POOLED;                      // full handshakes go to the pool
+static __thread int ON_POOL;            // running a step for the pool
+static unsigned long RATE[TLS_RATE_SEC];    // handshakes in each second
+static time_t RATE_AT;                  // the last second counted in RATE
+static tls_stats_t ST;
+
+static int  new_session(SSL *ssl, SSL_SESSION *sess);
+static SSL_SESSION *get_session(SSL *ssl, const unsigned char *id, int idlen,
+                                int *copy);
+static void remove_session(SSL_CTX *ctx, SSL_SESSION *sess);
+static tslot_t *lock_slot(const unsigned char *id, unsigned idlen);
+static int  ticket_key(SSL *ssl, unsigned char name[16], unsigned char *iv,
+                       EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc);
+static tkey_t *keys_of(long epoch);
+static int  full_handshake(SSL *ssl, void *arg);
+static void count_rate(time_t now, unsigned long n);
+static ssize_t fail(SSL *ssl, int ret);
+
+/******************************************************************************
+* subroutine: tls_init                                                        *
+* purpose:    create the server context from a private key and a certificate *
+*             chain (PEM), the shared session cache and the ticket secret.    *
+*             Called once, before the workers are forked                      *
+* parameters: key  - the private key file                                     *
+*             cert - the certificate chain file                               *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int tls_init(const char *key, const char *cert)
+{
+    char why[256];
+
+    if ((CTX = SSL_CTX_new(TLS_server_method())) == NULL)
+        goto Failed;
+
+    SSL_CTX_set_min_proto_version(CTX, TLS1_2_VERSION);
+    SSL_CTX_set_options(CTX, SSL_OP_NO_RENEGOTIATION |
+                        SSL_OP_CIPHER_SERVER_PREFERENCE |
+                        SSL_OP_NO_COMPRESSION |
+                        SSL_OP_IGNORE_UNEXPECTED_EOF |
+                        SSL_OP_ENABLE_KTLS);
+    // a write may end early and be retried with the queue as it is then;
+    // an idle connection keeps no record buffers
+    SSL_CTX_set_mode(CTX, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                     SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(CTX, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(CTX, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(CTX) != 1)
+        goto Failed;
+
+    // the session cache of all workers, instead of one per process
+    CACHE = mmap(NULL, TLS_CACHE_SLOTS * sizeof(tslot_t),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (CACHE == MAP_FAILED)
+    {
+        CACHE = NULL;
+        goto Failed;
+    }
+    SSL_CTX_set_session_id_context(CTX, (const unsigned char *)"lisod", 5);
+    SSL_CTX_set_session_cache_mode(CTX, SSL_SESS_CACHE_SERVER |
+                                   SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_set_timeout(CTX, TLS_SESSION_SEC);
+    SSL_CTX_sess_set_new_cb(CTX, new_session);
+    SSL_CTX_sess_set_get_cb(CTX, get_session);
+    SSL_CTX_sess_set_remove_cb(CTX, remove_session);
+    SSL_CTX_set_cert_cb(CTX, full_handshake, NULL);
+
+    if (RAND_bytes(SECRET, sizeof SECRET) != 1 ||
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(CTX, ticket_key) != 1)
+        goto Failed;
+    return 0;
+
+    Failed:
+    ERR_error_string_n(ERR_peek_last_error(), why, sizeof why);
+    Log("Error: TLS setup with %s and %s failed: %s \n", key, cert, why);
+    SSL_CTX_free(CTX);
+    CTX = NULL;
+    return -1;
+}
+
+/* a TLS session for an accepted connection, NULL on error */
+SSL *tls_new(int fd)
+{
+    SSL *ssl;
+
+    if ((ssl = SSL_new(CTX)) == NULL)
+        return NULL;
+    if (SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+/******************************************************************************
+* subroutine: tls_handshake                                                   *
+* purpose:    go on with the handshake of a connection as far as its socket   *
+*             allows, and count it once it is done                            *
+* parameters: ssl - the connection                                            *
+* return:     1 once the handshake is done, 0 while it waits for the socket   *
+*             (see tls_wants()), TLS_OFFLOAD when its next step is to run on  *
+*             the crypto pool (see tls_step()), -1 if it failed               *
+******************************************************************************/
+int tls_handshake(SSL *ssl)
+{
+    int ret, err;
+
+    ERR_clear_error();
+    if ((ret = SSL_do_handshake(ssl)) == 1)
+    {
+        ST.handshakes++;
+        metrics_count(C_TLS_HANDSHAKES, 1);
+        if (SSL_session_reused(ssl))
+        {
+            ST.resumed++;
+            metrics_count(C_TLS_RESUMED, 1);
+        }
+        if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+            metrics_count(C_TLS_KTLS_TX, 1);
+        if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+            metrics_count(C_TLS_KTLS_RX, 1);
+        count_rate(time(NULL), 1);
+        return 1;
+    }
+
+    err = SSL_get_error(ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        return 0;
+    if (err == SSL_ERROR_WANT_X509_LOOKUP)
+        return TLS_OFFLOAD;
+    metrics_count(C_TLS_FAILURES, 1);
+    LogDebug("TLS handshake failed: %s \n",
+             ERR_reason_error_string(ERR_peek_error()));
+    return -1;
+}
+
+/* full handshakes are paused for the crypto pool from now on (1), or not */
+void tls_use_pool(int on)
+{
+    POOLED = on;
+}
+
+/* a crypto pool thread: run the handshake step paused by tls_handshake().
+ * What comes of it is seen by the next tls_handshake() in the event loop,
+ * which goes on from where the step left the connection */
+void tls_step(SSL *ssl)
+{
+    ON_POOL = 1;
+    SSL_do_handshake(ssl);
+    ERR_clear_error();
+    ON_POOL = 0;
+}
+
+/* like read() on a non-blocking socket: the bytes read, 0 at the end of the
+ * stream, -1 with errno set, EAGAIN until the socket is ready (tls_wants()) */
+ssize_t tls_read(SSL *ssl, void *buf, size_t len)
+{
+    size_t n;
+    int ret;
+
+    ERR_clear_error();
+    if ((ret = SSL_read_ex(ssl, buf, len, &n)) == 1)
+        return n;
+    return fail(ssl, ret);
+}
+
+/* the same, without taking the bytes */
+ssize_t tls_peek(SSL *ssl, void *buf, size_t len)
+{
+    size_t n;
+    int ret;
+
+    ERR_clear_error();
+    if ((ret = SSL_peek_ex(ssl, buf, len, &n)) == 1)
+        return n;
+    return fail(ssl, ret);
+}
+
+/* like write(): the bytes taken, maybe fewer than len, or -1 with errno.
+ * After EAGAIN the write is retried with the same bytes at the front */
+ssize_t tls_write(SSL *ssl, const void *buf, size_t len)
+{
+    size_t n;
+    int ret;
+
+    ERR_clear_error();
+    if ((ret = SSL_write_ex(ssl, buf, len, &n)) == 1)
+        return n;
+    return fail(ssl, ret);
+}
+
+/* which directions of a connection the kernel encrypts, KTLS_TX and KTLS_RX;
+ * a socket that does TX takes plaintext write()s, sendmsg()s and sendfile()s
+ * as application data */
+int tls_kernel(SSL *ssl)
+{
+    return (BIO_get_ktls_send(SSL_get_wbio(ssl)) ? KTLS_TX : 0) |
+           (BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? KTLS_RX : 0);
+}
+
+/* 1 if OpenSSL holds bytes of the connection that the socket no longer has */
+int tls_pending(SSL *ssl)
+{
+    return SSL_has_pending(ssl);
+}
+
+/* what the connection waits for after EAGAIN (or a handshake returning 0),
+ * POLLIN or POLLOUT */
+int tls_wants(SSL *ssl)
+{
+    return SSL_want_write(ssl) ? POLLOUT : POLLIN;
+}
+
+/* end a connection, with a close_notify if the socket takes it right away */
+void tls_close(SSL *ssl)
+{
+    if (SSL_is_init_finished(ssl))
+        SSL_shutdown(ssl);
+    ERR_clear_error();
+    SSL_free(ssl);
+}
+
+void tls_stats(tls_stats_t *stats)
+{
+    time_t now = time(NULL);
+    unsigned long sum = 0;
+    int i;
+
+    count_rate(now, 0);
+    for (i = 0; i < TLS_RATE_SEC; i++)
+        sum += RATE[i];
+    *stats = ST;
+    stats->cache_hits = atomic_load_explicit(&HITS, memory_order_relaxed);
+    stats->cache_misses = atomic_load_explicit(&MISSES, memory_order_relaxed);
+    stats->rate = (double)sum / TLS_RATE_SEC;
+}
+
+/* errno for a failed SSL_*_ex() call */
+static ssize_t fail(SSL *ssl, int ret)
+{
+    switch (SSL_get_error(ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:         // close_notify, or EOF (ignored)
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0)
+            errno = ECONNRESET;
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/* n more handshakes in the second now, forgetting the seconds that went by
+ * without any */
+static void count_rate(time_t now, unsigned long n)
+{
+    time_t t;
+
+    for (t = RATE_AT + 1; t <= now && t <= RATE_AT + TLS_RATE_SEC; t++)
+        RATE[t % TLS_RATE_SEC] = 0;
+    if (now > RATE_AT)
+        RATE_AT = now;
+    RATE[now % TLS_RATE_SEC] += n;
+}
+
+/* the slot of a session id, locked, or NULL if another worker has it */
+static tslot_t *lock_slot(const unsigned char *id, unsigned idlen)
+{
+    uint32_t h = 2166136261u;           // FNV-1a
+    tslot_t *s;
+    unsigned i;
+
+    for (i = 0; i < idlen; i++)
+        h = (h ^ id[i]) * 16777619u;
+    s = &CACHE[h % TLS_CACHE_SLOTS];
+    if (atomic_exchange_explicit(&s->lock, 1, memory_order_acquire))
+        return NULL;
+    return s;
+}
+
+static void unlock_slot(tslot_t *s)
+{
+    atomic_store_explicit(&s->lock, 0, memory_order_release);
+}
+
+/* a new session: into the cache, over whatever had its slot */
+static int new_session(SSL *ssl, SSL_SESSION *sess)
+{
+    const unsigned char *id;
+    unsigned char *p;
+    unsigned idlen;
+    tslot_t *s;
+    int len;
+
+    id = SSL_SESSION_get_id(sess, &idlen);
+    len = i2d_SSL_SESSION(sess, NULL);
+    if (len <= 0 || len > TLS_SESSION_MAX || (s = lock_slot(id, idlen)) == NULL)
+        return 0;
+    p = s->der;
+    s->len = i2d_SSL_SESSION(sess, &p);
+    s->idlen = idlen;
+    memcpy(s->id, id, idlen);
+    s->expires = time(NULL) + SSL_SESSION_get_timeout(sess);
+    unlock_slot(s);
+    return 0;                           // OpenSSL keeps no reference
+}
+
+/* a client offers a session id: the session, if the cache still has it */
+static SSL_SESSION *get_session(SSL *ssl, const unsigned char *id, int idlen,
+                                int *copy)
+{
+    SSL_SESSION *sess = NULL;
+    const unsigned char *p;
+    tslot_t *s;
+
+    *copy = 0;
+    if ((s = lock_slot(id, idlen)) != NULL)
+    {
+        if (s->expires > time(NULL) && s->idlen == (unsigned)idlen &&
+            memcmp(s->id, id, idlen) == 0)
+        {
+            p = s->der;
+            sess = d2i_SSL_SESSION(NULL, &p, s->len);
+        }
+        unlock_slot(s);
+    }
+    atomic_fetch_add_explicit(sess ? &HITS : &MISSES, 1, memory_order_relaxed);
+    return sess;
+}
+
+static void remove_session(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    const unsigned char *id;
+    unsigned idlen;
+    tslot_t *s;
+
+    id = SSL_SESSION_get_id(sess, &idlen);
+    if ((s = lock_slot(id, idlen)) == NULL)
+        return;
+    if (s->idlen == idlen && memcmp(s->id, id, idlen) == 0)
+        s->expires = 0;
+    unlock_slot(s);
+}
+
+/******************************************************************************
+* subroutine: ticket_key                                                      *
+* purpose:    OpenSSL's ticket key callback: seal a new ticket with the key  *
+*             of this period, or open one sealed in this period or the last  *
+* parameters: ssl  - the connection                                           *
+*             name - the key name in the ticket, set when enc                 *
+*             iv   - the IV, made up when enc                                 *
+*             ectx - cipher context to set up                                 *
+*             hctx - HMAC context to set up                                   *
+*             enc  - 1 to seal, 0 to open                                     *
+* return:     1 on success, 2 to have the ticket renewed, 0 for a key that   *
+*             is gone (a full handshake follows), -1 on error                 *
+******************************************************************************/
+static int ticket_key(SSL *ssl, unsigned char name[16], unsigned char *iv,
+                      EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+{
+    static char digest[] = "SHA256";
+    long now = time(NULL) / TLS_TICKET_SEC;
+    OSSL_PARAM params[3];
+    tkey_t *k;
+
+    if (enc)
+    {
+        if ((k = keys_of(now)) == NULL ||
+            RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1)
+            return -1;
+        memcpy(name, k->name, sizeof k->name);
+        if (EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv) != 1)
+            return -1;
+    }
+    else
+    {
+        if ((k = keys_of(now)) == NULL || memcmp(name, k->name, 16) != 0)
+            if ((k = keys_of(now - 1)) == NULL ||
+                memcmp(name, k->name, 16) != 0)
+                return 0;
+        if (EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv) != 1)
+            return -1;
+    }
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, k->mac,
+                                                  sizeof k->mac);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 digest, 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+        return -1;
+    return enc || k->epoch == now ? 1 : 2;
+}
+
+/* OpenSSL's certificate callback, which it only calls for a full handshake,
+ * after the ClientHello's ticket or session id failed to resume: pause the
+ * handshake for the crypto pool. A bad or expired ticket does not keep the
+ * private-key work in the event loop */
+static int full_handshake(SSL *ssl, void *arg)
+{
+    return !POOLED || ON_POOL ? 1 : -1;
+}
+
+/* the ticket keys of a period, HMAC-SHA256 of the secret over a label and
+ * the period, the same in every worker; every thread derives its own copy */
+static tkey_t *keys_of(long epoch)
+{
+    static const char *LABELS[3] = { "name", "aes", "mac" };
+    tkey_t *k = &KEYS[epoch & 1];
+    unsigned char msg[16], md[EVP_MAX_MD_SIZE], *out[3];
+    size_t sizes[3] = { sizeof k->name, sizeof k->aes, sizeof k->mac };
+    unsigned mdlen;
+    int i;
+
+    if (k->epoch == epoch)
+        return k;
+    out[0] = k->name;
+    out[1] = k->aes;
+    out[2] = k->mac;
+    for (i = 0; i < 3; i++)
+    {
+        memset(msg, 0, sizeof msg);
+        strcpy((char *)msg, LABELS[i]);
+        memcpy(msg + 8, &epoch, sizeof epoch);
+        if (HMAC(EVP_sha256(), SECRET, sizeof SECRET, msg, sizeof msg, md,
+                 &mdlen) == NULL)
+        {
+            k->epoch = -1;
+            return NULL;
+        }
+        memcpy(out[i], md, sizes[i]);
+    }
+    k->epoch = epoch;
+    return k;
+}
@@ -0,0 +1,38 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+/* what the TLS layer of a worker has seen */
+typedef struct
+{
+    unsigned long handshakes;   // completed
+    unsigned long resumed;      // of those, with a resumed session
+    double rate;                // handshakes per second, over the last
+                                // TLS_RATE_SEC seconds
+    unsigned long cache_hits;   // session ids found in the shared cache
+    unsigned long cache_misses;
+} tls_stats_t;
+
+/* the directions of a connection that the kernel took over (kTLS) */
+enum { KTLS_TX = 1, KTLS_RX = 2 };
+
+/* tls_handshake(): the next step is for the crypto pool */
+#define TLS_OFFLOAD 2
+
+int  tls_init(const char *key, const char *cert);
+SSL *tls_new(int fd);
+int  tls_handshake(SSL *ssl);
+void tls_use_pool(int on);
+void tls_step(SSL *ssl);
+ssize_t tls_read(SSL *ssl, void *buf, size_t len);
+ssize_t tls_peek(SSL *ssl, void *buf, size_t len);
+ssize_t tls_write(SSL *ssl, const void *buf, size_t len);
+int  tls_kernel(SSL *ssl);
+int  tls_pending(SSL *ssl);
+int  tls_wants(SSL *ssl);
+void tls_close(SSL *ssl);
+void tls_stats(tls_stats_t *stats);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * uring.c
+ *
+ * Description: This file defines a minimal io_uring wrapper for Liso server,
+ *              written against the raw system calls: ring setup and mapping,
+ *              getting submission entries, submitting (and waiting), walking
+ *              the completion ring, and a ring of provided buffers for
+ *              receives. What the operations mean is up to the caller.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+/******************************************************************************
+* subroutine: uring_init                                                      *
+* purpose:    set up a ring and register its provided buffers                 *
+* parameters: r        - the ring to set up                                   *
+*             entries  - submission queue size (power of two)                 *
+*             nbufs    - number of provided buffers (power of two)            *
+*             buf_size - size of each                                         *
+* return:     0 on success, -1 with errno set on error (ENOSYS, EPERM: no     *
+*             io_uring on this system)                                        *
+******************************************************************************/
+int uring_init(uring_t *r, unsigned entries, unsigned nbufs, unsigned buf_size)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_len, cq_len, br_len;
+    char *sq, *cq;
+    unsigned i;
+
+    memset(r, 0, sizeof *r);
+
+    // one thread submits and reaps; completions may wait for our next
+    // io_uring_enter() instead of interrupting us
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN |
+              IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    if ((r->fd = sys_setup(entries, &p)) < 0)
+    {
+        // older kernels know fewer flags
+        memset(&p, 0, sizeof p);
+        if ((r->fd = sys_setup(entries, &p)) < 0)
+            return -1;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto Fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else if ((cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd,
+                        IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto Fail;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto Fail;
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_local = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // entry i of the ring always holds sqe i
+    for (i = 0; i < p.sq_entries; i++)
+        r->sq_array[i] = i;
+
+    // the provided buffer ring is shared with the kernel as well
+    br_len = nbufs * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED || (r->bufs = malloc((size_t)nbufs * buf_size)) == NULL)
+        goto Fail;
+    r->br_mask = nbufs - 1;
+    r->buf_size = buf_size;
+
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long)r->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BGID;
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto Fail;
+
+    for (i = 0; i < nbufs; i++)
+        uring_buf_return(r, i);
+    return 0;
+
+    Fail:
+    close(r->fd);
+    return -1;
+}
+
+/******************************************************************************
+* subroutine: uring_sqe                                                       *
+* purpose:    get a cleared submission entry, submitting the queued ones      *
+*             first if the queue is full                                      *
+* parameters: r - the ring                                                    *
+* return:     the entry, NULL if the queue stays full                         *
+******************************************************************************/
+struct io_uring_sqe *uring_sqe(uring_t *r)
+{
+    struct io_uring_sqe *sqe;
+
+    if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_mask)
+    {
+        uring_submit(r, 0);
+        if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_mask)
+            return NULL;
+    }
+
+    sqe = &r->sqes[r->sq_local & r->sq_mask];
+    r->sq_local++;
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+/******************************************************************************
+* subroutine: uring_submit                                                    *
+* purpose:    hand the queued entries to the kernel and wait for completions  *
+* parameters: r       - the ring                                              *
+*             wait_nr - completions to wait for, 0 to return right away       *
+* return:     number of entries submitted, -1 with errno set on error (EINTR  *
+*             when a signal arrived while waiting)                            *
+******************************************************************************/
+int uring_submit(uring_t *r, unsigned wait_nr)
+{
+    unsigned pending;
+
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    pending = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    return sys_enter(r->fd, pending, wait_nr,
+                     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/* the next completion, NULL if there is none; uring_cqe_seen() releases it */
+struct io_uring_cqe *uring_cqe(uring_t *r)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* the provided buffer a receive completion refers to */
+char *uring_buf(uring_t *r, unsigned bid)
+{
+    return r->bufs + (size_t)bid * r->buf_size;
+}
+
+/* give a provided buffer back to the kernel once its data is consumed */
+void uring_buf_return(uring_t *r, unsigned bid)
+{
+    unsigned short tail = r->br->tail;
+    struct io_uring_buf *buf = &r->br->bufs[tail & r->br_mask];
+
+    buf->addr = (unsigned long)uring_buf(r, bid);
+    buf->len = r->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&r->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,39 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+
+/* an io_uring instance, set up with the raw system calls. Besides the
+ * submission and completion rings it owns a ring of provided buffers (group
+ * URING_BGID) that receives pick from, so an idle connection has no buffer
+ * waiting on it */
+typedef struct
+{
+    int       fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned  sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned  sq_local;         // our copy of the tail, published on submit
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;   // provided buffers
+    unsigned  br_mask;
+    char     *bufs;             // nbufs buffers of buf_size bytes each
+    unsigned  buf_size;
+} uring_t;
+
+#define URING_BGID 0
+
+int  uring_init(uring_t *r, unsigned entries, unsigned nbufs, unsigned buf_size);
+struct io_uring_sqe *uring_sqe(uring_t *r);
+int  uring_submit(uring_t *r, unsigned wait_nr);
+struct io_uring_cqe *uring_cqe(uring_t *r);
+void uring_cqe_seen(uring_t *r);
+char *uring_buf(uring_t *r, unsigned bid);
+void uring_buf_return(uring_t *r, unsigned bid);
+
+#endif